@@ -0,0 +1,79 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace tuya {
+namespace bench {
+
+/* number of heap allocations so far, counted by the operator new replacement in main.cpp */
+size_t allocationCount();
+
+template <typename T>
+inline void doNotOptimize(const T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+class State {
+public:
+    State(size_t iterations) : mIterations(iterations), mNs(0), mAllocations(0) {}
+
+    /* run op once to warm up caches and scratch buffers, then measure mIterations runs */
+    template <typename F>
+    void measure(F&& op) {
+        op();
+
+        const size_t allocations = allocationCount();
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < mIterations; i++)
+            op();
+        const auto end = std::chrono::steady_clock::now();
+
+        mAllocations = allocationCount() - allocations;
+        mNs = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    }
+
+    size_t iterations() const {
+        return mIterations;
+    }
+
+    double nsPerOp() const {
+        return mIterations ? (double) mNs / mIterations : 0;
+    }
+
+    double allocationsPerOp() const {
+        return mIterations ? (double) mAllocations / mIterations : 0;
+    }
+
+private:
+    size_t mIterations;
+    uint64_t mNs;
+    size_t mAllocations;
+};
+
+struct Benchmark {
+    std::string name;
+    std::function<void(State&)> run;
+};
+
+inline std::vector<Benchmark>& benchmarks() {
+    static std::vector<Benchmark> sBenchmarks;
+    return sBenchmarks;
+}
+
+struct Registration {
+    Registration(const char* name, void (*run)(State&)) {
+        benchmarks().push_back({name, run});
+    }
+};
+
+} // namespace bench
+} // namespace tuya
+
+#define BENCHMARK(name) \
+    static void name(tuya::bench::State& state); \
+    static tuya::bench::Registration name##_registration(#name, name); \
+    static void name(tuya::bench::State& state)
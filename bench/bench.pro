@@ -0,0 +1,20 @@
+TEMPLATE = app
+CONFIG += console c++14
+CONFIG -= app_bundle qt
+
+include(../tuyacpp.pri)
+
+HEADERS += \
+    bench.hpp
+
+SOURCES += \
+    main.cpp \
+    bench_cipher.cpp \
+    bench_crc.cpp \
+    bench_device.cpp \
+    bench_dps.cpp \
+    bench_logging.cpp \
+    bench_loop.cpp \
+    bench_message55aa.cpp \
+    bench_message6699.cpp \
+    bench_registry.cpp
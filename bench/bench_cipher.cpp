@@ -0,0 +1,100 @@
+#include "bench.hpp"
+
+#include "protocol/cipher.hpp"
+
+using namespace tuya;
+using bench::State;
+
+#ifdef TUYACPP_USE_MBEDTLS
+    #define CIPHER_BENCHMARK(name) BENCHMARK(cipher_mbedtls_##name)
+#else
+    #define CIPHER_BENCHMARK(name) BENCHMARK(cipher_openssl_##name)
+#endif
+
+namespace {
+
+Cipher cipher("0123456789abcdef");
+
+void encrypt(State& state, size_t len) {
+    const std::string plain(len, 'x');
+    std::string out;
+    out.reserve(Cipher::paddedLength(len));
+
+    state.measure([&] {
+        out.clear();
+        cipher.encrypt(plain.data(), plain.length(), out);
+        bench::doNotOptimize(out);
+    });
+}
+
+void decrypt(State& state, size_t len) {
+    std::string encrypted;
+    cipher.encrypt(std::string(len, 'x').data(), len, encrypted);
+    std::string out;
+    out.reserve(encrypted.length());
+
+    state.measure([&] {
+        out.clear();
+        cipher.decrypt(encrypted.data(), encrypted.length(), out);
+        bench::doNotOptimize(out);
+    });
+}
+
+} // namespace
+
+/* about the size of a CONTROL command */
+CIPHER_BENCHMARK(encrypt_100) {
+    encrypt(state, 100);
+}
+
+CIPHER_BENCHMARK(decrypt_100) {
+    decrypt(state, 100);
+}
+
+CIPHER_BENCHMARK(encrypt_1000) {
+    encrypt(state, 1000);
+}
+
+CIPHER_BENCHMARK(decrypt_1000) {
+    decrypt(state, 1000);
+}
+
+/* the HMAC of 3.4 frames and the AES-GCM of 3.5 frames, both about the size of a CONTROL
+ * command
+ */
+CIPHER_BENCHMARK(hmac_100) {
+    const std::string data(100, 'x');
+    unsigned char mac[Cipher::HMAC_SIZE];
+
+    state.measure([&] {
+        cipher.hmac(data.data(), data.length(), mac);
+        bench::doNotOptimize(mac);
+    });
+}
+
+CIPHER_BENCHMARK(gcm_encrypt_100) {
+    const unsigned char iv[Cipher::GCM_IV_SIZE] = { 0 };
+    const char aad[14] = { 0 };
+    const std::string plain(100, 'x');
+    std::string out(plain.length(), '\0');
+    unsigned char tag[Cipher::GCM_TAG_SIZE];
+
+    state.measure([&] {
+        cipher.gcmEncrypt(iv, aad, sizeof(aad), plain.data(), &out[0], plain.length(), tag);
+        bench::doNotOptimize(out);
+    });
+}
+
+CIPHER_BENCHMARK(gcm_decrypt_100) {
+    const unsigned char iv[Cipher::GCM_IV_SIZE] = { 0 };
+    const char aad[14] = { 0 };
+    std::string encrypted(100, 'x');
+    unsigned char tag[Cipher::GCM_TAG_SIZE];
+    cipher.gcmEncrypt(iv, aad, sizeof(aad), encrypted.data(), &encrypted[0], encrypted.length(), tag);
+    std::string out(encrypted.length(), '\0');
+
+    state.measure([&] {
+        cipher.gcmDecrypt(iv, aad, sizeof(aad), encrypted.data(), &out[0], encrypted.length(), tag);
+        bench::doNotOptimize(out);
+    });
+}
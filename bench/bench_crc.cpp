@@ -0,0 +1,46 @@
+#include "bench.hpp"
+
+#include "protocol/crc32.hpp"
+
+using namespace tuya;
+using bench::State;
+
+namespace {
+
+void crc32(State& state, size_t len) {
+    const std::string data(len, 'x');
+
+    state.measure([&] {
+        uint32_t crc = Crc32::calculate(data.data(), data.length());
+        bench::doNotOptimize(crc);
+    });
+}
+
+void slicingBy8(State& state, size_t len) {
+    const std::string data(len, 'x');
+
+    state.measure([&] {
+        uint32_t crc = ~Crc32::slicingBy8(~0u, reinterpret_cast<const uint8_t*>(data.data()), data.length());
+        bench::doNotOptimize(crc);
+    });
+}
+
+} // namespace
+
+/* header and payload of a typical STATUS frame, with the implementation picked at runtime */
+BENCHMARK(crc32_128) {
+    crc32(state, 128);
+}
+
+BENCHMARK(crc32_1024) {
+    crc32(state, 1024);
+}
+
+/* the portable fallback */
+BENCHMARK(crc32_slicing_by_8_128) {
+    slicingBy8(state, 128);
+}
+
+BENCHMARK(crc32_slicing_by_8_1024) {
+    slicingBy8(state, 1024);
+}
@@ -0,0 +1,186 @@
+#include "bench.hpp"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "device.hpp"
+
+using namespace tuya;
+using bench::State;
+
+namespace {
+
+const char* KEY = "0123456789abcdef";
+
+/* Plays the bulb on the other end of a socketpair(): answers every frame that the device
+ * has sent so far like a bulb would. Everything runs in the benchmark thread.
+ */
+class Peer {
+public:
+    Peer(int fd) : mFd(fd), mCipher(KEY) {}
+
+    ~Peer() {
+        close(mFd);
+    }
+
+    void serve() {
+        char buf[4096];
+        int ret;
+        while ((ret = recv(mFd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+            mRxBuffer.append(buf, ret);
+
+        while (true) {
+            const size_t frameLen = Message55AA::frameLength(mRxBuffer.data(), mRxBuffer.size());
+            if (!frameLen || (mRxBuffer.size() < frameLen))
+                break;
+
+            uint32_t parsedLen = 0;
+            Message55AA msg(mRxBuffer.data(), frameLen, parsedLen, mCipher, true);
+            mRxBuffer.erase(0, frameLen);
+            if (msg.cmd() == Message::CONTROL)
+                mControls.push_back(*Message::findDps(msg.data()));
+
+            const ordered_json reply = (msg.cmd() == Message::DP_QUERY)
+                ? ordered_json{{"devId", "bf0123456789abcdefghij"}, {"dps", {{"20", true}, {"22", 500}}}}
+                : ordered_json::object();
+            push(Message55AA(msg.seqNo(), msg.cmd(), reply).serialize(mCipher, false));
+        }
+    }
+
+    void push(const std::string& frame) {
+        if (send(mFd, frame.data(), frame.length(), 0) != (ssize_t) frame.length())
+            throw std::runtime_error("send failed");
+    }
+
+    Cipher& cipher() {
+        return mCipher;
+    }
+
+    /* the "dps" of the CONTROL frames received so far, in order */
+    std::vector<ordered_json>& controls() {
+        return mControls;
+    }
+
+private:
+    const int mFd;
+    Cipher mCipher;
+    std::string mRxBuffer;
+    std::vector<ordered_json> mControls;
+};
+
+/* a device connected to a peer on a socketpair(), with the DP_QUERY on connect answered */
+struct Connection {
+    Connection() : device(loop, "192.168.0.1", "bench", "bf0123456789abcdefghij", "bf0123456789abcdefghij", KEY),
+                   peer(pair(device)) {
+        /* the query is written at the end of the first loop iteration */
+        while (device.dps().empty()) {
+            loop.loop(0, LogStream::INFO);
+            peer.serve();
+            loop.loop(1, LogStream::INFO);
+        }
+    }
+
+    static int pair(Device& device) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+            throw std::runtime_error("socketpair failed");
+        device.adopt(fds[0]);
+        return fds[1];
+    }
+
+    Loop loop;
+    Device device;
+    Peer peer;
+};
+
+} // namespace
+
+/* sendCommand() until its callback has run: serialize, encrypt, send, the bulb's reply
+ * is parsed, decrypted and matched to the command
+ */
+BENCHMARK(device_send_command_socketpair) {
+    /* keep the connect message out of the results */
+    LogStream::setLevel("DEVICE", LogStream::WARNING);
+
+    Connection conn;
+    Loop& loop = conn.loop;
+
+    int brightness = 10;
+    state.measure([&] {
+        bool done = false;
+        conn.device.sendCommand(Message::CONTROL, ordered_json{{"22", brightness}}, [&done] (Device::CommandStatus status, const ordered_json&) {
+            if (status != Device::CMD_OK)
+                throw std::runtime_error("command failed");
+            done = true;
+        });
+        brightness = (brightness < 1000) ? brightness + 1 : 10;
+
+        /* the frame is written at the end of the loop iteration */
+        loop.loop(0, LogStream::INFO);
+        conn.peer.serve();
+        while (!done)
+            loop.loop(1000, LogStream::INFO);
+    });
+
+    LogStream::setLevel("DEVICE", LogStream::INFO);
+}
+
+/* a write followed by a transaction on the same datapoint until both have been answered,
+ * the bulb has to see them in the order they were made
+ */
+BENCHMARK(device_write_then_commit_socketpair) {
+    LogStream::setLevel("DEVICE", LogStream::WARNING);
+
+    Connection conn;
+    Loop& loop = conn.loop;
+    auto& controls = conn.peer.controls();
+
+    state.measure([&] {
+        bool done = false;
+        controls.clear();
+        conn.device.setOn(false);
+        conn.device.begin().setOn(true).commit([&done] (Device::CommandStatus status, const ordered_json&) {
+            if (status != Device::CMD_OK)
+                throw std::runtime_error("command failed");
+            done = true;
+        });
+
+        while (!done) {
+            loop.loop(0, LogStream::INFO);
+            conn.peer.serve();
+            loop.loop(1, LogStream::INFO);
+        }
+
+        if ((controls.size() != 2) || (controls[0].value("20", true) != false) || (controls[1].value("20", false) != true))
+            throw std::runtime_error("CONTROL frames out of order");
+    });
+
+    LogStream::setLevel("DEVICE", LogStream::INFO);
+}
+
+/* a STATUS update pushed by the bulb until the device has it: read, frame parsing,
+ * decryption, Device::handleMessage() and the datapoints decoded into its store
+ */
+BENCHMARK(device_receive_status_socketpair) {
+    LogStream::setLevel("DEVICE", LogStream::WARNING);
+
+    Connection conn;
+
+    /* the frames are prepared up front, only the receiving side is measured */
+    std::vector<std::string> frames;
+    for (int brightness = 10; brightness <= 1000; brightness++) {
+        const ordered_json data = {{"devId", "bf0123456789abcdefghij"}, {"dps", {{"20", true}, {"22", brightness}}}, {"t", 1700000000}};
+        frames.push_back(Message55AA(0, Message::STATUS, data).serialize(conn.peer.cipher(), false));
+    }
+
+    size_t i = 0;
+    state.measure([&] {
+        const int brightness = 10 + (int) i;
+        conn.peer.push(frames[i]);
+        i = (i + 1) % frames.size();
+        while (conn.device.brightness() != brightness)
+            conn.loop.loop(1000, LogStream::INFO);
+    });
+
+    LogStream::setLevel("DEVICE", LogStream::INFO);
+}
@@ -0,0 +1,56 @@
+#include "bench.hpp"
+
+#include "protocol/dps.hpp"
+
+using namespace tuya;
+using bench::State;
+
+namespace {
+
+const ordered_json QUERY = {{"20", true}, {"21", "white"}, {"22", 500}, {"23", 500}, {"24", "000003e803e8"}, {"25", "000e0d0000000000000000c80000"}, {"26", 0}};
+const ordered_json STATUS = {{"22", 510}};
+
+} // namespace
+
+/* a STATUS update with one datapoint */
+BENCHMARK(dps_update_status) {
+    DpsStore store;
+    store.assign(QUERY);
+
+    state.measure([&] {
+        store.update(STATUS);
+    });
+}
+
+/* the same update of the json tree the device used to keep */
+BENCHMARK(dps_update_status_json) {
+    ordered_json dps = QUERY;
+
+    state.measure([&] {
+        dps.update(STATUS);
+    });
+}
+
+/* what a dashboard polls: switch and brightness */
+BENCHMARK(dps_poll) {
+    DpsStore store;
+    store.assign(QUERY);
+
+    state.measure([&] {
+        bool on = store.getBool(20);
+        int64_t brightness = store.getInt(22);
+        bench::doNotOptimize(on);
+        bench::doNotOptimize(brightness);
+    });
+}
+
+BENCHMARK(dps_poll_json) {
+    ordered_json dps = QUERY;
+
+    state.measure([&] {
+        bool on = dps.contains("20") && dps["20"].get<bool>();
+        int64_t brightness = dps.contains("22") ? dps["22"].get<int64_t>() : 0;
+        bench::doNotOptimize(on);
+        bench::doNotOptimize(brightness);
+    });
+}
@@ -0,0 +1,59 @@
+#include "bench.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include "logging.hpp"
+
+using namespace tuya;
+using bench::State;
+using ordered_json = nlohmann::ordered_json;
+
+namespace {
+
+class Logger {
+public:
+    void logPayload(const ordered_json& payload) {
+        TUYACPP_LOGD() << "payload: " << payload.dump() << std::endl;
+    }
+
+    void logSent(int bytes, const std::string& ip) {
+        TUYACPP_LOGI() << "sent " << bytes << " bytes to " << ip << std::endl;
+    }
+
+private:
+    LOG_MEMBERS(BENCH);
+};
+
+} // namespace
+
+/* a disabled debug statement whose argument is expensive to build */
+BENCHMARK(log_debug_disabled) {
+    const ordered_json payload = {{"devId", "bf0123456789abcdefghij"}, {"dps", {{"20", true}, {"22", 500}}}};
+    Logger logger;
+
+    state.measure([&] {
+        logger.logPayload(payload);
+    });
+}
+
+/* cost of an enabled statement for the logging thread, the records are written to a sink
+ * that discards them
+ */
+BENCHMARK(log_info_enabled) {
+    class NullSink : public LogSink {
+        virtual void write(const LogEntry&) override {}
+    };
+    LogBackend::instance().flush();
+    LogBackend::instance().clearSinks();
+    LogBackend::instance().addSink(std::make_unique<NullSink>());
+
+    const std::string ip = "192.168.0.10";
+    Logger logger;
+    state.measure([&] {
+        logger.logSent(42, ip);
+    });
+
+    LogBackend::instance().flush();
+    LogBackend::instance().clearSinks();
+    LogBackend::instance().addSink(std::make_unique<StdoutSink>());
+}
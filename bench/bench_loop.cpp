@@ -0,0 +1,134 @@
+#include "bench.hpp"
+
+#include <atomic>
+#include <thread>
+
+#include "loop/loop.hpp"
+
+using namespace tuya;
+using bench::State;
+
+namespace {
+
+/* loop that runs in its own thread, so that the benchmark thread is a foreign thread */
+class LoopThread {
+public:
+    LoopThread() : mRunning(true), mThread([this] () {
+        while (mRunning)
+            mLoop.loop(1000, LogStream::INFO);
+    }) {}
+
+    ~LoopThread() {
+        mRunning = false;
+        mLoop.wakeUp();
+        mThread.join();
+    }
+
+    Loop& loop() {
+        return mLoop;
+    }
+
+private:
+    Loop mLoop;
+    std::atomic_bool mRunning;
+    std::thread mThread;
+};
+
+void waitFor(const std::atomic<size_t>& counter, size_t value) {
+    while (counter.load() < value)
+        std::this_thread::yield();
+}
+
+class CountingHandler : public Handler {
+public:
+    virtual void handleRead(ReadEvent& e) override {
+        mBytes += e.length;
+    }
+
+    size_t mBytes = 0;
+};
+
+const size_t NUM_HANDLERS = 500;
+const int FIRST_FD = 1000;
+
+/* send READ events to fds FIRST_FD ... FIRST_FD + NUM_HANDLERS - 1 in turn */
+void dispatch(State& state, Loop& loop) {
+    static const std::string addr = "192.168.0.1";
+    static const char data[16] = { 0 };
+    int fd = FIRST_FD;
+
+    state.measure([&] {
+        loop.handleEvent(ReadEvent(fd, data, sizeof(data), addr, LogStream::INFO));
+        if (++fd == FIRST_FD + (int) NUM_HANDLERS)
+            fd = FIRST_FD;
+    });
+}
+
+} // namespace
+
+/* cost of post() for the posting thread, while the loop thread drains concurrently */
+BENCHMARK(loop_post_foreign_thread) {
+    LoopThread thread;
+    std::atomic<size_t> done(0);
+
+    state.measure([&] {
+        thread.loop().post([&done] () { done++; });
+    });
+    waitFor(done, state.iterations() + 1);
+}
+
+/* a burst of 500 posts from a foreign thread until the last one has run in the loop */
+BENCHMARK(loop_post_burst_500) {
+    static const size_t BURST = 500;
+    LoopThread thread;
+    std::atomic<size_t> done(0);
+    size_t expected = 0;
+
+    state.measure([&] {
+        for (size_t i = 0; i < BURST; i++)
+            thread.loop().post([&done] () { done++; });
+        expected += BURST;
+        waitFor(done, expected);
+    });
+}
+
+/* every handler is subscribed to the READ events of its own fd */
+BENCHMARK(loop_dispatch_500_fd_subscribers) {
+    Loop loop;
+    std::vector<CountingHandler> handlers(NUM_HANDLERS);
+    for (size_t i = 0; i < NUM_HANDLERS; i++)
+        loop.attach(&handlers[i], Event::mask(Event::READ), FIRST_FD + i);
+
+    dispatch(state, loop);
+}
+
+/* every handler gets every event, as all extra handlers did before subscriptions */
+BENCHMARK(loop_dispatch_500_all_subscribers) {
+    Loop loop;
+    std::vector<CountingHandler> handlers(NUM_HANDLERS);
+    for (auto& handler : handlers)
+        loop.attach(&handler);
+
+    dispatch(state, loop);
+}
+
+/* an iteration of the loop without any work or ready fds */
+BENCHMARK(loop_iteration_idle) {
+    Loop loop;
+
+    state.measure([&] {
+        loop.loop(0, LogStream::INFO);
+    });
+}
+
+/* schedule work from the loop thread and run it in the next iteration */
+BENCHMARK(loop_push_work_and_run) {
+    Loop loop;
+    size_t done = 0;
+
+    state.measure([&] {
+        loop.pushWork([&done] () { done++; });
+        loop.loop(0, LogStream::INFO);
+    });
+    bench::doNotOptimize(done);
+}
@@ -0,0 +1,146 @@
+#include "bench.hpp"
+
+#include "protocol/dps.hpp"
+#include "protocol/message55aa.hpp"
+
+using namespace tuya;
+using bench::State;
+
+namespace {
+
+Cipher localCipher("0123456789abcdef");
+/* 3.4 frames are encrypted and authenticated with a session key */
+Cipher sessionCipher("fedcba9876543210");
+
+/* typical reply of a bulb to a CONTROL command */
+const ordered_json statusData = {
+    {"devId", "bf0123456789abcdefghij"},
+    {"dps", {{"20", true}, {"22", 500}}},
+    {"t", 1700000000},
+};
+
+/* the same from a 3.4 or 3.5 bulb */
+const ordered_json v34StatusData = {
+    {"protocol", 4},
+    {"t", 1700000000},
+    {"data", {{"dps", {{"20", true}, {"22", 500}}}}},
+};
+
+/* typical reply of a bulb to DP_QUERY */
+const ordered_json dpQueryData = {
+    {"devId", "bf0123456789abcdefghij"},
+    {"dps", {
+        {"20", true},
+        {"21", "white"},
+        {"22", 1000},
+        {"23", 500},
+        {"24", "000003e803e8"},
+        {"25", "000e0d0000000000000000c80000"},
+        {"26", 0},
+    }},
+};
+
+std::string frame(uint32_t cmd, const ordered_json& data, Message::Version version = Message::V3_3) {
+    return Message55AA(1, cmd, data, version).serialize((version >= Message::V3_4) ? sessionCipher : localCipher, false);
+}
+
+enum ParseMode {
+    FRAME_ONLY,         // check and decrypt
+    DOM,                // and build the DOM with aliases, as data() does
+    DPS,                // and decode the datapoints into a store, as Device does
+};
+
+void parse(State& state, const std::string& raw, ParseMode mode = FRAME_ONLY, Message::Version version = Message::V3_3) {
+    DpsStore store;
+    Cipher& cipher = (version >= Message::V3_4) ? sessionCipher : localCipher;
+
+    state.measure([&] {
+        uint32_t parsedLen = 0;
+        Message55AA msg(raw.data(), raw.length(), parsedLen, cipher, false, version);
+        if (mode == DOM)
+            bench::doNotOptimize(msg.data());
+        else if (mode == DPS)
+            msg.decodeDps(store);
+        bench::doNotOptimize(msg);
+    });
+}
+
+} // namespace
+
+BENCHMARK(message55aa_parse_status) {
+    parse(state, frame(Message::STATUS, statusData));
+}
+
+BENCHMARK(message55aa_parse_dp_query) {
+    parse(state, frame(Message::DP_QUERY, dpQueryData));
+}
+
+/* STATUS frames as the device handles them, and with the DOM that all frames used to get */
+BENCHMARK(message55aa_parse_status_dps) {
+    parse(state, frame(Message::STATUS, statusData), DPS);
+}
+
+BENCHMARK(message55aa_parse_status_dom) {
+    parse(state, frame(Message::STATUS, statusData), DOM);
+}
+
+BENCHMARK(message55aa_parse_dp_query_dps) {
+    parse(state, frame(Message::DP_QUERY, dpQueryData), DPS);
+}
+
+BENCHMARK(message55aa_parse_dp_query_dom) {
+    parse(state, frame(Message::DP_QUERY, dpQueryData), DOM);
+}
+
+/* a CONTROL command as sent by Device::sendCommand() */
+BENCHMARK(message55aa_serialize_control) {
+    Message55AA msg(1, Message::CONTROL, ordered_json{
+        {"devId", "bf0123456789abcdefghij"}, {"uid", "bf0123456789abcdefghij"}, {"t", "1700000000"}, {"dps", {{"22", 500}}}
+    });
+
+    state.measure([&] {
+        std::string raw = msg.serialize(localCipher, true);
+        bench::doNotOptimize(raw);
+    });
+}
+
+BENCHMARK(message55aa_serialize_dp_query) {
+    Message55AA msg(1, Message::DP_QUERY, dpQueryData);
+
+    state.measure([&] {
+        std::string raw = msg.serialize(localCipher, false);
+        bench::doNotOptimize(raw);
+    });
+}
+
+/* into a buffer that is reused, like a connection's send buffer */
+BENCHMARK(message55aa_serialize_control_to_buffer) {
+    Message55AA msg(1, Message::CONTROL, ordered_json{
+        {"devId", "bf0123456789abcdefghij"}, {"uid", "bf0123456789abcdefghij"}, {"t", "1700000000"}, {"dps", {{"22", 500}}}
+    });
+    std::string buffer;
+
+    state.measure([&] {
+        buffer.clear();
+        msg.serializeTo(buffer, localCipher, true);
+        bench::doNotOptimize(buffer);
+    });
+}
+
+/* the same for 3.4 frames, which carry an HMAC instead of a CRC */
+BENCHMARK(message55aa_v34_parse_status_dps) {
+    parse(state, frame(Message::STATUS, v34StatusData, Message::V3_4), DPS, Message::V3_4);
+}
+
+BENCHMARK(message55aa_v34_serialize_to_buffer) {
+    Message55AA msg(1, Message::CONTROL_NEW, ordered_json{
+        {"protocol", 5}, {"t", 1700000000}, {"data", {{"dps", {{"22", 500}}}}}
+    }, Message::V3_4);
+    std::string buffer;
+
+    state.measure([&] {
+        buffer.clear();
+        msg.serializeTo(buffer, sessionCipher, true);
+        bench::doNotOptimize(buffer);
+    });
+}
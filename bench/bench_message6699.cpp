@@ -0,0 +1,46 @@
+#include "bench.hpp"
+
+#include "protocol/dps.hpp"
+#include "protocol/message6699.hpp"
+
+using namespace tuya;
+using bench::State;
+
+namespace {
+
+Cipher sessionCipher("fedcba9876543210");
+
+/* reply of a 3.5 bulb to a CONTROL_NEW command */
+const ordered_json statusData = {
+    {"protocol", 4},
+    {"t", 1700000000},
+    {"data", {{"dps", {{"20", true}, {"22", 500}}}}},
+};
+
+} // namespace
+
+/* compare with message55aa_parse_status_dps and message55aa_v34_parse_status_dps */
+BENCHMARK(message6699_parse_status_dps) {
+    const std::string raw = Message6699(1, Message::STATUS, statusData).serialize(sessionCipher, false);
+    DpsStore store;
+
+    state.measure([&] {
+        uint32_t parsedLen = 0;
+        Message6699 msg(raw.data(), raw.length(), parsedLen, sessionCipher, false);
+        msg.decodeDps(store);
+        bench::doNotOptimize(msg);
+    });
+}
+
+BENCHMARK(message6699_serialize_control_to_buffer) {
+    Message6699 msg(1, Message::CONTROL_NEW, ordered_json{
+        {"protocol", 5}, {"t", 1700000000}, {"data", {{"dps", {{"22", 500}}}}}
+    });
+    std::string buffer;
+
+    state.measure([&] {
+        buffer.clear();
+        msg.serializeTo(buffer, sessionCipher, true);
+        bench::doNotOptimize(buffer);
+    });
+}
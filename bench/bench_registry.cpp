@@ -0,0 +1,56 @@
+#include "bench.hpp"
+
+#include <map>
+
+#include "deviceregistry.hpp"
+
+using namespace tuya;
+using bench::State;
+
+namespace {
+
+const size_t DEVICES = 4096;
+
+std::string ipOf(size_t i) {
+    return "10.0." + std::to_string(i / 256) + "." + std::to_string(i % 256);
+}
+
+} // namespace
+
+/* what discovery and Qt signals need: the device of an address */
+BENCHMARK(registry_find_by_ip_4096) {
+    DeviceRegistry registry;
+    for (size_t i = 0; i < DEVICES; i++)
+        registry.add(ipOf(i), "dev" + std::to_string(i));
+
+    size_t i = 0;
+    state.measure([&] {
+        auto handle = registry.findByIp(ipOf(i++ % DEVICES));
+        bench::doNotOptimize(handle);
+    });
+}
+
+/* the std::map keyed by IP strings the scanner used before */
+BENCHMARK(registry_string_map_find_4096) {
+    std::map<std::string, std::shared_ptr<Device>> devices;
+    for (size_t i = 0; i < DEVICES; i++)
+        devices[ipOf(i)] = nullptr;
+
+    size_t i = 0;
+    state.measure([&] {
+        auto it = devices.find(ipOf(i++ % DEVICES));
+        bench::doNotOptimize(it);
+    });
+}
+
+BENCHMARK(registry_find_by_fd_4096) {
+    DeviceRegistry registry;
+    for (size_t i = 0; i < DEVICES; i++)
+        registry.setFd(registry.add(ipOf(i), std::string()), 100 + i);
+
+    size_t i = 0;
+    state.measure([&] {
+        auto handle = registry.findByFd(100 + i++ % DEVICES);
+        bench::doNotOptimize(handle);
+    });
+}
@@ -0,0 +1,81 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "bench.hpp"
+
+static std::atomic<size_t> sAllocations(0);
+
+void* operator new(size_t size) {
+    sAllocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+size_t tuya::bench::allocationCount() {
+    return sAllocations.load(std::memory_order_relaxed);
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-n iterations] [-j] [filter]\n", name);
+    fprintf(stderr, "  -j    print the results as JSON\n");
+}
+
+int main(int argc, char* argv[]) {
+    size_t iterations = 100000;
+    const char* filter = nullptr;
+    bool json = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && (i + 1 < argc)) {
+            iterations = strtoul(argv[++i], nullptr, 0);
+        } else if (!strcmp(argv[i], "-j")) {
+            json = true;
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            filter = argv[i];
+        }
+    }
+
+    /* one object per benchmark, so that results of different versions can be compared */
+    if (json)
+        printf("[\n");
+    else
+        printf("%-40s %12s %12s %12s\n", "benchmark", "iterations", "ns/op", "allocs/op");
+
+    bool first = true;
+    for (const auto& b : tuya::bench::benchmarks()) {
+        if (filter && !strstr(b.name.c_str(), filter))
+            continue;
+
+        tuya::bench::State state(iterations);
+        b.run(state);
+        if (json) {
+            printf("%s  {\"name\": \"%s\", \"iterations\": %zu, \"ns_per_op\": %.1f, \"allocs_per_op\": %.2f}",
+                   first ? "" : ",\n", b.name.c_str(), state.iterations(), state.nsPerOp(), state.allocationsPerOp());
+        } else {
+            printf("%-40s %12zu %12.1f %12.2f\n", b.name.c_str(), state.iterations(), state.nsPerOp(), state.allocationsPerOp());
+        }
+        fflush(stdout);
+        first = false;
+    }
+
+    if (json)
+        printf("%s]\n", first ? "" : "\n");
+
+    return 0;
+}
@@ -17,7 +17,7 @@ public:
     /* workaround to initialize mLoop before SocketHandler, which needs an initialized loop as argument */
     TuyaWorker() : mScanner(mLoop) {
         mRunning = true;
-        mLoop.attach(this);
+        mLoop.attach(this, Event::mask(Event::CONNECTED) | Event::mask(Event::MESSAGE) | Event::mask(Event::CLOSING));
     }
 
     ~TuyaWorker() {
@@ -53,12 +53,18 @@ public:
             try {
                 mLoop.loop();
             } catch (const std::runtime_error& e) {
-                LOGE() << "runtime error: " << e.what() << std::endl;
+                TUYACPP_LOGE() << "runtime error: " << e.what() << std::endl;
                 return;
             }
         }
     }
 
+    /* hides QThread::start(), the loop has to know that it is run by another thread from now on */
+    void start(Priority priority = InheritPriority) {
+        mLoop.setThreaded();
+        QThread::start(priority);
+    }
+
     void stop() {
         mRunning = false;
         mLoop.wakeUp();
@@ -1,4 +0,0 @@
-INCLUDEPATH += $$PWD/CRCpp/inc
-
-HEADERS += \
-    $$PWD/CRCpp/inc/CRC.h
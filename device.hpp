@@ -1,10 +1,15 @@
 #pragma once
 
+#include <algorithm>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <string>
+#include <vector>
 
 #include "loop/tcpclienthandler.hpp"
+#include "protocol/dps.hpp"
+#include "protocol/session.hpp"
 #include <nlohmann/json.hpp>
 using ordered_json = nlohmann::ordered_json;
 
@@ -12,143 +17,333 @@ using ordered_json = nlohmann::ordered_json;
 namespace tuya {
 
 class Device : public TCPClientHandler {
+    static const size_t MAX_PENDING_COMMANDS = 32;
+    static const size_t FRAME_SIZE_HINT = 256;
+    static const uint32_t COMMAND_TIMEOUT_MS = 3000;
+    static const uint32_t NEGOTIATION_TIMEOUT_MS = 3000;
+
+    /* DPS keys depend on the device state, so they are only looked up in the loop thread */
+    enum DpsField {
+        DPS_RAW,
+        DPS_SWITCH,
+        DPS_BRIGHTNESS,
+        DPS_COLOR_TEMP,
+    };
+
+    struct DpsWrite {
+        DpsField field;
+        std::string key;
+        ordered_json value;
+    };
+
 public:
     enum CommandStatus {
         CMD_OK,
         CMD_ERR_DISCONNECTED,
+        CMD_ERR_TIMEOUT,
+        CMD_ERR_BUSY,
+        CMD_ERR_INVALID,
     };
 
     typedef std::function<void(CommandStatus, const ordered_json&)> Callback_t;
 
-    Device(Loop &loop, const std::string& ip, const std::string& name, const std::string& gwId, const std::string& devId, const std::string& key) :
+    Device(Loop &loop, const std::string& ip, const std::string& name, const std::string& gwId, const std::string& devId, const std::string& key,
+           Message::Version version = Message::V3_3) :
         TCPClientHandler(loop, ip, 6668, key), mTag("DEVICE " + ip), mIp(ip), mName(name), mGwId(gwId), mDevId(devId), mLocalKey(key), mSeqNo(1)
     {
+        setVersion(version);
     }
 
-    bool isOn() {
-        const auto& key = switchKey();
-        if (key.length())
-            return mDps[key];
-        return false;
+    ~Device() {
+        for (const auto& cmd : mCommands)
+            mLoop.cancel(cmd.timer);
+        mLoop.cancel(mFlushTimer);
+        mLoop.cancel(mNegotiationTimer);
+    }
+
+    /* The state of the device as of the last DP_QUERY response and STATUS update. The
+     * datapoints of the switch, brightness and color temperature are resolved when the
+     * device reports new datapoints, so these getters don't allocate.
+     */
+    bool isOn() const {
+        return mSwitchDp && mDps.getBool(mSwitchDp);
+    }
+
+    /* in units of brightnessScale(), 0 if the device has no brightness */
+    int brightness() const {
+        return mBrightnessDp ? (int) mDps.getInt(mBrightnessDp) : 0;
     }
 
+    /* in units of colorTempScale(), 0 if the device has no color temperature */
+    int colorTemp() const {
+        return mColorTempDp ? (int) mDps.getInt(mColorTempDp) : 0;
+    }
+
+    const DpsStore& dps() const {
+        return mDps;
+    }
+
+    /* Batch of DPS writes that is sent as a single CONTROL command on commit(), e.g.
+     * device.begin().setOn(true).setBrightness(500).commit(cb);
+     */
+    class Transaction {
+    public:
+        Transaction& set(const std::string& key, const ordered_json& value) {
+            mWrites.push_back({DPS_RAW, key, value});
+            return *this;
+        }
+
+        Transaction& setOn(bool b) {
+            mWrites.push_back({DPS_SWITCH, "", b});
+            return *this;
+        }
+
+        Transaction& setBrightness(int brightness) {
+            mWrites.push_back({DPS_BRIGHTNESS, "", brightness});
+            return *this;
+        }
+
+        Transaction& setColorTemp(int colorTemp) {
+            mWrites.push_back({DPS_COLOR_TEMP, "", colorTemp});
+            return *this;
+        }
+
+        int commit(Callback_t cb = nullptr) {
+            if (mWrites.empty())
+                return mDevice.fail(-EINVAL, cb);
+            return mDevice.commitDps(mWrites, cb);
+        }
+
+    private:
+        friend class Device;
+
+        Transaction(Device& device) : mDevice(device) {}
+
+        Device& mDevice;
+        std::vector<DpsWrite> mWrites;
+    };
+
+    Transaction begin() {
+        return Transaction(*this);
+    }
+
+    /* Writes from setOn(), toggle(), setBrightness() and setColorTemp() that are issued within
+     * the same loop iteration are coalesced into a single CONTROL command.
+     *
+     * Commands can be issued from any thread, calls from outside the loop thread are posted
+     * to it. Errors of calls with a callback are always reported through it, and never before
+     * the call has returned, which then returns 0. Without a callback, calls from the loop
+     * thread return them.
+     */
     int setOn(bool b, Callback_t cb = nullptr) {
-        const auto& key = switchKey();
-        if (key.length())
-            return sendCommand(Message::CONTROL, ordered_json{{key, b}}, cb);
-        return -EINVAL;
+        if (!mLoop.isLoopThread())
+            return postToLoop([this, b, cb] () { return setOn(b, cb); });
+        return writeDps(switchKey(), b, cb);
     }
 
     int toggle(Callback_t cb = nullptr) {
+        if (!mLoop.isLoopThread())
+            return postToLoop([this, cb] () { return toggle(cb); });
         const auto& key = switchKey();
-        if (key.length())
-            return sendCommand(Message::CONTROL, ordered_json{{key, !mDps[key]}}, cb);
-        return -EINVAL;
+        if (!key.length())
+            return fail(-EINVAL, cb);
+        if (mPendingDps.contains(key))
+            return writeDps(key, !mPendingDps[key], cb);
+        return writeDps(key, !isOn(), cb);
     }
 
     int setBrightness(int brightness, Callback_t cb = nullptr) {
+        if (!mLoop.isLoopThread())
+            return postToLoop([this, brightness, cb] () { return setBrightness(brightness, cb); });
         const auto& key = brightnessKey();
-        if (key == "2")
-            brightness = std::max(brightness, 25);
-        if (key.length())
-            return sendCommand(Message::CONTROL, ordered_json{{key, brightness}}, cb);
-        return -EINVAL;
+        return writeDps(key, limitBrightness(key, brightness), cb);
     }
 
     int setColorTemp(int colorTemp, Callback_t cb = nullptr) {
-        const auto& key = colorTempKey();
-        if (key.length())
-            return sendCommand(Message::CONTROL, ordered_json{{key, colorTemp}}, cb);
-        return -EINVAL;
+        if (!mLoop.isLoopThread())
+            return postToLoop([this, colorTemp, cb] () { return setColorTemp(colorTemp, cb); });
+        return writeDps(colorTempKey(), colorTemp, cb);
     }
 
     virtual void handleMessage(MessageEvent& e) override {
         const auto& msg = e.msg;
-        const auto& msgStr = static_cast<std::string>(msg);
-        if ((msg.seqNo() == mCmdCtx.seqNo) && (msg.cmd() == static_cast<uint32_t>(mCmdCtx.command))) {
-            EV_LOGI(e) << "response to command " << msg.cmdString() << " from " << e.addr << ": " << msgStr << std::endl;
-            mCmdCtx.seqNo = 0;
-            if (mCmdCtx.callback != nullptr)
-                mCmdCtx.callback(CMD_OK, msg.data());
+        if (msg.cmd() == Message::SESS_KEY_NEG_RESP) {
+            handleNegotiation(e);
+            return;
+        }
+
+        auto cmd = findCommand(msg.seqNo());
+        if ((cmd != mCommands.end()) && cmd->sent && (msg.cmd() == static_cast<uint32_t>(cmd->command))) {
+            TUYACPP_EV_LOGD(e) << "response to command " << msg.cmdString() << " from " << e.addr << ": " << static_cast<std::string>(msg) << std::endl;
+            completeCommand(cmd, CMD_OK, msg.data());
         } else if (msg.cmd() == Message::STATUS) {
-            mDps.update(msg.data()["dps"]);
+            updateDps(msg);
+        } else if (msg.cmd() == Message::HEART_BEAT) {
+            TUYACPP_EV_LOGD(e) << "heartbeat from " << e.addr << std::endl;
         } else {
-            EV_LOGI(e) << "new message from " << e.addr << ": " << msgStr << std::endl;
+            TUYACPP_EV_LOGI(e) << "new message from " << e.addr << ": " << static_cast<std::string>(msg) << std::endl;
         }
     }
 
     virtual void handleConnected(ConnectedEvent& e) override {
         TCPClientHandler::handleConnected(e);
 
-        sendCommand(Message::DP_QUERY, ordered_json(), [this](CommandStatus status, const ordered_json& data) {
-            if (status == CMD_OK) {
-                mDps = data["dps"];
-            } else {
-                LOGE() << "command failed, error " << status << std::endl;
-            }
-        });
+        if (version() >= Message::V3_4)
+            startNegotiation();
+        else
+            startSession();
+    }
+
+    virtual void handleTxDrained() override {
+        flushCommands();
+    }
+
+    /* devices with queued commands connect before the others */
+    virtual bool isConnectUrgent() const override {
+        return !mCommands.empty();
+    }
+
+    /* not before the session is established, the negotiation has its own timeout */
+    virtual int sendHeartbeat() override {
+        if (!isSessionEstablished())
+            return -EAGAIN;
+
+        auto msg = Session::message(version(), mSeqNo++, Message::HEART_BEAT, ordered_json{{"gwId", mGwId}, {"devId", mDevId}});
+        int ret = queueTx(FRAME_SIZE_HINT, [this, &msg] (std::string& out) { msg->serializeTo(out, mCipher, true); });
+        if (ret == 0)
+            scheduleFlushTx();
+        return ret;
     }
 
     virtual void handleClose(CloseEvent& e) override {
+        if (!isConnected() || (e.fd != mSocketFd))
+            return;
         TCPClientHandler::handleClose(e);
 
-        if (mCmdCtx.seqNo) {
-            mCmdCtx.seqNo = 0;
-            if (mCmdCtx.callback != nullptr)
-                mCmdCtx.callback(CMD_ERR_DISCONNECTED, ordered_json());
+        mSessionState = SESSION_NONE;
+        mLoop.cancel(mNegotiationTimer);
+        mNegotiationTimer = TimerQueue::INVALID_HANDLE;
+
+        /* commands that were sent will not get a response anymore, the ones that are still
+         * queued are sent after reconnecting unless they time out before
+         */
+        std::vector<Callback_t> callbacks;
+        for (auto it = mCommands.begin(); it != mCommands.end();) {
+            if (it->sent) {
+                mLoop.cancel(it->timer);
+                callbacks.push_back(std::move(it->callback));
+                it = mCommands.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (auto& callback : callbacks) {
+            if (callback != nullptr)
+                callback(CMD_ERR_DISCONNECTED, ordered_json());
         }
     }
 
-    /* sendRaw() can be called from outside the loop thread because only read operations
-     * are performed in the loop thread and socket read and write operations are
-     * independent
+    /* sendRaw() bypasses the command queue and must only be called from the loop thread,
+     * use sendCommand() from other threads. The message is buffered if the socket is full.
      */
     int sendRaw(const std::string& message) {
         if (!isConnected()) {
-            LOGE() << "failed to send message: not connected" << std::endl;
+            TUYACPP_LOGE() << "failed to send message: not connected" << std::endl;
             return -ENOTCONN;
         }
 
-        int ret = send(mSocketFd, message.data(), message.length(), 0);
-        if (ret <= 0) {
-            LOGE() << "failed to send message" << std::endl;
-            return -1;
-        } else if ((unsigned) ret != message.length()) {
-            LOGE() << "failed to send message" << std::endl;
-            return -1;
+        int ret = queueTx(message.data(), message.length());
+        if (ret == 0)
+            ret = flushTx();
+        if (ret < 0) {
+            TUYACPP_LOGE() << "failed to send message" << std::endl;
+            return ret;
         }
 
-        LOGI() << "sent " << ret << " bytes to " << mIp << std::endl;
+        TUYACPP_LOGD() << "queued " << message.length() << " bytes for " << mIp << std::endl;
 
         return 0;
     }
 
+    /* Commands are queued and sent right away when connected, or as soon as the connection
+     * is established otherwise, which includes the session key negotiation of 3.4 and 3.5
+     * devices. Several commands can be in flight at the same time, responses are matched by
+     * their sequence number. While the connection is congested, commands wait in the queue
+     * until the send buffer has drained. Queued commands are only serialized when they are
+     * sent, with the key of the session they are sent in.
+     */
     int sendCommand(Message::Command command, const ordered_json& data = ordered_json(), Callback_t callback = nullptr) {
-        if (mCmdCtx.seqNo != 0) {
-            LOGE() << "Command already in progress" << std::endl;
-            return -EBUSY;
-        }
-
-        mCmdCtx.seqNo = mSeqNo++;
-        mCmdCtx.command = command;
-        mCmdCtx.callback = callback;
-
-        auto payload = ordered_json{
-            {"gwId", mDevId}, {"devId", mDevId}, {"uid", mDevId}, {"t", std::to_string((uint32_t) time(NULL))}
-        };
-        if (command != Message::DP_QUERY)
-            payload.erase("gwId");
-        if (!data.is_null())
-            payload["dps"] = data;
-        std::unique_ptr<Message> msg = std::make_unique<Message55AA>(mCmdCtx.seqNo, command, payload);
-        LOGI() << "sending command " << msg->cmdString() << " with payload: " << payload.dump() << std::endl;
-        mLoop.pushWork([this, seqno=mCmdCtx.seqNo] () {
-            if (mCmdCtx.seqNo == seqno) {
-                LOGE() << "timeout" << std::endl;
+        if (!mLoop.isLoopThread())
+            return postToLoop([this, command, data, callback] () { return sendCommand(command, data, callback); });
+
+        if (mCommands.size() >= MAX_PENDING_COMMANDS) {
+            TUYACPP_LOGE() << "too many pending commands" << std::endl;
+            return fail(-EBUSY, callback);
+        }
+
+        const uint32_t seqNo = mSeqNo++;
+
+        /* 3.4 and later devices take CONTROL_NEW with the datapoints under "data" and answer
+         * DP_QUERY_NEW instead of DP_QUERY
+         */
+        ordered_json payload;
+        if ((version() >= Message::V3_4) && (command == Message::CONTROL)) {
+            command = Message::CONTROL_NEW;
+            payload = ordered_json{
+                {"protocol", 5}, {"t", (uint32_t) time(NULL)}, {"data", {{"dps", data}}}
+            };
+        } else {
+            payload = ordered_json{
+                {"gwId", mDevId}, {"devId", mDevId}, {"uid", mDevId}, {"t", std::to_string((uint32_t) time(NULL))}
+            };
+            if (command != Message::DP_QUERY)
+                payload.erase("gwId");
+            if (!data.is_null())
+                payload["dps"] = data;
+            if ((version() >= Message::V3_4) && (command == Message::DP_QUERY))
+                command = Message::DP_QUERY_NEW;
+        }
+        std::unique_ptr<Message> msg = Session::message(version(), seqNo, command, payload);
+        TUYACPP_LOGD() << "queueing command " << msg->cmdString() << " with payload: " << payload.dump() << std::endl;
+        auto timer = mLoop.pushWork([this, seqNo] () {
+            auto cmd = findCommand(seqNo);
+            if (cmd == mCommands.end())
+                return;
+
+            TUYACPP_LOGE() << "timeout" << std::endl;
+            bool sent = cmd->sent;
+            completeCommand(cmd, CMD_ERR_TIMEOUT, ordered_json());
+            if (sent)
                 mLoop.handleEvent(CloseEvent(mSocketFd, mIp, LogStream::INFO));
+        }, COMMAND_TIMEOUT_MS);
+
+        /* Unless it has to wait behind other commands, the frame goes straight into the send
+         * buffer, which is flushed after this loop iteration together with the frames of
+         * other commands issued in the meantime.
+         */
+        if (isSessionEstablished() && !isTxCongested() && (mCommands.empty() || mCommands.back().sent)) {
+            int ret = queueTx(FRAME_SIZE_HINT, [this, &msg] (std::string& out) { msg->serializeTo(out, mCipher, true); });
+            if (ret == 0) {
+                mCommands.push_back({seqNo, command, callback, nullptr, true, timer});
+                scheduleFlushTx();
+                return 0;
             }
-        }, 3000);
-        return sendRaw(msg->serialize(mLocalKey, true));
+        }
+
+        mCommands.push_back({seqNo, command, callback, std::move(msg), false, timer});
+        if (!isConnected())
+            expediteConnect();
+        flushCommands();
+        return 0;
+    }
+
+    /* the key negotiated for the current connection of a 3.4 or 3.5 device, empty otherwise */
+    const std::string& sessionKey() const {
+        return mSessionKey;
+    }
+
+    bool isSessionEstablished() const {
+        return isConnected() && (mSessionState == SESSION_ESTABLISHED);
     }
 
     const std::string& ip() const {
@@ -166,54 +361,315 @@ public:
         return ss.str();
     }
 
-    int brightnessScale() {
-        if (mDps.contains("22"))
-            return 1000;
-        else if (mDps.contains("2"))
-            return 255;
-        return 1;
+    int brightnessScale() const {
+        return scaleOf(mBrightnessDp);
     }
 
-    int colorTempScale() {
-        if (mDps.contains("23"))
-            return 1000;
-        else if (mDps.contains("3"))
-            return 255;
-        return 1;
+    int colorTempScale() const {
+        return scaleOf(mColorTempDp);
     }
 
 private:
     virtual const std::string& TAG() override { return mTag; };
 
-    std::string switchKey() {
-        if (mDps.contains("20"))
-            return "20";
-        else if (mDps.contains("1"))
-            return "1";
-        return "";
+    /* v2 lights use datapoints 20-23 with values up to 1000, older ones 1-3 with 255 */
+    static const uint16_t SWITCH_DP = 20;
+    static const uint16_t BRIGHTNESS_DP = 22;
+    static const uint16_t COLOR_TEMP_DP = 23;
+    static const uint16_t SWITCH_DP_V1 = 1;
+    static const uint16_t BRIGHTNESS_DP_V1 = 2;
+    static const uint16_t COLOR_TEMP_DP_V1 = 3;
+
+    static const std::string& keyOf(uint16_t dp) {
+        static const std::string keys[] = { "", "1", "2", "3", "20", "22", "23" };
+        switch (dp) {
+        case SWITCH_DP_V1:      return keys[1];
+        case BRIGHTNESS_DP_V1:  return keys[2];
+        case COLOR_TEMP_DP_V1:  return keys[3];
+        case SWITCH_DP:         return keys[4];
+        case BRIGHTNESS_DP:     return keys[5];
+        case COLOR_TEMP_DP:     return keys[6];
+        default:                return keys[0];
+        }
+    }
+
+    static int scaleOf(uint16_t dp) {
+        switch (dp) {
+        case BRIGHTNESS_DP:
+        case COLOR_TEMP_DP:     return 1000;
+        case BRIGHTNESS_DP_V1:
+        case COLOR_TEMP_DP_V1:  return 255;
+        default:                return 1;
+        }
+    }
+
+    const std::string& switchKey() const {
+        return keyOf(mSwitchDp);
+    }
+
+    const std::string& brightnessKey() const {
+        return keyOf(mBrightnessDp);
     }
 
-    std::string brightnessKey() {
-        if (mDps.contains("22"))
-            return "22";
-        else if (mDps.contains("2"))
-            return "2";
-        return "";
+    const std::string& colorTempKey() const {
+        return keyOf(mColorTempDp);
     }
 
-    std::string colorTempKey() {
-        if (mDps.contains("23"))
-            return "23";
-        else if (mDps.contains("3"))
-            return "3";
-        return "";
+    uint16_t resolveDp(uint16_t dp, uint16_t v1Dp) const {
+        if (mDps.contains(dp))
+            return dp;
+        return mDps.contains(v1Dp) ? v1Dp : 0;
     }
 
-    struct {
-        uint32_t seqNo = 0;
+    /* Store the "dps" of a DP_QUERY response, or of a STATUS update which is decoded straight
+     * into mDps unless its shape needs the DOM, and resolve the datapoints of the switch etc.
+     * whenever the device reports datapoints we have not seen.
+     */
+    void assignDps(const ordered_json& data) {
+        const ordered_json* dps = Message::findDps(data);
+        if (dps && mDps.assign(*dps))
+            resolveDps();
+    }
+
+    void updateDps(const Message& msg) {
+        const size_t count = mDps.size();
+        if (!msg.decodeDps(mDps)) {
+            const ordered_json* dps = Message::findDps(msg.data());
+            if (dps)
+                mDps.update(*dps);
+        }
+        if (mDps.size() != count)
+            resolveDps();
+    }
+
+    void resolveDps() {
+        mSwitchDp = resolveDp(SWITCH_DP, SWITCH_DP_V1);
+        mBrightnessDp = resolveDp(BRIGHTNESS_DP, BRIGHTNESS_DP_V1);
+        mColorTempDp = resolveDp(COLOR_TEMP_DP, COLOR_TEMP_DP_V1);
+    }
+
+    struct PendingCommand {
+        uint32_t seqNo;
         Message::Command command;
         Callback_t callback;
-    } mCmdCtx;
+        std::unique_ptr<Message> msg;   // until it has been sent
+        bool sent;
+        TimerQueue::Handle timer;
+    };
+
+    enum SessionState {
+        SESSION_NONE,
+        SESSION_NEGOTIATING,
+        SESSION_ESTABLISHED,
+    };
+
+    /* commands that were issued while we were disconnected go out first */
+    void startSession() {
+        mSessionState = SESSION_ESTABLISHED;
+        flushCommands();
+
+        sendCommand(Message::DP_QUERY, ordered_json(), [this](CommandStatus status, const ordered_json& data) {
+            if (status == CMD_OK) {
+                assignDps(data);
+            } else {
+                TUYACPP_LOGE() << "command failed, error " << status << std::endl;
+            }
+        });
+    }
+
+    /* The negotiation is encrypted with the local key, so a session key of a previous
+     * connection is dropped first. Commands stay queued until it is done.
+     */
+    void startNegotiation() {
+        mSessionState = SESSION_NEGOTIATING;
+        mSessionKey.clear();
+        if (mCipher.setKey(mLocalKey) < 0) {
+            closeAfter(0);
+            return;
+        }
+
+        mLocalNonce = Session::nonce();
+        auto msg = Session::rawMessage(version(), mSeqNo++, Message::SESS_KEY_NEG_START, mLocalNonce.data(), mLocalNonce.length());
+        if ((queueTx(FRAME_SIZE_HINT, [this, &msg] (std::string& out) { msg->serializeTo(out, mCipher, true); }) < 0) ||
+            (flushTx() < 0)) {
+            TUYACPP_LOGE() << "failed to start the session key negotiation" << std::endl;
+            closeAfter(0);
+            return;
+        }
+        TUYACPP_LOGD() << "negotiating a session key" << std::endl;
+        closeAfter(NEGOTIATION_TIMEOUT_MS);
+    }
+
+    /* The response carries the nonce of the device and the HMAC of ours, which proves that
+     * it knows the local key. The FINISH frame proves the same to the device, it is queued
+     * before switching to the session key.
+     */
+    void handleNegotiation(MessageEvent& e) {
+        const auto& payload = e.msg.rawPayload();
+        if (mSessionState != SESSION_NEGOTIATING) {
+            TUYACPP_EV_LOGW(e) << "unexpected " << e.msg.cmdString() << std::endl;
+            return;
+        }
+
+        if (!e.msg.isRaw() || (payload.length() < Session::NONCE_SIZE + Cipher::HMAC_SIZE) ||
+            !mCipher.verifyHmac(mLocalNonce.data(), mLocalNonce.length(), payload.data() + Session::NONCE_SIZE)) {
+            TUYACPP_EV_LOGE(e) << "session key negotiation failed: invalid response" << std::endl;
+            closeAfter(0);
+            return;
+        }
+
+        const std::string remoteNonce = payload.substr(0, Session::NONCE_SIZE);
+        const std::string mac = Session::hmac(mCipher, remoteNonce);
+        auto msg = Session::rawMessage(version(), mSeqNo++, Message::SESS_KEY_NEG_FINISH, mac.data(), mac.length());
+        mSessionKey = Session::deriveKey(mCipher, version(), mLocalNonce, remoteNonce);
+        if (mac.empty() || mSessionKey.empty() ||
+            (queueTx(FRAME_SIZE_HINT, [this, &msg] (std::string& out) { msg->serializeTo(out, mCipher, true); }) < 0) ||
+            (mCipher.setKey(mSessionKey) < 0)) {
+            TUYACPP_EV_LOGE(e) << "session key negotiation failed" << std::endl;
+            closeAfter(0);
+            return;
+        }
+
+        mLoop.cancel(mNegotiationTimer);
+        mNegotiationTimer = TimerQueue::INVALID_HANDLE;
+        TUYACPP_EV_LOGD(e) << "session key negotiated" << std::endl;
+        startSession();
+    }
+
+    /* close the connection once the negotiation has failed or timed out */
+    void closeAfter(uint32_t delayMs) {
+        mLoop.cancel(mNegotiationTimer);
+        mNegotiationTimer = mLoop.pushWork([this, delayMs] () {
+            mNegotiationTimer = TimerQueue::INVALID_HANDLE;
+            if (delayMs)
+                TUYACPP_LOGE() << "session key negotiation timed out" << std::endl;
+            mLoop.handleEvent(CloseEvent(mSocketFd, mIp, LogStream::INFO));
+        }, delayMs);
+    }
+
+    std::deque<PendingCommand>::iterator findCommand(uint32_t seqNo) {
+        return std::find_if(mCommands.begin(), mCommands.end(),
+                            [seqNo] (const PendingCommand& cmd) { return cmd.seqNo == seqNo; });
+    }
+
+    /* remove the command before calling its callback, which may issue new commands */
+    void completeCommand(std::deque<PendingCommand>::iterator cmd, CommandStatus status, const ordered_json& data) {
+        Callback_t callback = std::move(cmd->callback);
+        mLoop.cancel(cmd->timer);
+        mCommands.erase(cmd);
+        if (callback != nullptr)
+            callback(status, data);
+    }
+
+    /* queue all commands that have not been sent yet until the connection is congested, and
+     * write them with a single flush
+     */
+    int flushCommands() {
+        if (!isSessionEstablished())
+            return 0;
+
+        for (auto& cmd : mCommands) {
+            if (cmd.sent)
+                continue;
+            if (isTxCongested())
+                break;
+            int ret = queueTx(FRAME_SIZE_HINT, [this, &cmd] (std::string& out) { cmd.msg->serializeTo(out, mCipher, true); });
+            if (ret < 0)
+                return ret;
+            cmd.sent = true;
+            cmd.msg.reset();
+        }
+
+        return flushTx();
+    }
+
+    int commitDps(const std::vector<DpsWrite>& writes, Callback_t cb) {
+        if (!mLoop.isLoopThread())
+            return postToLoop([this, writes, cb] () { return commitDps(writes, cb); });
+
+        ordered_json dps = ordered_json::object();
+        for (const auto& write : writes) {
+            std::string key;
+            switch (write.field) {
+            case DPS_RAW:           key = write.key; break;
+            case DPS_SWITCH:        key = switchKey(); break;
+            case DPS_BRIGHTNESS:    key = brightnessKey(); break;
+            case DPS_COLOR_TEMP:    key = colorTempKey(); break;
+            }
+            if (!key.length())
+                return fail(-EINVAL, cb);
+            dps[key] = (write.field == DPS_BRIGHTNESS) ? ordered_json(limitBrightness(key, write.value)) : write.value;
+        }
+
+        /* writes made before the transaction go out before it */
+        if (mFlushTimer != TimerQueue::INVALID_HANDLE) {
+            mLoop.cancel(mFlushTimer);
+            flushDps();
+        }
+        return sendCommand(Message::CONTROL, dps, cb);
+    }
+
+    /* run a call that was made outside of the loop thread in the loop thread, the call
+     * reports its errors through cb itself (see fail())
+     */
+    int postToLoop(std::function<int()>&& call) {
+        mLoop.post([call = std::move(call)] () { call(); });
+        return 0;
+    }
+
+    /* report err through cb once the current call has returned, or return it without cb */
+    int fail(int err, const Callback_t& cb) {
+        if (cb == nullptr)
+            return err;
+        const CommandStatus status = (err == -EBUSY) ? CMD_ERR_BUSY : CMD_ERR_INVALID;
+        mLoop.pushWork([cb, status] () { cb(status, ordered_json()); });
+        return 0;
+    }
+
+    int limitBrightness(const std::string& key, int brightness) {
+        if (key == "2")
+            brightness = std::max(brightness, 25);
+        return brightness;
+    }
+
+    int writeDps(const std::string& key, const ordered_json& value, Callback_t cb) {
+        if (!key.length())
+            return fail(-EINVAL, cb);
+
+        mPendingDps[key] = value;
+        if (cb != nullptr)
+            mPendingCallbacks.push_back(cb);
+
+        if (mFlushTimer == TimerQueue::INVALID_HANDLE)
+            mFlushTimer = mLoop.pushWork([this] () { flushDps(); });
+
+        return 0;
+    }
+
+    void flushDps() {
+        ordered_json dps;
+        dps.swap(mPendingDps);
+        std::vector<Callback_t> callbacks;
+        callbacks.swap(mPendingCallbacks);
+        mFlushTimer = TimerQueue::INVALID_HANDLE;
+
+        Callback_t callback = nullptr;
+        if (callbacks.size() == 1) {
+            callback = std::move(callbacks.front());
+        } else if (callbacks.size()) {
+            callback = [callbacks] (CommandStatus status, const ordered_json& data) {
+                for (const auto& cb : callbacks)
+                    cb(status, data);
+            };
+        }
+
+        sendCommand(Message::CONTROL, dps, callback);
+    }
+
+    std::deque<PendingCommand> mCommands;
+    ordered_json mPendingDps;
+    std::vector<Callback_t> mPendingCallbacks;
+    TimerQueue::Handle mFlushTimer = TimerQueue::INVALID_HANDLE;
     const std::string mTag;
     const std::string mIp;
     const std::string mName;
@@ -221,7 +677,14 @@ private:
     const std::string mDevId;
     const std::string mLocalKey;
     uint32_t mSeqNo;
-    ordered_json mDps;
+    SessionState mSessionState = SESSION_NONE;
+    std::string mLocalNonce;
+    std::string mSessionKey;
+    TimerQueue::Handle mNegotiationTimer = TimerQueue::INVALID_HANDLE;
+    DpsStore mDps;
+    uint16_t mSwitchDp = 0;
+    uint16_t mBrightnessDp = 0;
+    uint16_t mColorTempDp = 0;
 };
 
 } // namespace tuya
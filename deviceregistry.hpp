@@ -0,0 +1,208 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "device.hpp"
+
+namespace tuya {
+
+/* Devices of a scanner, indexed by IPv4 address, devId and the fd of their connection.
+ * Entries live in a vector of slots that are reused after removal. A Handle names a slot
+ * together with its generation, so a handle of a removed device stays invalid even after
+ * its slot has been reused. The registry is not locked, Scanner serializes access to it.
+ */
+class DeviceRegistry {
+public:
+    struct Handle {
+        uint32_t index = 0;
+        uint32_t generation = 0;
+
+        bool isValid() const {
+            return generation != 0;
+        }
+
+        bool operator==(const Handle& other) const {
+            return (index == other.index) && (generation == other.generation);
+        }
+
+        bool operator!=(const Handle& other) const {
+            return !(*this == other);
+        }
+    };
+
+    struct Entry {
+        uint32_t addr;          // IPv4 address in network byte order
+        std::string ip;
+        std::string devId;
+        int fd;
+        std::shared_ptr<Device> device;
+    };
+
+    /* parse a dotted IPv4 address into addr (network byte order) */
+    static bool parseIp(const std::string& ip, uint32_t& addr) {
+        struct in_addr inAddr;
+        if (inet_pton(AF_INET, ip.c_str(), &inAddr) != 1)
+            return false;
+        addr = inAddr.s_addr;
+        return true;
+    }
+
+    size_t size() const {
+        return mByIp.size();
+    }
+
+    /* add a device without instance yet, returns an invalid handle if the address is invalid
+     * or already registered; an empty or "unknown" devId is not indexed
+     */
+    Handle add(const std::string& ip, const std::string& devId) {
+        uint32_t addr;
+        if (!parseIp(ip, addr) || mByIp.count(addr))
+            return Handle();
+
+        uint32_t index;
+        if (mFree.size()) {
+            index = mFree.back();
+            mFree.pop_back();
+        } else {
+            index = mSlots.size();
+            mSlots.emplace_back();
+        }
+
+        Slot& slot = mSlots[index];
+        slot.used = true;
+        slot.entry.addr = addr;
+        slot.entry.ip = ip;
+        slot.entry.devId = hasDevId(devId) ? devId : std::string();
+        slot.entry.fd = -1;
+
+        mByIp[addr] = index;
+        if (slot.entry.devId.size())
+            mByDevId[slot.entry.devId] = index;
+        return { index, slot.generation };
+    }
+
+    bool remove(Handle handle) {
+        Slot* slot = find(handle);
+        if (!slot)
+            return false;
+
+        mByIp.erase(slot->entry.addr);
+        if (slot->entry.devId.size())
+            mByDevId.erase(slot->entry.devId);
+        if (slot->entry.fd >= 0)
+            mByFd.erase(slot->entry.fd);
+
+        slot->used = false;
+        slot->entry = Entry();
+        if (!++slot->generation)
+            slot->generation = 1;
+        mFree.push_back(handle.index);
+        return true;
+    }
+
+    void clear() {
+        mSlots.clear();
+        mFree.clear();
+        mByIp.clear();
+        mByDevId.clear();
+        mByFd.clear();
+    }
+
+    Handle findByIp(uint32_t addr) const {
+        return handleOf(mByIp, addr);
+    }
+
+    Handle findByIp(const std::string& ip) const {
+        uint32_t addr;
+        return parseIp(ip, addr) ? findByIp(addr) : Handle();
+    }
+
+    Handle findByDevId(const std::string& devId) const {
+        return handleOf(mByDevId, devId);
+    }
+
+    Handle findByFd(int fd) const {
+        return handleOf(mByFd, fd);
+    }
+
+    /* the entry of handle, or nullptr if the device has been removed */
+    const Entry* get(Handle handle) const {
+        const Slot* slot = find(handle);
+        return slot ? &slot->entry : nullptr;
+    }
+
+    bool setDevice(Handle handle, std::shared_ptr<Device> device) {
+        Slot* slot = find(handle);
+        if (!slot)
+            return false;
+        slot->entry.device = std::move(device);
+        return true;
+    }
+
+    /* set the fd of the current connection of the device, -1 if it is not connected */
+    bool setFd(Handle handle, int fd) {
+        Slot* slot = find(handle);
+        if (!slot)
+            return false;
+
+        if (slot->entry.fd >= 0)
+            mByFd.erase(slot->entry.fd);
+        slot->entry.fd = fd;
+        if (fd >= 0)
+            mByFd[fd] = handle.index;
+        return true;
+    }
+
+    /* call fn(Handle, const Entry&) for all devices, which must not be added or removed meanwhile */
+    template <typename F>
+    void forEach(F&& fn) const {
+        for (size_t i = 0; i < mSlots.size(); i++) {
+            if (mSlots[i].used)
+                fn(Handle{ (uint32_t) i, mSlots[i].generation }, mSlots[i].entry);
+        }
+    }
+
+private:
+    struct Slot {
+        Entry entry;
+        uint32_t generation = 1;
+        bool used = false;
+    };
+
+    static bool hasDevId(const std::string& devId) {
+        return devId.size() && (devId != "unknown");
+    }
+
+    template <typename Map, typename Key>
+    Handle handleOf(const Map& map, const Key& key) const {
+        auto it = map.find(key);
+        if (it == map.end())
+            return Handle();
+        return { it->second, mSlots[it->second].generation };
+    }
+
+    Slot* find(Handle handle) {
+        if (!handle.isValid() || (handle.index >= mSlots.size()))
+            return nullptr;
+        Slot& slot = mSlots[handle.index];
+        return (slot.used && (slot.generation == handle.generation)) ? &slot : nullptr;
+    }
+
+    const Slot* find(Handle handle) const {
+        return const_cast<DeviceRegistry*>(this)->find(handle);
+    }
+
+    std::vector<Slot> mSlots;
+    std::vector<uint32_t> mFree;
+    std::unordered_map<uint32_t, uint32_t> mByIp;
+    std::unordered_map<std::string, uint32_t> mByDevId;
+    std::unordered_map<int, uint32_t> mByFd;
+};
+
+} // namespace tuya
@@ -1,80 +1,509 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <map>
-#include <iostream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <syslog.h>
+
+/* Log statements below this level (0: DEBUG, 1: INFO, 2: WARNING, 3: ERROR) are removed at
+ * compile time, including the evaluation of their arguments.
+ */
+#ifndef TUYACPP_MIN_LOG_LEVEL
+    #define TUYACPP_MIN_LOG_LEVEL 0
+#endif
+
+/* number of records the log ring can hold, must be a power of two */
+#ifndef TUYACPP_LOG_RING_SIZE
+    #define TUYACPP_LOG_RING_SIZE 256
+#endif
 
 namespace tuya {
 
-class LogStream : public std::ostream {
+class LogStream {
 public:
     enum Level { DEBUG, INFO, WARNING, ERROR };
 
-    // TODO: implement tag-specific log levels
-    LogStream(const std::string& tag) : mTag(tag) {}
+    static const char* levelStr(Level level) {
+        static const char* const sLevelStr[] = { "DEBUG", "INFO", "WARNING", "ERROR" };
+        return sLevelStr[level];
+    }
 
-    static std::map<std::string, LogStream>& logstreams() {
-        static std::map<std::string, LogStream> sLogStreams = {};
-        return sLogStreams;
+    /* Runtime log levels. A tag without a level of its own uses the level of its first word
+     * (e.g. "DEVICE" for "DEVICE 192.168.0.10"), or the default level.
+     */
+    static void setLevel(Level level) {
+        auto& levels = runtimeLevels();
+        std::lock_guard<std::mutex> lock(levels.mutex);
+        levels.defaultLevel = level;
+        levels.updateBounds();
     }
 
-    static LogStream& nullstream() {
-        static LogStream sNullStream("");
-        return sNullStream;
+    static void setLevel(const std::string& tag, Level level) {
+        auto& levels = runtimeLevels();
+        std::lock_guard<std::mutex> lock(levels.mutex);
+        levels.tags[tag] = level;
+        levels.updateBounds();
     }
 
-    static LogStream& make(const std::string& t) {
-        auto result = logstreams().emplace(t, t);
-        return result.second ? result.first->second : nullstream();
+    /* only takes a lock if tags have levels that differ from the default and level is
+     * in between them
+     */
+    static bool enabled(const std::string& tag, Level level) {
+        auto& levels = runtimeLevels();
+        if (level < levels.min.load(std::memory_order_relaxed))
+            return false;
+        if (level >= levels.max.load(std::memory_order_relaxed))
+            return true;
+
+        std::lock_guard<std::mutex> lock(levels.mutex);
+        auto it = levels.tags.find(tag);
+        if (it == levels.tags.end())
+            it = levels.tags.find(tag.substr(0, tag.find(' ')));
+        return level >= ((it != levels.tags.end()) ? it->second : levels.defaultLevel);
     }
 
-    static LogStream& get(const std::string& t, Level l) {
-        static const std::map<LogStream::Level, std::string> levelMap = {
-            {LogStream::DEBUG, "DEBUG"},
-            {LogStream::INFO, "INFO"},
-            {LogStream::WARNING, "WARNING"},
-            {LogStream::ERROR, "ERROR"},
-        };
-        static const std::map<LogStream::Level, std::string> colorMap = {
-            {LogStream::DEBUG, "\e[1;35m"},
-            {LogStream::INFO, "\e[1;32m"},
-            {LogStream::WARNING, "\e[1;33m"},
-            {LogStream::ERROR, "\e[1;31m"},
-        };
-        static const std::string resetColor = "\e[0m";
+private:
+    struct Levels {
+        std::mutex mutex;
+        std::map<std::string, Level> tags;
+        Level defaultLevel = INFO;
+        std::atomic<int> min{INFO};
+        std::atomic<int> max{INFO};
+
+        void updateBounds() {
+            int lo = defaultLevel, hi = defaultLevel;
+            for (const auto& it : tags) {
+                lo = std::min<int>(lo, it.second);
+                hi = std::max<int>(hi, it.second);
+            }
+            min = lo;
+            max = hi;
+        }
+    };
 
-        if (!t.size())
-            return nullstream();
+    static Levels& runtimeLevels() {
+        static Levels sLevels;
+        return sLevels;
+    }
+};
+
+/* a formatted log record as it is passed to the sinks, text does not end with a newline */
+struct LogEntry {
+    std::chrono::system_clock::time_point time;
+    LogStream::Level level;
+    const char* tag;
+    const char* text;
+    size_t length;
+};
+
+/* Sinks are only called from one thread at a time, usually the log writer thread */
+class LogSink {
+public:
+    virtual ~LogSink() = default;
+    virtual void write(const LogEntry& entry) = 0;
+    virtual void flush() {}
 
-        auto now = std::chrono::system_clock::now();
-        std::time_t now_time = std::chrono::system_clock::to_time_t(now);
-        const auto& now_ctime = std::ctime(&now_time);
-        const auto& levelStr = levelMap.at(l);
-        auto it = logstreams().find(t);
-        LogStream& s = (it != logstreams().end()) ? it->second : make(t);
-        s << colorMap.at(l) << "[" << std::string(now_ctime + 11, now_ctime + 19) << " " << levelStr << " " << t << "] " << resetColor;
-        return s;
+protected:
+    static void formatTime(const LogEntry& entry, char* buf, size_t len) {
+        const std::time_t time = std::chrono::system_clock::to_time_t(entry.time);
+        struct tm tm;
+        strftime(buf, len, "%H:%M:%S", localtime_r(&time, &tm));
     }
+};
+
+class StdoutSink : public LogSink {
+public:
+    StdoutSink(bool colors = true) : mColors(colors) {}
 
-    template <typename T>
-    std::ostream& operator<<(T const &t) {
-        return !mTag.size() ? *this : std::cout << t;
+    virtual void write(const LogEntry& entry) override {
+        static const char* const colorStr[] = { "\e[1;35m", "\e[1;32m", "\e[1;33m", "\e[1;31m" };
+        char timeStr[16];
+        formatTime(entry, timeStr, sizeof(timeStr));
+        fprintf(stdout, "%s[%s %s %s] %s%.*s\n", mColors ? colorStr[entry.level] : "", timeStr,
+                LogStream::levelStr(entry.level), entry.tag, mColors ? "\e[0m" : "", (int) entry.length, entry.text);
     }
 
-    std::ostream& operator<<(std::ostream& s) {
-        return s;
+    virtual void flush() override {
+        fflush(stdout);
     }
 
 private:
-    std::string mTag;
+    const bool mColors;
 };
 
+/* appends to path, which is rotated to path.1 ... path.<maxFiles> when it exceeds maxSize */
+class FileSink : public LogSink {
+public:
+    FileSink(const std::string& path, size_t maxSize = 1024 * 1024, unsigned maxFiles = 3)
+        : mPath(path), mMaxSize(maxSize), mMaxFiles(maxFiles), mFile(nullptr), mSize(0) {
+        open();
+    }
+
+    ~FileSink() {
+        if (mFile)
+            fclose(mFile);
+    }
+
+    virtual void write(const LogEntry& entry) override {
+        if (!mFile)
+            return;
+
+        char timeStr[16];
+        formatTime(entry, timeStr, sizeof(timeStr));
+        int ret = fprintf(mFile, "[%s %s %s] %.*s\n", timeStr, LogStream::levelStr(entry.level), entry.tag,
+                          (int) entry.length, entry.text);
+        if (ret > 0)
+            mSize += ret;
+        if (mSize >= mMaxSize)
+            rotate();
+    }
+
+    virtual void flush() override {
+        if (mFile)
+            fflush(mFile);
+    }
+
+private:
+    void open() {
+        mFile = fopen(mPath.c_str(), "a");
+        mSize = mFile ? ftell(mFile) : 0;
+    }
+
+    void rotate() {
+        fclose(mFile);
+        for (unsigned i = mMaxFiles; i > 1; i--)
+            rename((mPath + "." + std::to_string(i - 1)).c_str(), (mPath + "." + std::to_string(i)).c_str());
+        if (mMaxFiles)
+            rename(mPath.c_str(), (mPath + ".1").c_str());
+        else
+            remove(mPath.c_str());
+        open();
+    }
+
+    const std::string mPath;
+    const size_t mMaxSize;
+    const unsigned mMaxFiles;
+    FILE* mFile;
+    size_t mSize;
+};
+
+class SyslogSink : public LogSink {
+public:
+    /* ident must stay valid as long as the sink exists */
+    SyslogSink(const char* ident = "tuyacpp", int facility = LOG_USER) {
+        openlog(ident, LOG_PID, facility);
+    }
+
+    ~SyslogSink() {
+        closelog();
+    }
+
+    virtual void write(const LogEntry& entry) override {
+        static const int priority[] = { LOG_DEBUG, LOG_INFO, LOG_WARNING, LOG_ERR };
+        syslog(priority[entry.level], "[%s] %.*s", entry.tag, (int) entry.length, entry.text);
+    }
+};
+
+/* Log records are formatted by the logging thread directly into a slot of a pre-allocated
+ * ring (a bounded lock-free queue, Vyukov) and written to the sinks by a writer thread, so
+ * that logging never waits for I/O. Records are dropped and counted when the ring is full.
+ *
+ * With TUYACPP_SYNC_LOG, there is no writer thread and records are written right away.
+ */
+class LogBackend {
+public:
+    static const size_t RING_SIZE = TUYACPP_LOG_RING_SIZE;
+    static const size_t TAG_SIZE = 32;
+    static const size_t TEXT_SIZE = 984;
+    static const unsigned WRITER_SPINS = 100;
+
+    struct Slot {
+        std::atomic<size_t> seq;
+        std::chrono::system_clock::time_point time;
+        LogStream::Level level;
+        size_t length;
+        char tag[TAG_SIZE];
+        char text[TEXT_SIZE];
+    };
+
+    /* never destroyed, so that it can be used until the very end, see stop() */
+    static LogBackend& instance() {
+        static LogBackend* sInstance = new LogBackend();
+        return *sInstance;
+    }
+
+    void addSink(std::unique_ptr<LogSink> sink) {
+        std::lock_guard<std::mutex> lock(mSinkMutex);
+        mSinks.push_back(std::move(sink));
+    }
+
+    void clearSinks() {
+        std::lock_guard<std::mutex> lock(mSinkMutex);
+        mSinks.clear();
+    }
+
+    /* number of records that have been dropped because the ring was full */
+    uint64_t dropped() const {
+        return mDropped.load(std::memory_order_relaxed);
+    }
+
+    /* write all pending records from the calling thread */
+    void flush() {
+        std::lock_guard<std::mutex> lock(mSinkMutex);
+        drain();
+    }
+
+    /* stop the writer thread, records are written synchronously from then on */
+    void stop() {
+        if (!mRunning.exchange(false))
+            return;
+        { std::lock_guard<std::mutex> lock(mCondMutex); }
+        mCond.notify_one();
+        if (mWriter.joinable())
+            mWriter.join();
+        flush();
+    }
+
+    Slot* claim() {
+        size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot& slot = mRing[pos & (RING_SIZE - 1)];
+            const size_t seq = slot.seq.load(std::memory_order_acquire);
+            const intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+            if (diff == 0) {
+                if (mEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    return &slot;
+            } else if (diff < 0) {
+                mDropped.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            } else {
+                pos = mEnqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /* The writer sleeps while the ring is empty and is only notified by the record that
+     * ends that, the records that follow while it is draining are picked up without a
+     * futex syscall.
+     */
+    void publish(Slot* slot) {
+        const size_t pos = slot->seq.load(std::memory_order_relaxed);
+        slot->seq.store(pos + 1, std::memory_order_release);
+        if (!mRunning.load(std::memory_order_relaxed)) {
+            flush();
+            return;
+        }
+
+        /* pairs with the fence in run(), either the writer sees the record or we see it idle */
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (mWriterIdle.load(std::memory_order_relaxed) && mWriterIdle.exchange(false)) {
+            /* the writer may be between its check and the wait, let it get to the wait */
+            { std::lock_guard<std::mutex> lock(mCondMutex); }
+            mCond.notify_one();
+        }
+    }
+
+private:
+    LogBackend() : mRing(RING_SIZE), mEnqueuePos(0), mDequeuePos(0), mDropped(0), mReportedDropped(0),
+                   mRunning(false), mWriterIdle(false) {
+        static_assert((RING_SIZE & (RING_SIZE - 1)) == 0, "TUYACPP_LOG_RING_SIZE must be a power of two");
+        for (size_t i = 0; i < RING_SIZE; i++)
+            mRing[i].seq.store(i, std::memory_order_relaxed);
+        mSinks.push_back(std::make_unique<StdoutSink>());
+
+#ifndef TUYACPP_SYNC_LOG
+        mRunning = true;
+        mWriter = std::thread([this] () { run(); });
+        std::atexit([] () { instance().stop(); });
+#endif
+    }
+
+    void run() {
+        while (mRunning) {
+            {
+                std::lock_guard<std::mutex> lock(mSinkMutex);
+                if (drain())
+                    continue;
+            }
+
+            /* records often come in bursts, look again for a while before going to sleep */
+            unsigned spins = 0;
+            while ((spins < WRITER_SPINS) && !pending()) {
+                std::this_thread::yield();
+                spins++;
+            }
+            if (spins < WRITER_SPINS)
+                continue;
+
+            std::unique_lock<std::mutex> lock(mCondMutex);
+            mWriterIdle.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            mCond.wait(lock, [this] () { return !mRunning || !mWriterIdle || pending(); });
+            mWriterIdle.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    bool pending() const {
+        const size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+        return mRing[pos & (RING_SIZE - 1)].seq.load(std::memory_order_acquire) == pos + 1;
+    }
+
+    /* called with mSinkMutex held, returns true if something has been written */
+    bool drain() {
+        bool written = false;
+        while (pending()) {
+            const size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+            Slot& slot = mRing[pos & (RING_SIZE - 1)];
+            const LogEntry entry = { slot.time, slot.level, slot.tag, slot.text, slot.length };
+            for (auto& sink : mSinks)
+                sink->write(entry);
+            slot.seq.store(pos + RING_SIZE, std::memory_order_release);
+            mDequeuePos.store(pos + 1, std::memory_order_relaxed);
+            written = true;
+        }
+
+        const uint64_t dropped = mDropped.load(std::memory_order_relaxed);
+        if (dropped != mReportedDropped) {
+            char text[64];
+            const int len = snprintf(text, sizeof(text), "%llu log records dropped",
+                                     (unsigned long long) (dropped - mReportedDropped));
+            const LogEntry entry = { std::chrono::system_clock::now(), LogStream::WARNING, "LOG", text, (size_t) len };
+            for (auto& sink : mSinks)
+                sink->write(entry);
+            mReportedDropped = dropped;
+            written = true;
+        }
+
+        if (written) {
+            for (auto& sink : mSinks)
+                sink->flush();
+        }
+        return written;
+    }
+
+    std::vector<Slot> mRing;
+    std::atomic<size_t> mEnqueuePos;
+    /* only modified with mSinkMutex held, but also read by the idle writer */
+    std::atomic<size_t> mDequeuePos;
+    std::atomic<uint64_t> mDropped;
+    uint64_t mReportedDropped;
+
+    std::mutex mSinkMutex;
+    std::vector<std::unique_ptr<LogSink>> mSinks;
+
+    std::atomic_bool mRunning;
+    std::atomic_bool mWriterIdle;
+    std::mutex mCondMutex;
+    std::condition_variable mCond;
+    std::thread mWriter;
+};
+
+/* One log statement. The text is formatted straight into a slot of the ring, which is
+ * published when the record is destroyed at the end of the statement.
+ */
+class LogRecord {
+public:
+    LogRecord(const std::string& tag, LogStream::Level level) : mSlot(LogBackend::instance().claim()) {
+        if (mSlot) {
+            mSlot->time = std::chrono::system_clock::now();
+            mSlot->level = level;
+            const size_t tagLen = std::min(tag.length(), LogBackend::TAG_SIZE - 1);
+            memcpy(mSlot->tag, tag.data(), tagLen);
+            mSlot->tag[tagLen] = '\0';
+            mBuf.reset(mSlot->text, LogBackend::TEXT_SIZE);
+        } else {
+            mBuf.reset(nullptr, 0);
+        }
+
+        /* the stream is shared by the records of a thread, nested records restore it */
+        std::ostream& os = threadStream();
+        mPrevBuf = os.rdbuf(&mBuf);
+        os.flags(std::ios_base::dec | std::ios_base::skipws);
+        os.fill(' ');
+        os.width(0);
+        os.precision(6);
+    }
+
+    LogRecord(const LogRecord&) = delete;
+    LogRecord& operator=(const LogRecord&) = delete;
+
+    ~LogRecord() {
+        threadStream().rdbuf(mPrevBuf);
+        if (!mSlot)
+            return;
+
+        /* the sinks add their own line breaks */
+        size_t len = mBuf.length();
+        while (len && (mSlot->text[len - 1] == '\n'))
+            len--;
+        mSlot->length = len;
+        LogBackend::instance().publish(mSlot);
+    }
+
+    std::ostream& stream() {
+        return threadStream();
+    }
+
+private:
+    /* writes to a fixed buffer and silently truncates, so that the stream never fails */
+    class SlotBuf : public std::streambuf {
+    public:
+        void reset(char* buf, size_t len) {
+            setp(buf, buf + len);
+        }
+
+        size_t length() const {
+            return pptr() - pbase();
+        }
+
+    protected:
+        virtual int_type overflow(int_type c) override {
+            return traits_type::not_eof(c);
+        }
+    };
+
+    static std::ostream& threadStream() {
+        static thread_local std::ostream sStream(nullptr);
+        return sStream;
+    }
+
+    LogBackend::Slot* mSlot;
+    SlotBuf mBuf;
+    std::streambuf* mPrevBuf;
+};
+
+/* Turns a log statement into a void expression, see TUYACPP_LOG */
+struct LogVoidify {
+    void operator&(std::ostream&) {}
+};
+
+/* The log macros are expressions of the form "disabled ? (void) 0 : stream << ...", so
+ * that the arguments of a disabled statement are not evaluated. They need a TAG() in
+ * scope, see LOG_MEMBERS.
+ */
+#define TUYACPP_LOG(level) \
+    !(((level) >= TUYACPP_MIN_LOG_LEVEL) && tuya::LogStream::enabled(TAG(), (level))) ? (void) 0 : \
+    tuya::LogVoidify() & tuya::LogRecord(TAG(), (level)).stream()
+
+#define TUYACPP_LOGD() TUYACPP_LOG(tuya::LogStream::DEBUG)
+#define TUYACPP_LOGI() TUYACPP_LOG(tuya::LogStream::INFO)
+#define TUYACPP_LOGW() TUYACPP_LOG(tuya::LogStream::WARNING)
+#define TUYACPP_LOGE() TUYACPP_LOG(tuya::LogStream::ERROR)
+
 #define LOG_MEMBERS(t) \
-    virtual const std::string& TAG() { static const std::string tag = #t; return tag; }; \
-    LogStream& LOGD() { return LogStream::get(TAG(), LogStream::DEBUG); } \
-    LogStream& LOGI() { return LogStream::get(TAG(), LogStream::INFO); } \
-    LogStream& LOGW() { return LogStream::get(TAG(), LogStream::WARNING); } \
-    LogStream& LOGE() { return LogStream::get(TAG(), LogStream::ERROR); }
+    virtual const std::string& TAG() { static const std::string tag = #t; return tag; }
 
 }   // namespace tuya
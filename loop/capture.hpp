@@ -0,0 +1,168 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+
+#include <arpa/inet.h>
+
+#include "../logging.hpp"
+
+namespace tuya {
+
+/* Capture files contain the raw data received by socket handlers. After an 8 byte magic
+ * ("TUYACAP1"), each record consists of a 24 byte header and the data, all integers are
+ * little-endian:
+ *
+ *   uint64  time in us since the epoch
+ *   int32   fd
+ *   uint32  IPv4 address of the peer, in network byte order (0 if unknown)
+ *   uint32  flags, see Flags
+ *   uint32  length of the data
+ */
+class Capture {
+public:
+    static constexpr const char* MAGIC = "TUYACAP1";
+    static const size_t MAGIC_SIZE = 8;
+    static const size_t HEADER_SIZE = 24;
+
+    enum Flags : uint32_t {
+        NONE        = 0,
+        DATAGRAM    = 1 << 0,
+    };
+
+    struct Record {
+        uint64_t timeUs;
+        int fd;
+        std::string addr;
+        uint32_t flags;
+        std::string data;
+    };
+
+protected:
+    static void put(char* buf, uint64_t value, size_t len) {
+        for (size_t i = 0; i < len; i++)
+            buf[i] = (char) (value >> (8 * i));
+    }
+
+    static uint64_t get(const char* buf, size_t len) {
+        uint64_t value = 0;
+        for (size_t i = 0; i < len; i++)
+            value |= (uint64_t) (uint8_t) buf[i] << (8 * i);
+        return value;
+    }
+};
+
+/* appends records to a capture file, can be shared by several loops */
+class CaptureWriter : public Capture {
+public:
+    CaptureWriter(const std::string& path) : mFile(fopen(path.c_str(), "ab")) {
+        if (!mFile) {
+            TUYACPP_LOGE() << "failed to open capture file " << path << std::endl;
+            return;
+        }
+        if (ftell(mFile) == 0)
+            fwrite(MAGIC, 1, MAGIC_SIZE, mFile);
+    }
+
+    CaptureWriter(const CaptureWriter&) = delete;
+    CaptureWriter& operator=(const CaptureWriter&) = delete;
+
+    ~CaptureWriter() {
+        if (mFile)
+            fclose(mFile);
+    }
+
+    bool isOpen() const {
+        return mFile != nullptr;
+    }
+
+    int write(int fd, const std::string& addr, uint32_t flags, const char* data, size_t len) {
+        if (!mFile)
+            return -EBADF;
+
+        struct in_addr inAddr;
+        if (inet_pton(AF_INET, addr.c_str(), &inAddr) != 1)
+            inAddr.s_addr = 0;
+
+        const auto now = std::chrono::system_clock::now().time_since_epoch();
+        char header[HEADER_SIZE];
+        put(header, std::chrono::duration_cast<std::chrono::microseconds>(now).count(), 8);
+        put(header + 8, (uint32_t) fd, 4);
+        memcpy(header + 12, &inAddr.s_addr, 4);
+        put(header + 16, flags, 4);
+        put(header + 20, len, 4);
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        if ((fwrite(header, 1, HEADER_SIZE, mFile) != HEADER_SIZE) || (fwrite(data, 1, len, mFile) != len)) {
+            TUYACPP_LOGE() << "failed to write capture record" << std::endl;
+            return -EIO;
+        }
+        return 0;
+    }
+
+    void flush() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mFile)
+            fflush(mFile);
+    }
+
+private:
+    LOG_MEMBERS(CAPTURE);
+
+    FILE* mFile;
+    std::mutex mMutex;
+};
+
+class CaptureReader : public Capture {
+public:
+    CaptureReader(const std::string& path) : mFile(fopen(path.c_str(), "rb")) {
+        char magic[MAGIC_SIZE];
+        if (mFile && ((fread(magic, 1, MAGIC_SIZE, mFile) != MAGIC_SIZE) || memcmp(magic, MAGIC, MAGIC_SIZE))) {
+            TUYACPP_LOGE() << path << " is not a capture file" << std::endl;
+            fclose(mFile);
+            mFile = nullptr;
+        }
+    }
+
+    CaptureReader(const CaptureReader&) = delete;
+    CaptureReader& operator=(const CaptureReader&) = delete;
+
+    ~CaptureReader() {
+        if (mFile)
+            fclose(mFile);
+    }
+
+    bool isOpen() const {
+        return mFile != nullptr;
+    }
+
+    /* read the next record, returns false at the end of the file or for truncated records */
+    bool next(Record& record) {
+        char header[HEADER_SIZE];
+        if (!mFile || (fread(header, 1, HEADER_SIZE, mFile) != HEADER_SIZE))
+            return false;
+
+        struct in_addr inAddr;
+        memcpy(&inAddr.s_addr, header + 12, 4);
+        char addr[INET_ADDRSTRLEN] = { 0 };
+        if (inAddr.s_addr)
+            inet_ntop(AF_INET, &inAddr, addr, sizeof(addr));
+
+        record.timeUs = get(header, 8);
+        record.fd = (int) get(header + 8, 4);
+        record.addr.assign(addr);
+        record.flags = get(header + 16, 4);
+        record.data.resize(get(header + 20, 4));
+        return fread(&record.data[0], 1, record.data.size(), mFile) == record.data.size();
+    }
+
+private:
+    LOG_MEMBERS(CAPTURE);
+
+    FILE* mFile;
+};
+
+} // namespace tuya
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+
+namespace tuya {
+
+/* Connection attempts of the TCP clients of a loop. At most maxInProgress() of them connect
+ * at the same time, the others wait in line, urgent ones (e.g. devices with queued commands)
+ * before the rest. This keeps hundreds of devices that lost their connection together from
+ * flooding the network with SYNs. Like everything attached to a loop it is single-threaded,
+ * except for stats(), which can be read from any thread.
+ */
+class ConnectManager {
+public:
+    static const size_t DEFAULT_MAX_IN_PROGRESS = 32;
+
+    enum Result {
+        CONNECTED,
+        FAILED,
+        TIMED_OUT,
+        ABORTED,        // the client went away, not counted
+    };
+
+    struct Stats {
+        uint64_t attempts;
+        uint64_t connected;
+        uint64_t failed;            // including timed out
+        uint64_t timedOut;
+        uint64_t latencyTotalUs;    // of the successful attempts
+        uint64_t latencyMaxUs;
+        uint64_t inProgress;
+        uint64_t queued;
+
+        Stats& operator+=(const Stats& other) {
+            attempts += other.attempts;
+            connected += other.connected;
+            failed += other.failed;
+            timedOut += other.timedOut;
+            latencyTotalUs += other.latencyTotalUs;
+            latencyMaxUs = std::max(latencyMaxUs, other.latencyMaxUs);
+            inProgress += other.inProgress;
+            queued += other.queued;
+            return *this;
+        }
+    };
+
+    typedef std::function<void()> Start_t;
+
+    ConnectManager() : mMaxInProgress(DEFAULT_MAX_IN_PROGRESS), mPumping(false) {
+    }
+
+    /* 0 removes the limit */
+    void setMaxInProgress(size_t max) {
+        mMaxInProgress = max;
+        pump();
+    }
+
+    size_t maxInProgress() const {
+        return mMaxInProgress;
+    }
+
+    /* Queue a connection attempt of owner, start() is called when it may connect, maybe
+     * right away. Every start() has to be followed by finish(). An owner has at most one
+     * request at a time.
+     */
+    void request(const void* owner, bool urgent, Start_t&& start) {
+        (urgent ? mUrgent : mNormal).push_back({owner, std::move(start)});
+        mQueued++;
+        pump();
+    }
+
+    /* move a waiting request ahead of the ones that are not urgent */
+    bool promote(const void* owner) {
+        auto it = find(mNormal, owner);
+        if (it == mNormal.end())
+            return false;
+        mUrgent.push_back(std::move(*it));
+        mNormal.erase(it);
+        return true;
+    }
+
+    /* drop a request that has not been started */
+    bool withdraw(const void* owner) {
+        for (auto* queue : { &mUrgent, &mNormal }) {
+            auto it = find(*queue, owner);
+            if (it != queue->end()) {
+                queue->erase(it);
+                mQueued--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* the attempt that has been started is done, latencyUs is the time it took to connect */
+    void finish(Result result, uint64_t latencyUs = 0) {
+        mInProgress--;
+        switch (result) {
+        case CONNECTED:
+            mConnected++;
+            mLatencyTotalUs += latencyUs;
+            if (latencyUs > mLatencyMaxUs.load(std::memory_order_relaxed))
+                mLatencyMaxUs = latencyUs;
+            break;
+        case TIMED_OUT:
+            mTimedOut++;
+            /* fall through */
+        case FAILED:
+            mFailed++;
+            break;
+        case ABORTED:
+            break;
+        }
+        pump();
+    }
+
+    Stats stats() const {
+        return Stats{ mAttempts, mConnected, mFailed, mTimedOut, mLatencyTotalUs, mLatencyMaxUs, mInProgress, mQueued };
+    }
+
+private:
+    struct Request {
+        const void* owner;
+        Start_t start;
+    };
+
+    static std::deque<Request>::iterator find(std::deque<Request>& queue, const void* owner) {
+        return std::find_if(queue.begin(), queue.end(), [owner] (const Request& r) { return r.owner == owner; });
+    }
+
+    /* start() may finish() right away, the outer call goes on with the next request */
+    void pump() {
+        if (mPumping)
+            return;
+        mPumping = true;
+        while ((!mMaxInProgress || (mInProgress < mMaxInProgress)) && (!mUrgent.empty() || !mNormal.empty())) {
+            auto& queue = mUrgent.empty() ? mNormal : mUrgent;
+            Start_t start = std::move(queue.front().start);
+            queue.pop_front();
+            mQueued--;
+            mInProgress++;
+            mAttempts++;
+            start();
+        }
+        mPumping = false;
+    }
+
+    size_t mMaxInProgress;
+    bool mPumping;
+    std::deque<Request> mUrgent;
+    std::deque<Request> mNormal;
+    std::atomic<uint64_t> mAttempts{0};
+    std::atomic<uint64_t> mConnected{0};
+    std::atomic<uint64_t> mFailed{0};
+    std::atomic<uint64_t> mTimedOut{0};
+    std::atomic<uint64_t> mLatencyTotalUs{0};
+    std::atomic<uint64_t> mLatencyMaxUs{0};
+    std::atomic<uint64_t> mInProgress{0};
+    std::atomic<uint64_t> mQueued{0};
+};
+
+} // namespace tuya
@@ -1,6 +1,5 @@
 #pragma once
 
-#include <map>
 #include <string>
 
 #include "../logging.hpp"
@@ -19,44 +18,45 @@ public:
         MESSAGE,
         CLOSING,
     };
+
+    /* event type masks for Loop::attach() */
+    static constexpr uint8_t mask(Type t) {
+        return 1 << t;
+    }
+    static const uint8_t ALL = 0xff;
+
     const int fd;
     const Type type;
     const LogStream::Level logLevel;
 
-    const std::string& typeStr() const {
-        static const std::map<Type, std::string> map = {
-            {INVALID, "INVALID"},
-            {CONNECTED, "CONNECTED"},
-            {READABLE, "READABLE"},
-            {WRITABLE, "WRITABLE"},
-            {READ, "READ"},
-            {MESSAGE, "MESSAGE"},
-            {CLOSING, "CLOSING"}
-        };
-        const auto& it = map.find(type);
-        if (it == map.end())
-            return map.at(INVALID);
-        return it->second;
+    const char* typeStr() const {
+        switch (type) {
+        case CONNECTED:     return "CONNECTED";
+        case READABLE:      return "READABLE";
+        case WRITABLE:      return "WRITABLE";
+        case READ:          return "READ";
+        case MESSAGE:       return "MESSAGE";
+        case CLOSING:       return "CLOSING";
+        default:            return "INVALID";
+        }
+    }
+
+    bool logs(LogStream::Level level) const {
+        return level >= logLevel;
     }
 
     operator std::string() const {
         return "Event {fd=" + std::to_string(fd) + ", type=" + typeStr() + "}";
     }
 
-    std::ostream &log(const std::string& tag, LogStream::Level level) {
-        if (level >= logLevel)
-            return LogStream::get(tag, level) << "[EV " << typeStr() << "(" << fd << ")] ";
-        else
-            return LogStream::nullstream();
+    std::ostream &log(std::ostream& os) const {
+        return os << "[EV " << typeStr() << "(" << fd << ")] ";
     }
 
     virtual ~Event() = default;
 
 protected:
     Event(int f, Type t, LogStream::Level l) : fd(f), type(t), logLevel(l) {}
-
-private:
-    static std::map<std::string, LogStream> mLogStreams;
 };
 
 class ConnectedEvent : public Event {
@@ -79,9 +79,10 @@ public:
 class ReadEvent : public Event {
 public:
     const std::string &addr;
-    const std::string &data;
+    const char *data;
+    const size_t length;
 
-    ReadEvent(int f, const std::string &d, const std::string &a, LogStream::Level l) : Event(f, Event::READ, l), addr(a), data(d) {}
+    ReadEvent(int f, const char *d, size_t n, const std::string &a, LogStream::Level l) : Event(f, Event::READ, l), addr(a), data(d), length(n) {}
 };
 
 class MessageEvent : public Event {
@@ -99,4 +100,14 @@ public:
     CloseEvent(int f, const std::string &a, LogStream::Level l) : Event(f, Event::CLOSING, l), addr(a) {}
 };
 
+/* like TUYACPP_LOGD() etc., but also subject to the log level of the event */
+#define TUYACPP_EV_LOG(e, level) \
+    !(((level) >= TUYACPP_MIN_LOG_LEVEL) && (e).logs(level) && tuya::LogStream::enabled(TAG(), (level))) ? (void) 0 : \
+    tuya::LogVoidify() & (e).log(tuya::LogRecord(TAG(), (level)).stream())
+
+#define TUYACPP_EV_LOGD(e) TUYACPP_EV_LOG(e, tuya::LogStream::DEBUG)
+#define TUYACPP_EV_LOGI(e) TUYACPP_EV_LOG(e, tuya::LogStream::INFO)
+#define TUYACPP_EV_LOGW(e) TUYACPP_EV_LOG(e, tuya::LogStream::WARNING)
+#define TUYACPP_EV_LOGE(e) TUYACPP_EV_LOG(e, tuya::LogStream::ERROR)
+
 }  // namespace tuya
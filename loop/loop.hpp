@@ -1,226 +1,403 @@
 #pragma once
 
-#include <list>
-#include <map>
-#include <queue>
-#include <set>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <errno.h>
-#include <sys/select.h>
+#include <fcntl.h>
 #include <unistd.h>
 
+#if defined(__linux__) && !defined(TUYACPP_NO_PIPE) && !defined(TUYACPP_USE_PIPE)
+    #define TUYACPP_USE_EVENTFD
+    #include <sys/eventfd.h>
+#endif
+
+#include "capture.hpp"
+#include "connectmanager.hpp"
 #include "event.hpp"
 #include "handler.hpp"
+#include "mpscqueue.hpp"
+#include "poller.hpp"
+#include "timerqueue.hpp"
 #include "../logging.hpp"
 
 namespace tuya {
 
 class Loop {
-    struct DelayedWork {
-        DelayedWork(std::chrono::time_point<std::chrono::steady_clock> d, std::function<void()>& w) : deadline(d), work(w) {}
-        std::chrono::time_point<std::chrono::steady_clock> deadline;
-        std::function<void()> work;
-    };
-
-    struct OrderByDeadline {
-        bool operator() (const DelayedWork& work1, const DelayedWork& work2) {
-            return work2.deadline < work1.deadline;
-        }
-    };
+    static const size_t MAX_POSTED_PER_ITERATION = 256;
 
 public:
-    class PipeHandler : public Handler {
+    /* Wakes up the loop from other threads. An eventfd is used where available, so that
+     * any number of wakeups is drained with a single read, a pipe otherwise.
+     */
+    class WakeUpHandler : public Handler {
     public:
-        PipeHandler() {
-            pipe(mPipeFds);
+        WakeUpHandler() {
+#ifdef TUYACPP_USE_EVENTFD
+            mFds[0] = mFds[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            if (mFds[0] < 0)
+                throw std::runtime_error("eventfd() failed");
+#else
+            if (pipe(mFds) < 0)
+                throw std::runtime_error("pipe() failed");
+            /* a full pipe means that a wakeup is pending anyway */
+            fcntl(mFds[0], F_SETFL, fcntl(mFds[0], F_GETFL) | O_NONBLOCK);
+            fcntl(mFds[1], F_SETFL, fcntl(mFds[1], F_GETFL) | O_NONBLOCK);
+#endif
         }
 
-        ~PipeHandler() {
-            close(mPipeFds[0]);
-            close(mPipeFds[1]);
+        ~WakeUpHandler() {
+            close(mFds[0]);
+            if (mFds[1] != mFds[0])
+                close(mFds[1]);
         }
 
         int readFd() const {
-            return mPipeFds[0];
-        }
-
-        int writeFd() const {
-            return mPipeFds[1];
+            return mFds[0];
         }
 
-        void write(char c = '\0') {
-            const uint8_t buf[1] = { c };
-            ::write(mPipeFds[1], buf, 1);
+        void signal() {
+#ifdef TUYACPP_USE_EVENTFD
+            const uint64_t value = 1;
+            ::write(mFds[1], &value, sizeof(value));
+#else
+            const uint8_t value = 0;
+            ::write(mFds[1], &value, sizeof(value));
+#endif
         }
 
         virtual void handleReadable(ReadableEvent& e) {
-            EV_LOGD(e) << "pipe is readable" << std::endl;
-            uint8_t buf[1];
-            read(mPipeFds[0], buf, 1);
+            TUYACPP_EV_LOGD(e) << "woken up" << std::endl;
+#ifdef TUYACPP_USE_EVENTFD
+            uint64_t count;
+            read(mFds[0], &count, sizeof(count));
+#else
+            uint8_t buf[64];
+            while (read(mFds[0], buf, sizeof(buf)) == sizeof(buf))
+                ;
+#endif
         }
 
     private:
-        int mPipeFds[2];
+        int mFds[2];
     };
 
-    Loop() {
+    Loop(std::unique_ptr<Poller> poller = Poller::create())
+        : mPoller(std::move(poller)), mCapture(nullptr), mThreadId(std::thread::id()), mThreaded(false),
+          mWakeUpPending(false) {
+        TUYACPP_LOGD() << "using " << mPoller->name() << " poller" << std::endl;
 #ifndef TUYACPP_NO_PIPE
-        attach(mPipeHandler.readFd(), &mPipeHandler);
+        attach(mWakeUpHandler.readFd(), &mWakeUpHandler);
 #endif
     }
 
-    void attach(Handler* handler) {
-        mExtraHandlers.insert(handler);
+    /* Subscribe a handler to the events of the given types (see Event::mask()) of fd, or of
+     * all fds if fd is -1, in addition to the handler that is attached to the fd itself.
+     * Subscribing again replaces the event types. Subscriptions to an fd end when its
+     * handler is detached, after the event that is being dispatched then.
+     */
+    void attach(Handler* handler, uint8_t events = Event::ALL, int fd = -1) {
+        auto& subscribers = (fd < 0) ? mSubscribers : mFdSubscribers[fd];
+        for (auto& sub : subscribers) {
+            if (sub.handler == handler) {
+                sub.events = events;
+                return;
+            }
+        }
+        subscribers.push_back({handler, events});
     }
 
+    /* remove all subscriptions of handler, for all fds */
     void detach(Handler* handler) {
-        mExtraHandlers.erase(handler);
+        unsubscribe(mSubscribers, handler);
+        for (auto& it : mFdSubscribers)
+            unsubscribe(it.second, handler);
+        if (!mDispatching)
+            compact();
     }
 
     int attach(int fd, Handler* handler) {
         if (mHandlers.count(fd)) {
-            LOGE() << "fd " << fd << " already registered" << std::endl;
+            TUYACPP_LOGE() << "fd " << fd << " already registered" << std::endl;
             return -EALREADY;
         }
 
         mHandlers[fd] = handler;
 
-        return 0;
+        return updateInterest(fd);
     }
 
     int attachWritable(int fd, Handler* handler) {
         if (mWritableHandlers.count(fd)) {
-            LOGE() << "fd " << fd << " already registered" << std::endl;
+            TUYACPP_LOGE() << "fd " << fd << " already registered" << std::endl;
             return -EALREADY;
         }
 
         mWritableHandlers[fd] = handler;
 
-        return 0;
+        return updateInterest(fd);
     }
 
+    /* also drops a writable handler that is still registered for fd, the fd may be reused */
     int detach(int fd) {
+        const bool writable = mWritableHandlers.erase(fd);
         if (!mHandlers.count(fd))
-            return -ENOENT;
+            return writable ? updateInterest(fd) : -ENOENT;
 
         mHandlers.erase(fd);
+        if (mDispatching) {
+            mDetachedFds.push_back(fd);
+            mCompactPending = true;
+        } else {
+            mFdSubscribers.erase(fd);
+        }
 
-        return 0;
+        return updateInterest(fd);
+    }
+
+    int detachWritable(int fd) {
+        if (!mWritableHandlers.erase(fd))
+            return -ENOENT;
+
+        return updateInterest(fd);
     }
 
     Handler* getHandler(int fd) {
         return mHandlers.at(fd);
     }
 
-    void pushWork(std::function<void()>&& work, uint32_t delayMs = 0) {
-        mWork.push(DelayedWork(std::chrono::steady_clock::now() + std::chrono::milliseconds(delayMs), work));
+    /* record all data received by the socket handlers of this loop, nullptr stops capturing */
+    void setCapture(CaptureWriter* capture) {
+        mCapture = capture;
+    }
+
+    CaptureWriter* capture() const {
+        return mCapture;
+    }
+
+    /* the connection attempts of the TCP clients of this loop */
+    ConnectManager& connectManager() {
+        return mConnectManager;
+    }
+
+    /* Schedule work to be run in the loop after delayMs, the returned handle can be used to
+     * cancel or reschedule it until it has run. Timers are only touched in the loop thread,
+     * which computes its poll timeout after running the handlers, so no wakeup is needed.
+     * Use post() from other threads.
+     */
+    TimerQueue::Handle pushWork(std::function<void()>&& work, uint32_t delayMs = 0) {
+        return mTimers.schedule(std::move(work), delayMs);
+    }
+
+    /* Run work in the loop thread as soon as possible. Unlike everything else in the loop,
+     * this can be called from any thread, it does not take a lock.
+     */
+    void post(std::function<void()>&& work) {
+        mPosted.push(std::move(work));
 #ifndef TUYACPP_NO_PIPE
         wakeUp();
 #endif
     }
 
+    /* true if called from the thread that runs the loop, or if the loop has not run yet and
+     * no thread has been started for it (see setThreaded())
+     */
+    bool isLoopThread() const {
+        const auto id = mThreadId.load();
+        if (id == std::thread::id())
+            return !mThreaded;
+        return id == std::this_thread::get_id();
+    }
+
+    /* Call before starting the thread that is going to run the loop: from then on, all
+     * other threads are foreign, also before that thread has entered loop() for the first
+     * time, and have to post() their work.
+     */
+    void setThreaded() {
+        mThreaded = true;
+    }
+
+    bool cancel(TimerQueue::Handle handle) {
+        return mTimers.cancel(handle);
+    }
+
+    bool reschedule(TimerQueue::Handle handle, uint32_t delayMs) {
+        return mTimers.reschedule(handle, delayMs);
+    }
+
     void handleEvent(Event&& e) {
+        mDispatching++;
         auto handler = mHandlers.find(e.fd);
         if (handler != mHandlers.end())
             handler->second->handle(e);
 
-        for (auto &hIt : mExtraHandlers)
-            hIt->handle(e);
+        /* subscriber lists are only erased from the map by compact(), so they stay valid
+         * while handlers modify the map
+         */
+        auto fdSubscribers = mFdSubscribers.find(e.fd);
+        if (fdSubscribers != mFdSubscribers.end())
+            notify(fdSubscribers->second, e);
+        notify(mSubscribers, e);
+
+        if (!--mDispatching && mCompactPending)
+            compact();
     }
 
     int loop(unsigned int timeoutMs = 1000, LogStream::Level logLevel = LogStream::INFO) {
-        int delayMs = timeoutMs;
-        while (mWork.size()) {
-            const auto& nextWork = mWork.top();
-            const auto& delay = nextWork.deadline - std::chrono::steady_clock::now();
-            delayMs = std::chrono::duration_cast<std::chrono::milliseconds>(delay).count();
-            if (delayMs <= 0) {
-                LOGD() << "executing scheduled work with deadline " << (-delayMs) << " ms ago" << std::endl;
-                nextWork.work();
-                mWork.pop();
-                delayMs = timeoutMs;
-            } else {
-                LOGD() << "work scheduled in " << delayMs << " ms" << std::endl;
-                break;
-            }
+        mThreadId = std::this_thread::get_id();
+
+        /* Reset before draining, so that work posted from now on wakes us up again. This
+         * is an exchange so that it synchronizes with the post() that has set the flag.
+         */
+        mWakeUpPending.exchange(false, std::memory_order_acq_rel);
+        if (runPosted())
+            timeoutMs = 0;
+
+        /* the poll timeout is the time until the next live timer */
+        int delayMs = mTimers.runExpired();
+        if (delayMs >= 0) {
+            TUYACPP_LOGD() << "work scheduled in " << delayMs << " ms" << std::endl;
+            timeoutMs = ((unsigned) delayMs < timeoutMs) ? delayMs : timeoutMs;
         }
-        timeoutMs = (delayMs < (int) timeoutMs) ? delayMs : timeoutMs;
 
-        fd_set readFds;
-        fd_set writeFds;
-        FD_ZERO(&readFds);
-        FD_ZERO(&writeFds);
-        int maxFd = 0;
-        int maxWritableFd = 0;
-
-        for (const auto &it : mHandlers) {
-            FD_SET(it.first, &readFds);
-            if (it.first > maxFd)
-                maxFd = it.first;
+        int ret = mPoller->wait(mReady, timeoutMs);
+        TUYACPP_LOGD() << "poll done, " << ret << " fds ready" << std::endl;
+        if (ret < 0) {
+            TUYACPP_LOGE() << mPoller->name() << " failed: " << ret << std::endl;
+            return ret;
         }
 
-        for (const auto &it : mWritableHandlers) {
-            FD_SET(it.first, &writeFds);
-            if (it.first > maxFd)
-                maxWritableFd = it.first;
+        /* read data from all readable FDs */
+        for (const auto &r : mReady) {
+            if ((r.events & Poller::READ) && mHandlers.count(r.fd))
+                handleEvent(ReadableEvent(r.fd, logLevel));
         }
-        maxFd = (maxWritableFd > maxFd) ? maxWritableFd : maxFd;
-
-#ifndef TUYACPP_NO_PIPE
-        FD_SET(mPipeHandler.readFd(), &readFds);
-        maxFd = (mPipeHandler.readFd() > maxFd) ? mPipeHandler.readFd() : maxFd;
-#endif
-
-        struct timeval tv = {
-            .tv_sec = timeoutMs / 1000,
-            .tv_usec = (timeoutMs % 1000 ) * 1000,
-        };
 
-        int ret = select(++maxFd, &readFds, &writeFds, NULL, &tv);
-        LOGD() << "select done, " << ret << " fds readable" << std::endl;
-        if (ret < 0) {
-            LOGE() << "select() failed: " << ret << std::endl;
-            return ret;
-        } else {
-            /* read data from all readable FDs */
-            for (const auto &it : mHandlers) {
-                const auto &fd = it.first;
-                if (FD_ISSET(fd, &readFds))
-                    handleEvent(ReadableEvent(fd, logLevel));
-            }
-            std::list<int> removeList;
-            for (const auto &it : mWritableHandlers) {
-                const auto &fd = it.first;
-                if (FD_ISSET(fd, &writeFds)) {
-                    WritableEvent e(fd, logLevel);
-                    mWritableHandlers[fd]->handle(e);
-                    removeList.push_back(fd);
-                }
-            }
-            for (int fd : removeList)
-                mWritableHandlers.erase(fd);
+        /* writable handlers are one-shot, they are removed before being called so that
+         * they can re-register themselves
+         */
+        for (const auto &r : mReady) {
+            if (!(r.events & Poller::WRITE))
+                continue;
+            auto it = mWritableHandlers.find(r.fd);
+            if (it == mWritableHandlers.end())
+                continue;
+            Handler* handler = it->second;
+            mWritableHandlers.erase(it);
+            updateInterest(r.fd);
+            WritableEvent e(r.fd, logLevel);
+            handler->handle(e);
         }
 
         return 0;
     }
 
 #ifndef TUYACPP_NO_PIPE
+    /* can be called from any thread, there is at most one pending wakeup per iteration */
     void wakeUp() {
-        mPipeHandler.write();
+        if (!mWakeUpPending.exchange(true, std::memory_order_acq_rel))
+            mWakeUpHandler.signal();
     }
 #endif
 
 private:
     LOG_MEMBERS(LOOP);
 
+    int updateInterest(int fd) {
+        uint8_t events = Poller::NONE;
+        if (mHandlers.count(fd))
+            events |= Poller::READ;
+        if (mWritableHandlers.count(fd))
+            events |= Poller::WRITE;
+        return mPoller->update(fd, events);
+    }
+
+    struct Subscription {
+        Handler* handler;
+        uint8_t events;
+    };
+
+    /* By index, as handlers may subscribe while being notified. Subscriptions that are
+     * removed meanwhile are only marked (see unsubscribe()).
+     */
+    static void notify(std::vector<Subscription>& subscribers, Event& e) {
+        const uint8_t mask = Event::mask(e.type);
+        for (size_t i = 0; i < subscribers.size(); i++) {
+            if (subscribers[i].handler && (subscribers[i].events & mask))
+                subscribers[i].handler->handle(e);
+        }
+    }
+
+    /* while events are dispatched, subscriptions are marked and erased by compact() once
+     * the outermost dispatch is done, so that no subscriber moves into a slot that has
+     * already been notified
+     */
+    void unsubscribe(std::vector<Subscription>& subscribers, Handler* handler) {
+        for (auto& sub : subscribers) {
+            if (sub.handler == handler) {
+                sub.handler = nullptr;
+                mCompactPending = true;
+            }
+        }
+    }
+
+    void compact() {
+        mCompactPending = false;
+        for (int fd : mDetachedFds) {
+            if (!mHandlers.count(fd))
+                mFdSubscribers.erase(fd);
+        }
+        mDetachedFds.clear();
+
+        auto isDead = [] (const Subscription& sub) { return sub.handler == nullptr; };
+        mSubscribers.erase(std::remove_if(mSubscribers.begin(), mSubscribers.end(), isDead), mSubscribers.end());
+        for (auto it = mFdSubscribers.begin(); it != mFdSubscribers.end();) {
+            auto& subscribers = it->second;
+            subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end(), isDead), subscribers.end());
+            if (subscribers.empty())
+                it = mFdSubscribers.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    /* run posted work in batches so that a flood of posts cannot starve I/O, returns true
+     * if there is more
+     */
+    bool runPosted() {
+        std::function<void()> work;
+        for (size_t n = MAX_POSTED_PER_ITERATION; n && mPosted.pop(work); n--) {
+            work();
+            work = nullptr;
+        }
+        return !mPosted.empty();
+    }
+
 #ifndef TUYACPP_NO_PIPE
-    PipeHandler mPipeHandler;
+    WakeUpHandler mWakeUpHandler;
 #endif
 
-    std::priority_queue<DelayedWork, std::vector<DelayedWork>, OrderByDeadline> mWork;
-    std::map<int, Handler*> mHandlers;
-    std::map<int, Handler*> mWritableHandlers;
-    std::set<Handler*> mExtraHandlers;
+    std::unique_ptr<Poller> mPoller;
+    std::vector<Poller::Ready> mReady;
+    CaptureWriter* mCapture;
+    TimerQueue mTimers;
+    ConnectManager mConnectManager;
+    std::unordered_map<int, Handler*> mHandlers;
+    std::unordered_map<int, Handler*> mWritableHandlers;
+    std::vector<Subscription> mSubscribers;
+    std::unordered_map<int, std::vector<Subscription>> mFdSubscribers;
+    std::vector<int> mDetachedFds;
+    unsigned int mDispatching = 0;
+    bool mCompactPending = false;
+    std::atomic<std::thread::id> mThreadId;
+    std::atomic_bool mThreaded;
+    std::atomic_bool mWakeUpPending;
+    MpscQueue<std::function<void()>> mPosted;
 };
 
 } // namespace tuya
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "loop.hpp"
+
+namespace tuya {
+
+/* A fixed number of loops, each one run by its own thread. Every device is placed on one
+ * of the loops (its shard) and all of its state is only accessed from that loop's thread,
+ * work for a device has to be posted to its shard with post().
+ *
+ * Handlers, devices and scanners that use the pool must only be destroyed after stop().
+ */
+class LoopPool {
+public:
+    enum Placement {
+        HASH,           // shard by hash of the IP address
+        LEAST_LOADED,   // shard with the fewest devices
+    };
+
+    LoopPool(size_t size = std::thread::hardware_concurrency(), Placement placement = HASH)
+        : mPlacement(placement), mRunning(false) {
+        if (!size)
+            size = 1;
+        for (size_t i = 0; i < size; i++)
+            mLoops.push_back(std::make_unique<Loop>());
+        mLoad.resize(size, 0);
+    }
+
+    ~LoopPool() {
+        stop();
+    }
+
+    void start(unsigned int timeoutMs = 1000, LogStream::Level logLevel = LogStream::INFO) {
+        if (mRunning.exchange(true))
+            return;
+
+        for (auto& loop : mLoops) {
+            Loop* l = loop.get();
+            l->setThreaded();
+            mThreads.emplace_back([this, l, timeoutMs, logLevel] () {
+                while (mRunning) {
+                    try {
+                        l->loop(timeoutMs, logLevel);
+                    } catch (const std::runtime_error& e) {
+                        TUYACPP_LOGE() << "runtime error: " << e.what() << std::endl;
+                    }
+                }
+            });
+        }
+    }
+
+    void stop() {
+        if (!mRunning.exchange(false))
+            return;
+
+#ifndef TUYACPP_NO_PIPE
+        for (auto& loop : mLoops)
+            loop->wakeUp();
+#endif
+        for (auto& thread : mThreads)
+            thread.join();
+        mThreads.clear();
+    }
+
+    bool isRunning() const {
+        return mRunning;
+    }
+
+    size_t size() const {
+        return mLoops.size();
+    }
+
+    Loop& loop(size_t index) {
+        return *mLoops.at(index);
+    }
+
+    /* shard of the device with the given IP address, assigned on first use */
+    size_t shard(const std::string& ip) {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        auto it = mShards.find(ip);
+        if (it != mShards.end())
+            return it->second;
+
+        size_t index = 0;
+        if (mPlacement == LEAST_LOADED) {
+            for (size_t i = 1; i < mLoad.size(); i++) {
+                if (mLoad[i] < mLoad[index])
+                    index = i;
+            }
+        } else {
+            index = std::hash<std::string>()(ip) % mLoops.size();
+        }
+
+        mLoad[index]++;
+        mShards[ip] = index;
+        return index;
+    }
+
+    Loop& loopFor(const std::string& ip) {
+        return loop(shard(ip));
+    }
+
+    /* run work in the thread of the shard that owns ip */
+    void post(const std::string& ip, std::function<void()>&& work) {
+        loopFor(ip).post(std::move(work));
+    }
+
+    /* Loop::pushWork() in the thread of the shard that owns ip. The timer handle only exists
+     * in that thread, work that has to be cancelled should be scheduled from there.
+     */
+    void pushWork(const std::string& ip, std::function<void()>&& work, uint32_t delayMs) {
+        Loop& l = loopFor(ip);
+        l.post([&l, w = std::move(work), delayMs] () mutable { l.pushWork(std::move(w), delayMs); });
+    }
+
+    /* capture the data received by all shards, see Loop::setCapture() */
+    void setCapture(CaptureWriter* capture) {
+        for (auto& loop : mLoops) {
+            Loop* l = loop.get();
+            if (mRunning)
+                l->post([l, capture] () { l->setCapture(capture); });
+            else
+                l->setCapture(capture);
+        }
+    }
+
+    /* subscribe a handler to the events of all shards (see Loop::attach()), note that it is
+     * called from all loop threads
+     */
+    void attach(Handler* handler, uint8_t events = Event::ALL, int fd = -1) {
+        for (auto& loop : mLoops) {
+            Loop* l = loop.get();
+            if (mRunning)
+                l->post([l, handler, events, fd] () { l->attach(handler, events, fd); });
+            else
+                l->attach(handler, events, fd);
+        }
+    }
+
+    void detach(Handler* handler) {
+        for (auto& loop : mLoops) {
+            Loop* l = loop.get();
+            if (mRunning)
+                l->post([l, handler] () { l->detach(handler); });
+            else
+                l->detach(handler);
+        }
+    }
+
+    /* limit the connection attempts of all shards together, each gets an equal share of at
+     * least one (see ConnectManager), 0 removes the limit
+     */
+    void setMaxConnectsInProgress(size_t max) {
+        const size_t share = max ? std::max<size_t>(1, max / mLoops.size()) : 0;
+        for (auto& loop : mLoops) {
+            Loop* l = loop.get();
+            if (mRunning)
+                l->post([l, share] () { l->connectManager().setMaxInProgress(share); });
+            else
+                l->connectManager().setMaxInProgress(share);
+        }
+    }
+
+    ConnectManager::Stats connectStats() {
+        ConnectManager::Stats stats{};
+        for (auto& loop : mLoops)
+            stats += loop->connectManager().stats();
+        return stats;
+    }
+
+private:
+    LOG_MEMBERS(LOOPPOOL);
+
+    const Placement mPlacement;
+    std::atomic_bool mRunning;
+    std::vector<std::unique_ptr<Loop>> mLoops;
+    std::vector<std::thread> mThreads;
+    std::mutex mMutex;
+    std::map<std::string, size_t> mShards;
+    std::vector<size_t> mLoad;
+};
+
+} // namespace tuya
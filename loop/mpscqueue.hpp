@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+namespace tuya {
+
+/* Unbounded lock-free multi-producer single-consumer queue (Vyukov). push() can be called
+ * from any thread and is wait-free, pop() must only be called from one consumer thread.
+ *
+ * A producer that has been preempted in the middle of push() makes the queue look empty
+ * to the consumer until it continues, so the consumer must be woken up again after each
+ * push() to be sure to see all items.
+ */
+template <typename T>
+class MpscQueue {
+public:
+    MpscQueue() : mHead(&mStub), mTail(&mStub) {}
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    ~MpscQueue() {
+        T item;
+        while (pop(item))
+            ;
+    }
+
+    void push(T&& item) {
+        Node* node = new Node(std::move(item));
+        Node* prev = mHead.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    bool pop(T& item) {
+        Node* tail = mTail;
+        Node* next = tail->next.load(std::memory_order_acquire);
+
+        /* skip the stub node */
+        if (tail == &mStub) {
+            if (!next)
+                return false;
+            mTail = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+
+        if (next) {
+            mTail = next;
+            item = std::move(tail->item);
+            delete tail;
+            return true;
+        }
+
+        /* tail is the last node, re-insert the stub behind it so that it can be removed */
+        if (tail != mHead.load(std::memory_order_acquire))
+            return false;
+        mStub.next.store(nullptr, std::memory_order_relaxed);
+        Node* prev = mHead.exchange(&mStub, std::memory_order_acq_rel);
+        prev->next.store(&mStub, std::memory_order_release);
+
+        next = tail->next.load(std::memory_order_acquire);
+        if (!next)
+            return false;
+        mTail = next;
+        item = std::move(tail->item);
+        delete tail;
+        return true;
+    }
+
+    /* only reliable in the consumer thread, see above */
+    bool empty() const {
+        return (mTail == &mStub) && !mStub.next.load(std::memory_order_acquire);
+    }
+
+private:
+    struct Node {
+        Node() : next(nullptr) {}
+        Node(T&& i) : next(nullptr), item(std::move(i)) {}
+
+        std::atomic<Node*> next;
+        T item;
+    };
+
+    Node mStub;
+    std::atomic<Node*> mHead;
+    Node* mTail;
+};
+
+} // namespace tuya
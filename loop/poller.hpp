@@ -0,0 +1,234 @@
+#pragma once
+
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/select.h>
+#include <unistd.h>
+
+#if defined(__linux__) && !defined(TUYACPP_NO_PIPE) && !defined(TUYACPP_USE_SELECT)
+    #define TUYACPP_USE_EPOLL
+    #include <sys/epoll.h>
+#endif
+
+#include "../logging.hpp"
+
+namespace tuya {
+
+/* The poller keeps the interest list of the loop across iterations. It is only modified
+ * through update() when handlers are attached or detached, and wait() only reports the
+ * fds that are actually ready.
+ */
+class Poller {
+public:
+    enum Events : uint8_t {
+        NONE    = 0,
+        READ    = 1 << 0,
+        WRITE   = 1 << 1,
+    };
+
+    struct Ready {
+        int fd;
+        uint8_t events;
+    };
+
+    virtual ~Poller() = default;
+
+    /* replace the set of events we are interested in for fd, NONE removes the fd */
+    virtual int update(int fd, uint8_t events) = 0;
+
+    /* wait up to timeoutMs for events, ready is cleared and filled with the ready fds */
+    virtual int wait(std::vector<Ready>& ready, unsigned int timeoutMs) = 0;
+
+    virtual const char* name() const = 0;
+
+    static std::unique_ptr<Poller> create();
+
+protected:
+    LOG_MEMBERS(POLLER);
+};
+
+class SelectPoller : public Poller {
+public:
+    SelectPoller() : mMaxFd(-1) {
+        FD_ZERO(&mReadFds);
+        FD_ZERO(&mWriteFds);
+    }
+
+    virtual int update(int fd, uint8_t events) override {
+        if ((fd < 0) || (fd >= FD_SETSIZE)) {
+            TUYACPP_LOGE() << "fd " << fd << " cannot be used with select()" << std::endl;
+            return -EINVAL;
+        }
+
+        if (events & READ)
+            FD_SET(fd, &mReadFds);
+        else
+            FD_CLR(fd, &mReadFds);
+
+        if (events & WRITE)
+            FD_SET(fd, &mWriteFds);
+        else
+            FD_CLR(fd, &mWriteFds);
+
+        if ((unsigned) fd >= mInterest.size())
+            mInterest.resize(fd + 1, NONE);
+        mInterest[fd] = events;
+
+        if (events && (fd > mMaxFd)) {
+            mMaxFd = fd;
+        } else if (!events && (fd == mMaxFd)) {
+            while ((mMaxFd >= 0) && (mInterest[mMaxFd] == NONE))
+                mMaxFd--;
+        }
+
+        return 0;
+    }
+
+    virtual int wait(std::vector<Ready>& ready, unsigned int timeoutMs) override {
+        ready.clear();
+
+        /* the persistent sets are only copied, select() modifies its arguments */
+        fd_set readFds = mReadFds;
+        fd_set writeFds = mWriteFds;
+
+        struct timeval tv = {
+            .tv_sec = timeoutMs / 1000,
+            .tv_usec = (timeoutMs % 1000 ) * 1000,
+        };
+
+        int ret = select(mMaxFd + 1, &readFds, &writeFds, NULL, &tv);
+        if (ret < 0)
+            return (errno == EINTR) ? 0 : -errno;
+
+        for (int fd = 0; (fd <= mMaxFd) && (ready.size() < (unsigned) ret); fd++) {
+            uint8_t events = NONE;
+            if (FD_ISSET(fd, &readFds))
+                events |= READ;
+            if (FD_ISSET(fd, &writeFds))
+                events |= WRITE;
+            if (events)
+                ready.push_back({fd, events});
+        }
+
+        return ready.size();
+    }
+
+    virtual const char* name() const override {
+        return "select";
+    }
+
+private:
+    fd_set mReadFds;
+    fd_set mWriteFds;
+    int mMaxFd;
+    std::vector<uint8_t> mInterest;
+};
+
+#ifdef TUYACPP_USE_EPOLL
+class EpollPoller : public Poller {
+    static const int MAX_EVENTS = 256;
+
+public:
+    EpollPoller() : mEpollFd(epoll_create1(EPOLL_CLOEXEC)), mEvents(MAX_EVENTS) {
+        if (mEpollFd < 0)
+            throw std::runtime_error("epoll_create1() failed");
+    }
+
+    ~EpollPoller() {
+        close(mEpollFd);
+    }
+
+    virtual int update(int fd, uint8_t events) override {
+        if (fd < 0)
+            return -EINVAL;
+
+        if ((unsigned) fd >= mInterest.size())
+            mInterest.resize(fd + 1, NONE);
+        uint8_t& interest = mInterest[fd];
+        if (interest == events)
+            return 0;
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.data.fd = fd;
+        if (events & READ)
+            ev.events |= EPOLLIN;
+        if (events & WRITE)
+            ev.events |= EPOLLOUT;
+
+        int op = (interest == NONE) ? EPOLL_CTL_ADD : ((events == NONE) ? EPOLL_CTL_DEL : EPOLL_CTL_MOD);
+        int ret = epoll_ctl(mEpollFd, op, fd, &ev);
+        if (ret < 0) {
+            /* the kernel drops closed fds from the interest list on its own, so our view
+             * of it can be stale when an fd is closed before it is detached
+             */
+            if ((op == EPOLL_CTL_ADD) && (errno == EEXIST))
+                ret = epoll_ctl(mEpollFd, EPOLL_CTL_MOD, fd, &ev);
+            else if ((op == EPOLL_CTL_MOD) && (errno == ENOENT))
+                ret = epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &ev);
+            else if ((op == EPOLL_CTL_DEL) && ((errno == ENOENT) || (errno == EBADF)))
+                ret = 0;
+        }
+
+        if (ret < 0) {
+            TUYACPP_LOGE() << "epoll_ctl() failed for fd " << fd << ": " << strerror(errno) << std::endl;
+            return -errno;
+        }
+
+        interest = events;
+        return 0;
+    }
+
+    virtual int wait(std::vector<Ready>& ready, unsigned int timeoutMs) override {
+        ready.clear();
+
+        int ret = epoll_wait(mEpollFd, mEvents.data(), mEvents.size(), timeoutMs);
+        if (ret < 0)
+            return (errno == EINTR) ? 0 : -errno;
+
+        for (int i = 0; i < ret; i++) {
+            const auto& ev = mEvents[i];
+            const int fd = ev.data.fd;
+            const uint8_t interest = ((unsigned) fd < mInterest.size()) ? mInterest[fd] : (uint8_t) NONE;
+
+            /* like select(), report errors and hangups as readiness so that the handler
+             * gets to see them in recv() / getsockopt()
+             */
+            uint8_t events = NONE;
+            if (ev.events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                events |= READ;
+            if (ev.events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+                events |= WRITE;
+            events &= interest;
+
+            if (events)
+                ready.push_back({fd, events});
+        }
+
+        return ready.size();
+    }
+
+    virtual const char* name() const override {
+        return "epoll";
+    }
+
+private:
+    int mEpollFd;
+    std::vector<struct epoll_event> mEvents;
+    std::vector<uint8_t> mInterest;
+};
+#endif
+
+inline std::unique_ptr<Poller> Poller::create() {
+#ifdef TUYACPP_USE_EPOLL
+    return std::make_unique<EpollPoller>();
+#else
+    return std::make_unique<SelectPoller>();
+#endif
+}
+
+} // namespace tuya
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstring>
+#include <vector>
+
+namespace tuya {
+
+/* Growable receive buffer that keeps incomplete frames across reads. Data is read directly
+ * into the free space at the end and consumed from the front, the remaining bytes are only
+ * moved to the front when more space is needed.
+ */
+class ReceiveBuffer {
+public:
+    ReceiveBuffer(size_t capacity) : mBuffer(capacity), mBegin(0), mEnd(0) {}
+
+    const char* data() const {
+        return mBuffer.data() + mBegin;
+    }
+
+    size_t size() const {
+        return mEnd - mBegin;
+    }
+
+    size_t space() const {
+        return mBuffer.size() - mEnd;
+    }
+
+    /* make sure that there are at least minSpace bytes of free space after the data */
+    char* prepare(size_t minSpace) {
+        if (space() < minSpace) {
+            if (mBegin) {
+                memmove(mBuffer.data(), mBuffer.data() + mBegin, size());
+                mEnd -= mBegin;
+                mBegin = 0;
+            }
+            if (space() < minSpace)
+                mBuffer.resize(mEnd + minSpace);
+        }
+        return mBuffer.data() + mEnd;
+    }
+
+    void commit(size_t len) {
+        mEnd += len;
+    }
+
+    void consume(size_t len) {
+        mBegin += len;
+        if (mBegin >= mEnd)
+            clear();
+    }
+
+    void clear() {
+        mBegin = mEnd = 0;
+    }
+
+private:
+    std::vector<char> mBuffer;
+    size_t mBegin;
+    size_t mEnd;
+};
+
+} // namespace tuya
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+namespace tuya {
+
+/* Outbound buffer of a stream socket. Data is appended to chunks of about CHUNK_SIZE bytes,
+ * frames can be serialized straight into them, and flush() gathers up to MAX_IOV chunks into
+ * one sendmsg(). Short writes keep the rest for the next flush(), so nothing is lost when the
+ * socket is full. Chunks are recycled, so a buffer that is drained regularly stops allocating.
+ */
+class SendBuffer {
+public:
+    static const size_t CHUNK_SIZE = 4096;
+    static const size_t MAX_IOV = 16;
+    static const size_t MAX_SPARE_CHUNKS = 4;
+
+    SendBuffer() : mSize(0), mOffset(0) {}
+
+    size_t size() const {
+        return mSize;
+    }
+
+    bool empty() const {
+        return !mSize;
+    }
+
+    void append(const char* data, size_t len) {
+        append(len, [data, len] (std::string& chunk) { chunk.append(data, len); });
+    }
+
+    /* let fill(std::string&) append about sizeHint bytes to a chunk, e.g. with
+     * Message::serializeTo(), and return how many it has appended
+     */
+    template <typename F>
+    size_t append(size_t sizeHint, F&& fill) {
+        if (mChunks.empty() || (mChunks.back().size() && (mChunks.back().size() + sizeHint > CHUNK_SIZE)))
+            newChunk();
+
+        std::string& chunk = mChunks.back();
+        const size_t before = chunk.size();
+        fill(chunk);
+        mSize += chunk.size() - before;
+        return chunk.size() - before;
+    }
+
+    /* write as much as the socket takes, returns the number of bytes written or -errno for
+     * errors other than a full socket
+     */
+    ssize_t flush(int fd) {
+        ssize_t total = 0;
+
+        while (mSize) {
+            struct iovec iov[MAX_IOV];
+            size_t count = 0;
+            size_t len = 0;
+            for (auto it = mChunks.begin(); (it != mChunks.end()) && (count < MAX_IOV); ++it, ++count) {
+                const size_t offset = count ? 0 : mOffset;
+                iov[count].iov_base = const_cast<char*>(it->data()) + offset;
+                iov[count].iov_len = it->size() - offset;
+                len += iov[count].iov_len;
+            }
+
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            ssize_t ret = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
+                if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                    break;
+                return -errno;
+            }
+
+            consume(ret);
+            total += ret;
+
+            /* the socket is full, don't ask again just to get EAGAIN */
+            if ((size_t) ret < len)
+                break;
+        }
+
+        return total;
+    }
+
+    void clear() {
+        while (mChunks.size())
+            releaseFront();
+        mSize = 0;
+    }
+
+private:
+    void newChunk() {
+        std::string chunk;
+        if (mSpare.size()) {
+            chunk.swap(mSpare.back());
+            mSpare.pop_back();
+            chunk.clear();
+        }
+        chunk.reserve(CHUNK_SIZE);
+        mChunks.push_back(std::move(chunk));
+    }
+
+    void releaseFront() {
+        if (mSpare.size() < MAX_SPARE_CHUNKS)
+            mSpare.push_back(std::move(mChunks.front()));
+        mChunks.pop_front();
+        mOffset = 0;
+    }
+
+    void consume(size_t len) {
+        mSize -= len;
+        while (len) {
+            const size_t available = mChunks.front().size() - mOffset;
+            if (len < available) {
+                mOffset += len;
+                return;
+            }
+            len -= available;
+            releaseFront();
+        }
+
+        if (!mSize)
+            clear();
+    }
+
+    std::deque<std::string> mChunks;
+    std::vector<std::string> mSpare;
+    size_t mSize;
+    size_t mOffset;
+};
+
+} // namespace tuya
@@ -5,7 +5,9 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 
+#include "receivebuffer.hpp"
 #include "../protocol/message55aa.hpp"
+#include "../protocol/message6699.hpp"
 
 namespace tuya {
 
@@ -13,64 +15,126 @@ class SocketHandler : public Handler {
 protected:
     static const uint32_t RECONNECT_DELAY_MS = 3000;
     static const size_t BUFFER_SIZE = 1024;
+    static const size_t MAX_FRAME_SIZE = 64 * 1024;
 
 public:
     SocketHandler(Loop& loop, const std::string& key, int port)
-        : mLoop(loop), mSocketFd(-1), mBuffer("\0", BUFFER_SIZE), mKey(key) {
+        : mLoop(loop), mSocketFd(-1), mRxBuffer(BUFFER_SIZE), mCipher(key), mVersion(Message::V3_3) {
         memset(&mAddr, 0, sizeof(mAddr));
         mAddr.sin_family = AF_INET;
         mAddr.sin_port = htons(port);
     }
 
-    virtual int read(std::string& addrStr) = 0;
+    virtual int read(char* buf, size_t len, std::string& addrStr) = 0;
+
+    /* stream sockets keep incomplete frames in the receive buffer until the next read,
+     * datagram sockets drop them
+     */
+    virtual bool isStream() const {
+        return true;
+    }
+
+    /* frames sent by devices carry a return code, frames sent to them (e.g. received by a
+     * simulated device) don't
+     */
+    virtual bool hasRetCode() const {
+        return true;
+    }
+
+    /* the protocol version of the peer, which decides how 55AA frames are authenticated */
+    Message::Version version() const {
+        return mVersion;
+    }
+
+    void setVersion(Message::Version version) {
+        mVersion = version;
+    }
 
     virtual void handleReadable(ReadableEvent& e) override {
         if ((mSocketFd == -1) || (mSocketFd != e.fd))
             return;
 
         std::string addr;
-        int ret = read(addr);
+        char* buf = mRxBuffer.prepare(BUFFER_SIZE);
+        int ret = read(buf, mRxBuffer.space(), addr);
         if (ret > 0) {
-            mLoop.handleEvent(ReadEvent(mSocketFd, mBuffer.substr(0, ret), addr, e.logLevel));
+            CaptureWriter* capture = mLoop.capture();
+            if (capture)
+                capture->write(mSocketFd, addr, isStream() ? Capture::NONE : Capture::DATAGRAM, buf, ret);
+            mRxBuffer.commit(ret);
+            mLoop.handleEvent(ReadEvent(mSocketFd, buf, ret, addr, e.logLevel));
+            if (!isStream())
+                mRxBuffer.clear();
         } else {
-            EV_LOGW(e) << "read failed, closing connection" << std::endl;
+            TUYACPP_EV_LOGW(e) << "read failed, closing connection" << std::endl;
             mLoop.pushWork([this, addr, l=e.logLevel] () {
                 mLoop.handleEvent(CloseEvent(mSocketFd, addr, l));
             });
         }
     }
 
+    /* Pass data through the receive path as if it had been read from the socket, e.g. to
+     * replay a capture. The handler must have a socket.
+     */
+    int receive(const char* data, size_t len, const std::string& addr, LogStream::Level logLevel = LogStream::INFO) {
+        if (mSocketFd == -1)
+            return -ENOTCONN;
+
+        char* buf = mRxBuffer.prepare(len);
+        memcpy(buf, data, len);
+        mRxBuffer.commit(len);
+        mLoop.handleEvent(ReadEvent(mSocketFd, buf, len, addr, logLevel));
+        if (!isStream())
+            mRxBuffer.clear();
+        return 0;
+    }
+
+    /* the data of the event has already been appended to the receive buffer, parse all
+     * complete frames from there and keep the rest for the next read
+     */
     virtual void handleRead(ReadEvent& e) override {
         if ((mSocketFd == -1) || (mSocketFd != e.fd))
             return;
 
-        if (e.data.length() < 2 * sizeof(uint32_t))
-            throw std::runtime_error("message too short");
+        while ((mSocketFd == e.fd) && (mRxBuffer.size() >= sizeof(uint32_t))) {
+            const char* data = mRxBuffer.data();
+            const size_t len = mRxBuffer.size();
+
+            uint32_t prefix;
+            memcpy(&prefix, data, sizeof(prefix));
+            prefix = ntohl(prefix);
+
+            size_t frameLen;
+            if (prefix == Message55AA::PREFIX) {
+                frameLen = Message55AA::frameLength(data, len);
+            } else if (prefix == Message6699::PREFIX) {
+                frameLen = Message6699::frameLength(data, len);
+            } else {
+                TUYACPP_EV_LOGE(e) << "unknown prefix: 0x" << std::hex << prefix << std::dec << std::endl;
+                resync(e, 1);
+                continue;
+            }
+            if (!frameLen)
+                break;
 
-        uint32_t prefix = ntohl(*reinterpret_cast<const uint32_t*>(e.data.data()));
-        switch(prefix) {
-        case Message55AA::PREFIX: {
-            /* check for remaining messages in buffer */
-            uint32_t parsedLen = 0;
-            uint32_t rawLen = e.data.length();
-            while (parsedLen < rawLen) {
-                uint32_t stepParsedLen = 0;
-                Message55AA msg(e.data.substr(parsedLen), stepParsedLen, mKey, false);
-                if (msg.hasData())
-                    mLoop.handleEvent(MessageEvent(mSocketFd, msg, e.addr, e.logLevel));
-                else
-                    EV_LOGE(e) << "failed to parse data in " << static_cast<std::string>(msg) << std::endl;
-                parsedLen += stepParsedLen;
+            if (frameLen > MAX_FRAME_SIZE) {
+                TUYACPP_EV_LOGE(e) << "frame too long: " << frameLen << " bytes" << std::endl;
+                resync(e, 1);
+                continue;
             }
-            break;
-        }
-        default:
-            EV_LOGE(e) << "unknown prefix: 0x" << std::hex << prefix << std::dec << std::endl;
+
+            if (len < frameLen)
+                break;
+
+            if (prefix == Message6699::PREFIX)
+                parseFrame<Message6699>(e, data, frameLen);
+            else
+                parseFrame<Message55AA>(e, data, frameLen, mVersion);
         }
     }
 
     virtual void handleClose(CloseEvent& e) override {
-        EV_LOGW(e) << "socket closed" << std::endl;
+        TUYACPP_EV_LOGW(e) << "socket closed" << std::endl;
     }
 
     ~SocketHandler() {
@@ -88,10 +152,49 @@ protected:
     Loop& mLoop;
     int mSocketFd;
     struct sockaddr_in mAddr;
-    std::string mBuffer;
+    ReceiveBuffer mRxBuffer;
+    Cipher mCipher;
+    Message::Version mVersion;
 
 private:
-    std::string mKey;
+    /* the message is parsed on the stack, args are passed to its constructor after the
+     * common ones
+     */
+    template <typename M, typename... Args>
+    void parseFrame(ReadEvent& e, const char* data, size_t frameLen, Args&&... args) {
+        bool parsed = false;
+        try {
+            uint32_t parsedLen = 0;
+            M msg(data, frameLen, parsedLen, mCipher, !hasRetCode(), std::forward<Args>(args)...);
+            parsed = true;
+            mRxBuffer.consume(parsedLen);
+            if (msg.hasData())
+                mLoop.handleEvent(MessageEvent(mSocketFd, msg, e.addr, e.logLevel));
+            else
+                TUYACPP_EV_LOGE(e) << "failed to parse data in " << static_cast<std::string>(msg) << std::endl;
+        } catch (const std::runtime_error& err) {
+            if (parsed)
+                throw;
+            TUYACPP_EV_LOGE(e) << "invalid frame: " << err.what() << std::endl;
+            resync(e, 1);
+        }
+    }
+
+    /* drop at least skip bytes and everything up to the next frame prefix */
+    void resync(Event& e, size_t skip) {
+        static const char prefix55AA[] = { 0x00, 0x00, 0x55, (char) 0xaa };
+        static const char prefix6699[] = { 0x00, 0x00, 0x66, (char) 0x99 };
+        const char* data = mRxBuffer.data();
+        const size_t len = mRxBuffer.size();
+
+        size_t pos = skip;
+        while ((pos < len) && memcmp(data + pos, prefix55AA, std::min(sizeof(prefix55AA), len - pos)) &&
+               memcmp(data + pos, prefix6699, std::min(sizeof(prefix6699), len - pos)))
+            pos++;
+
+        TUYACPP_EV_LOGW(e) << "dropping " << pos << " bytes" << std::endl;
+        mRxBuffer.consume(pos);
+    }
 };
 
 } // namespace tuya
@@ -1,28 +1,95 @@
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <random>
+
 #include <fcntl.h>
+#include <netinet/tcp.h>
 
+#include "sendbuffer.hpp"
 #include "sockethandler.hpp"
 
 namespace tuya {
 
 class TCPClientHandler : public SocketHandler {
+protected:
+    /* Above the high watermark, the connection is congested: callers should stop queueing
+     * until handleTxDrained() reports that it has dropped below the low watermark. Beyond
+     * TX_MAX_BUFFERED, queueTx() fails.
+     */
+    static const size_t TX_HIGH_WATERMARK = 64 * 1024;
+    static const size_t TX_LOW_WATERMARK = 16 * 1024;
+    static const size_t TX_MAX_BUFFERED = 1024 * 1024;
+
+    /* A connection that has not received anything for the heartbeat interval sends a
+     * heartbeat, and is closed if nothing arrives within HEARTBEAT_TIMEOUT_MS after it. Busy
+     * connections never send one. The interval starts at HEARTBEAT_INTERVAL_MS (or the one
+     * set with setHeartbeatInterval()), doubles after HEARTBEAT_STREAK heartbeats in a row
+     * have been answered, up to HEARTBEAT_MAX_FACTOR times the initial one, and is halved
+     * when a heartbeat is missed, down to half the initial one. Intervals are jittered so
+     * that connections which came up together do not send theirs together.
+     */
+    static const uint32_t HEARTBEAT_INTERVAL_MS = 10000;
+    static const uint32_t HEARTBEAT_TIMEOUT_MS = 5000;
+    static const uint32_t HEARTBEAT_JITTER_PERCENT = 20;
+    static const uint32_t HEARTBEAT_STREAK = 3;
+    static const uint32_t HEARTBEAT_MAX_FACTOR = 3;
+
+    /* kernel side: keepalive probes on silent connections, and a limit on how long sent
+     * data may stay unacknowledged
+     */
+    static const int KEEPALIVE_IDLE_S = 30;
+    static const int KEEPALIVE_INTERVAL_S = 5;
+    static const int KEEPALIVE_COUNT = 3;
+    static const unsigned int USER_TIMEOUT_MS = 15000;
+
+    /* Connection attempts go through the ConnectManager of the loop. After a failure the
+     * next attempt waits RECONNECT_MIN_DELAY_MS, doubling with every further failure up to
+     * RECONNECT_MAX_DELAY_MS, each delay jittered. Connections that are closed before
+     * RECONNECT_STABLE_MS count as failures, others reconnect right away.
+     */
+    static const uint32_t CONNECT_TIMEOUT_MS = 5000;
+    static const uint32_t RECONNECT_MIN_DELAY_MS = 1000;
+    static const uint32_t RECONNECT_MAX_DELAY_MS = 60000;
+    static const uint32_t RECONNECT_JITTER_PERCENT = 50;
+    static const uint32_t RECONNECT_STABLE_MS = 10000;
+
 public:
     TCPClientHandler(Loop& loop, const std::string& ip, int port, const std::string& key)
-        : SocketHandler(loop, key, port), mIp(ip), mIsConnected(false) {
+        : SocketHandler(loop, key, port), mIp(ip), mIsConnected(false), mTxCongested(false), mWaitingWritable(false),
+          mHeartbeatIntervalMs(HEARTBEAT_INTERVAL_MS), mIdleIntervalMs(HEARTBEAT_INTERVAL_MS), mHeartbeatSent(false),
+          mHeartbeatsAnswered(0), mConnectState(CONNECT_IDLE),
+          mConnectFailures(0) {
         if (inet_pton(mAddr.sin_family, ip.c_str(), &mAddr.sin_addr) <= 0) {
             throw std::runtime_error("Invalid address");
         }
 
-        mLoop.pushWork([this] () { connectSocket(); });
+        scheduleConnect(0);
+    }
+
+    ~TCPClientHandler() {
+        abortConnect();
+        resetTx();
+        mLoop.cancel(mCloseTimer);
+        mLoop.cancel(mHeartbeatTimer);
     }
 
-    virtual int read(std::string& addr) override {
+    virtual int read(char* buf, size_t len, std::string& addr) override {
         addr.assign(mIp);
-        return recv(mSocketFd, const_cast<char *>(mBuffer.data()), mBuffer.size(), 0);
+        return recv(mSocketFd, buf, len, 0);
     }
 
     virtual void handleWritable(WritableEvent& e) override {
+        if (mIsConnected) {
+            mWaitingWritable = false;
+            flushTx();
+            return;
+        }
+
+        if ((mConnectState != CONNECT_IN_PROGRESS) || (mSocketFd != e.fd))
+            return;
+
         int so_error;
         struct sockaddr_in addr;
         socklen_t len = sizeof(so_error);
@@ -34,66 +101,423 @@ public:
         int ret = getpeername(mSocketFd, (struct sockaddr *) &addr, &len);
         if ((so_error == 0) && (ret == 0)) {
             if (mLoop.attach(mSocketFd, this)) {
-                LOGE() << "failed to attach to loop" << std::endl;
-            } else {
-                mLoop.handleEvent(ConnectedEvent(mSocketFd, mIp, e.logLevel));
+                TUYACPP_LOGE() << "failed to attach to loop" << std::endl;
+                connectFailed(ConnectManager::FAILED);
+                return;
             }
+            mLoop.cancel(mConnectTimer);
+            mConnectTimer = TimerQueue::INVALID_HANDLE;
+            mConnectState = CONNECT_IDLE;
+            const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - mConnectStart);
+            mLoop.connectManager().finish(ConnectManager::CONNECTED, latency.count());
+            mLoop.handleEvent(ConnectedEvent(mSocketFd, mIp, e.logLevel));
         } else {
-            EV_LOGW(e) << "failed to connect, retry in " << RECONNECT_DELAY_MS << " ms" << std::endl;
-            mLoop.pushWork([this] () { connectSocket(); }, RECONNECT_DELAY_MS);
+            TUYACPP_EV_LOGW(e) << "failed to connect: " << strerror(so_error ? so_error : errno) << std::endl;
+            connectFailed(ConnectManager::FAILED);
         }
     }
 
     virtual void handleConnected(ConnectedEvent& e) override {
-        EV_LOGI(e) << "connected to " << mIp << std::endl;
+        TUYACPP_EV_LOGI(e) << "connected to " << mIp << std::endl;
         mIsConnected = true;
+        mConnectedAt = mLastRx = Clock::now();
+        mHeartbeatSent = false;
+        mHeartbeatsAnswered = 0;
+        scheduleHeartbeat(jittered(mIdleIntervalMs, HEARTBEAT_JITTER_PERCENT));
+    }
+
+    /* anything the peer sends shows that the connection is alive */
+    virtual void handleRead(ReadEvent& e) override {
+        if ((mSocketFd != -1) && (mSocketFd == e.fd)) {
+            mLastRx = Clock::now();
+            if (mHeartbeatSent) {
+                mHeartbeatSent = false;
+                heartbeatAnswered();
+                scheduleHeartbeat(jittered(mIdleIntervalMs, HEARTBEAT_JITTER_PERCENT));
+            }
+        }
+        SocketHandler::handleRead(e);
     }
 
+    /* events for a connection that has been closed already, e.g. by a deferred close that
+     * raced with the peer's, are ignored
+     */
     virtual void handleClose(CloseEvent& e) override {
-        EV_LOGI(e) << mIp << " disconnected" << std::endl;
+        if (!mIsConnected || (e.fd != mSocketFd))
+            return;
+
+        TUYACPP_EV_LOGI(e) << mIp << " disconnected" << std::endl;
         mIsConnected = false;
-        close(mSocketFd);
+        mRxBuffer.clear();
+        resetTx();
+        mLoop.cancel(mCloseTimer);
+        mCloseTimer = TimerQueue::INVALID_HANDLE;
+        mLoop.cancel(mHeartbeatTimer);
+        mHeartbeatTimer = TimerQueue::INVALID_HANDLE;
+        /* the number may belong to another connection before we reconnect */
         mLoop.detach(mSocketFd);
-        mLoop.pushWork([this] () { connectSocket(); });
+        close(mSocketFd);
+        mSocketFd = -1;
+
+        /* a connection that is closed right after it has been established, e.g. by a device
+         * that does not accept the key, backs off like a failed attempt
+         */
+        const auto uptime = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - mConnectedAt);
+        if (uptime.count() >= RECONNECT_STABLE_MS) {
+            mConnectFailures = 0;
+            scheduleConnect(0);
+        } else {
+            mConnectFailures++;
+            scheduleConnect(backoffDelay());
+        }
     }
 
+    /* called by the ConnectManager, the attempt completes in handleWritable() */
     void connectSocket() {
+        mConnectState = CONNECT_IN_PROGRESS;
+        mConnectStart = Clock::now();
+
         int ret = 0;
         mSocketFd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
         if (mSocketFd < 0) {
-            LOGE() << "failed to create socket" << std::endl;
+            TUYACPP_LOGE() << "failed to create socket" << std::endl;
             ret = mSocketFd;
         } else {
             ret = setSocketBlockingEnabled(false);
             if (ret < 0)
-                LOGE() << "failed to set socket non-blocking" << std::endl;
-
+                TUYACPP_LOGE() << "failed to set socket non-blocking" << std::endl;
+            else
+                setKeepalive();
         }
 
         if (ret == 0) {
             ret = mLoop.attachWritable(mSocketFd, this);
             if (ret < 0)
-                LOGE() << "failed to attach to loop" << std::endl;
-
+                TUYACPP_LOGE() << "failed to attach to loop" << std::endl;
         }
 
-        if (ret == 0) {
-            ret = connect(mSocketFd, reinterpret_cast<struct sockaddr *>(&mAddr), sizeof(mAddr));
-            if (ret != -1)
-                LOGE() << "failed to connect" << std::endl;
+        /* a non-blocking connect() usually returns EINPROGRESS, but it may also succeed right
+         * away, in both cases the socket becomes writable
+         */
+        if ((ret == 0) && (connect(mSocketFd, reinterpret_cast<struct sockaddr *>(&mAddr), sizeof(mAddr)) < 0) &&
+            (errno != EINPROGRESS)) {
+            TUYACPP_LOGE() << "failed to connect: " << strerror(errno) << std::endl;
+            ret = -errno;
         }
 
-        if (ret != -1) {
-            close(mSocketFd);
-            mLoop.pushWork([this] () { connectSocket(); }, RECONNECT_DELAY_MS);
+        if (ret < 0) {
+            connectFailed(ConnectManager::FAILED);
+            return;
         }
+
+        mConnectTimer = mLoop.pushWork([this] () {
+            mConnectTimer = TimerQueue::INVALID_HANDLE;
+            TUYACPP_LOGW() << "connecting to " << mIp << " timed out" << std::endl;
+            connectFailed(ConnectManager::TIMED_OUT);
+        }, CONNECT_TIMEOUT_MS);
     }
 
     bool isConnected() const {
         return mIsConnected;
     }
 
+    /* Outbound data is queued with queueTx() and written with flushTx(), several frames that
+     * are queued before a flush go out in one syscall. Whatever the socket does not take is
+     * written as soon as it becomes writable.
+     */
+    int queueTx(const char* data, size_t len) {
+        return queueTx(len, [data, len] (std::string& out) { out.append(data, len); });
+    }
+
+    /* fill(std::string&) appends to the send buffer directly, e.g. Message::serializeTo() */
+    template <typename F>
+    int queueTx(size_t sizeHint, F&& fill) {
+        if (!mIsConnected)
+            return -ENOTCONN;
+        if (mTxBuffer.size() + sizeHint > TX_MAX_BUFFERED) {
+            TUYACPP_LOGE() << "send buffer full" << std::endl;
+            return -ENOBUFS;
+        }
+
+        mTxBuffer.append(sizeHint, std::forward<F>(fill));
+        if (mTxBuffer.size() >= TX_HIGH_WATERMARK)
+            mTxCongested = true;
+        return 0;
+    }
+
+    int flushTx() {
+        if (!mIsConnected || mTxBuffer.empty())
+            return 0;
+
+        ssize_t ret = mTxBuffer.flush(mSocketFd);
+        if (ret < 0) {
+            TUYACPP_LOGE() << "failed to send: " << strerror(-ret) << std::endl;
+            resetTx();
+            if (mCloseTimer == TimerQueue::INVALID_HANDLE)
+                mCloseTimer = mLoop.pushWork([this] () {
+                    mCloseTimer = TimerQueue::INVALID_HANDLE;
+                    mLoop.handleEvent(CloseEvent(mSocketFd, mIp, LogStream::INFO));
+                });
+            return ret;
+        }
+
+        if (!mTxBuffer.empty() && !mWaitingWritable) {
+            if (mLoop.attachWritable(mSocketFd, this) == 0)
+                mWaitingWritable = true;
+        }
+
+        if (mTxCongested && (mTxBuffer.size() <= TX_LOW_WATERMARK)) {
+            mTxCongested = false;
+            handleTxDrained();
+        }
+        return 0;
+    }
+
+    /* flush once the current loop iteration is done, so that everything that is queued until
+     * then goes out with one syscall
+     */
+    void scheduleFlushTx() {
+        if (mFlushTxTimer == TimerQueue::INVALID_HANDLE)
+            mFlushTxTimer = mLoop.pushWork([this] () {
+                mFlushTxTimer = TimerQueue::INVALID_HANDLE;
+                flushTx();
+            });
+    }
+
+    bool isTxCongested() const {
+        return mTxCongested;
+    }
+
+    size_t txBuffered() const {
+        return mTxBuffer.size();
+    }
+
+    /* the send buffer has dropped below the low watermark after having been congested */
+    virtual void handleTxDrained() {
+    }
+
+    /* Connect as soon as possible, ahead of the clients of the loop that are not in a hurry.
+     * This does not shorten a backoff delay, only the wait for the ConnectManager.
+     */
+    void expediteConnect() {
+        if (mConnectState == CONNECT_QUEUED)
+            mLoop.connectManager().promote(this);
+    }
+
+    /* whether the next connection attempt should go ahead of the others, see expediteConnect() */
+    virtual bool isConnectUrgent() const {
+        return false;
+    }
+
+    /* the initial interval, 0 disables heartbeats, takes effect with the next connection */
+    void setHeartbeatInterval(uint32_t intervalMs) {
+        mHeartbeatIntervalMs = mIdleIntervalMs = intervalMs;
+        mHeartbeatsAnswered = 0;
+    }
+
+    /* the current interval, see HEARTBEAT_INTERVAL_MS */
+    uint32_t heartbeatInterval() const {
+        return mIdleIntervalMs;
+    }
+
+    /* Queue a heartbeat frame. Returning -ENOTSUP stops the heartbeats of the connection,
+     * other errors skip one interval.
+     */
+    virtual int sendHeartbeat() {
+        return -ENOTSUP;
+    }
+
+    /* ms, spread uniformly by +-percent */
+    static uint32_t jittered(uint32_t ms, uint32_t percent) {
+        static thread_local std::minstd_rand sRandom(std::random_device{}());
+        const uint32_t spread = (uint64_t) ms * percent / 100;
+        if (!spread)
+            return ms;
+        return ms - spread + sRandom() % (2 * spread + 1);
+    }
+
+    /* Use a socket that is already connected, e.g. one end of a socketpair() in benchmarks
+     * and replays, instead of connecting to the device. The handler owns the socket.
+     */
+    int adopt(int fd) {
+        abortConnect();
+        resetTx();
+        if (mSocketFd >= 0) {
+            mLoop.detach(mSocketFd);
+            close(mSocketFd);
+        }
+
+        mSocketFd = fd;
+        int ret = setSocketBlockingEnabled(false);
+        if (ret == 0)
+            ret = mLoop.attach(mSocketFd, this);
+        if (ret < 0) {
+            TUYACPP_LOGE() << "failed to adopt socket" << std::endl;
+            return ret;
+        }
+
+        mLoop.handleEvent(ConnectedEvent(mSocketFd, mIp, LogStream::INFO));
+        return 0;
+    }
+
 private:
+    typedef std::chrono::steady_clock Clock;
+
+    void scheduleHeartbeat(uint32_t delayMs) {
+        if (!mHeartbeatIntervalMs)
+            return;
+        if (!mLoop.reschedule(mHeartbeatTimer, delayMs))
+            mHeartbeatTimer = mLoop.pushWork([this] () {
+                mHeartbeatTimer = TimerQueue::INVALID_HANDLE;
+                checkHeartbeat();
+            }, delayMs);
+    }
+
+    void checkHeartbeat() {
+        if (!mIsConnected)
+            return;
+
+        if (mHeartbeatSent) {
+            TUYACPP_LOGW() << mIp << " did not answer the heartbeat, closing" << std::endl;
+            heartbeatMissed();
+            mLoop.handleEvent(CloseEvent(mSocketFd, mIp, LogStream::INFO));
+            return;
+        }
+
+        const uint32_t idleMs = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - mLastRx).count();
+        if (idleMs < mIdleIntervalMs) {
+            scheduleHeartbeat(mIdleIntervalMs - idleMs);
+            return;
+        }
+
+        int ret = sendHeartbeat();
+        if (ret == -ENOTSUP)
+            return;
+        if (ret < 0) {
+            scheduleHeartbeat(jittered(mIdleIntervalMs, HEARTBEAT_JITTER_PERCENT));
+            return;
+        }
+        mHeartbeatSent = true;
+        scheduleHeartbeat(HEARTBEAT_TIMEOUT_MS);
+    }
+
+    void heartbeatAnswered() {
+        if (++mHeartbeatsAnswered < HEARTBEAT_STREAK)
+            return;
+        mHeartbeatsAnswered = 0;
+        const uint32_t maxMs = mHeartbeatIntervalMs * HEARTBEAT_MAX_FACTOR;
+        if (mIdleIntervalMs < maxMs) {
+            mIdleIntervalMs = std::min(mIdleIntervalMs * 2, maxMs);
+            TUYACPP_LOGD() << mIp << " heartbeat interval " << mIdleIntervalMs << " ms" << std::endl;
+        }
+    }
+
+    /* the interval is kept for the next connection */
+    void heartbeatMissed() {
+        mHeartbeatsAnswered = 0;
+        const uint32_t minMs = mHeartbeatIntervalMs / 2;
+        if (mIdleIntervalMs > minMs) {
+            mIdleIntervalMs = std::max(mIdleIntervalMs / 2, minMs);
+            TUYACPP_LOGD() << mIp << " heartbeat interval " << mIdleIntervalMs << " ms" << std::endl;
+        }
+    }
+
+    /* failures are not fatal, the heartbeats notice dead peers as well */
+    void setKeepalive() {
+        int on = 1;
+        if (setsockopt(mSocketFd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) < 0) {
+            TUYACPP_LOGW() << "failed to enable keepalive" << std::endl;
+            return;
+        }
+
+#if defined(TCP_KEEPIDLE)
+        int idle = KEEPALIVE_IDLE_S;
+        setsockopt(mSocketFd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+#elif defined(TCP_KEEPALIVE)
+        int idle = KEEPALIVE_IDLE_S;
+        setsockopt(mSocketFd, IPPROTO_TCP, TCP_KEEPALIVE, &idle, sizeof(idle));
+#endif
+#ifdef TCP_KEEPINTVL
+        int interval = KEEPALIVE_INTERVAL_S;
+        setsockopt(mSocketFd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+#endif
+#ifdef TCP_KEEPCNT
+        int count = KEEPALIVE_COUNT;
+        setsockopt(mSocketFd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif
+#ifdef TCP_USER_TIMEOUT
+        unsigned int timeout = USER_TIMEOUT_MS;
+        setsockopt(mSocketFd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout));
+#endif
+    }
+
+    enum ConnectState {
+        CONNECT_IDLE,           // connected, or not trying to
+        CONNECT_DELAYED,        // waiting for mConnectTimer
+        CONNECT_QUEUED,         // waiting for the ConnectManager
+        CONNECT_IN_PROGRESS,    // connecting, mConnectTimer is the timeout
+    };
+
+    /* there is at most one pending connection attempt */
+    void scheduleConnect(uint32_t delayMs) {
+        if ((mConnectState == CONNECT_DELAYED) && mLoop.reschedule(mConnectTimer, delayMs))
+            return;
+
+        mConnectState = CONNECT_DELAYED;
+        mConnectTimer = mLoop.pushWork([this] () {
+            mConnectTimer = TimerQueue::INVALID_HANDLE;
+            mConnectState = CONNECT_QUEUED;
+            mLoop.connectManager().request(this, isConnectUrgent(), [this] () { connectSocket(); });
+        }, delayMs);
+    }
+
+    void connectFailed(ConnectManager::Result result) {
+        mLoop.cancel(mConnectTimer);
+        mConnectTimer = TimerQueue::INVALID_HANDLE;
+        if (mSocketFd >= 0) {
+            mLoop.detachWritable(mSocketFd);
+            close(mSocketFd);
+            mSocketFd = -1;
+        }
+        mConnectState = CONNECT_IDLE;
+        mLoop.connectManager().finish(result);
+
+        mConnectFailures++;
+        const uint32_t delayMs = backoffDelay();
+        TUYACPP_LOGW() << "retry connecting to " << mIp << " in " << delayMs << " ms" << std::endl;
+        scheduleConnect(delayMs);
+    }
+
+    /* stop trying to connect, e.g. when the handler goes away */
+    void abortConnect() {
+        mLoop.cancel(mConnectTimer);
+        mConnectTimer = TimerQueue::INVALID_HANDLE;
+        if (mConnectState == CONNECT_QUEUED) {
+            mLoop.connectManager().withdraw(this);
+        } else if (mConnectState == CONNECT_IN_PROGRESS) {
+            mLoop.detachWritable(mSocketFd);
+            mLoop.connectManager().finish(ConnectManager::ABORTED);
+        }
+        mConnectState = CONNECT_IDLE;
+    }
+
+    uint32_t backoffDelay() const {
+        const uint32_t shift = std::min<uint32_t>(mConnectFailures ? mConnectFailures - 1 : 0, 16);
+        const uint64_t delayMs = std::min<uint64_t>((uint64_t) RECONNECT_MIN_DELAY_MS << shift, RECONNECT_MAX_DELAY_MS);
+        return jittered(delayMs, RECONNECT_JITTER_PERCENT);
+    }
+
+    /* drop everything that has not been written */
+    void resetTx() {
+        mLoop.cancel(mFlushTxTimer);
+        mFlushTxTimer = TimerQueue::INVALID_HANDLE;
+        if (mWaitingWritable)
+            mLoop.detachWritable(mSocketFd);
+        mWaitingWritable = false;
+        mTxCongested = false;
+        mTxBuffer.clear();
+    }
+
     int setSocketBlockingEnabled(bool blocking)
     {
        int flags = fcntl(mSocketFd, F_GETFL, 0);
@@ -105,6 +529,22 @@ private:
 
     const std::string mIp;
     bool mIsConnected;
+    SendBuffer mTxBuffer;
+    bool mTxCongested;
+    bool mWaitingWritable;
+    TimerQueue::Handle mConnectTimer = TimerQueue::INVALID_HANDLE;
+    TimerQueue::Handle mFlushTxTimer = TimerQueue::INVALID_HANDLE;
+    TimerQueue::Handle mCloseTimer = TimerQueue::INVALID_HANDLE;
+    uint32_t mHeartbeatIntervalMs;
+    uint32_t mIdleIntervalMs;
+    bool mHeartbeatSent;
+    uint32_t mHeartbeatsAnswered;
+    Clock::time_point mLastRx;
+    TimerQueue::Handle mHeartbeatTimer = TimerQueue::INVALID_HANDLE;
+    ConnectState mConnectState;
+    uint32_t mConnectFailures;
+    Clock::time_point mConnectStart;
+    Clock::time_point mConnectedAt;
 };
 
 } // namespace tuya
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <vector>
+
+namespace tuya {
+
+/* Timer queue with handles. Timers live in slots that are reused, the binary heap only
+ * references them. Cancelling a timer releases its closure right away in O(1) and leaves
+ * a stale heap entry behind, which is skipped when it reaches the top or removed when the
+ * heap is compacted.
+ */
+class TimerQueue {
+    typedef std::chrono::steady_clock Clock;
+
+    static const size_t MIN_STALE_FOR_COMPACTION = 64;
+
+public:
+    /* 0 is never a valid handle, so it can be used for "no timer" */
+    typedef uint64_t Handle;
+    static const Handle INVALID_HANDLE = 0;
+
+    TimerQueue() : mSeq(0), mLive(0), mStale(0) {}
+
+    Handle schedule(std::function<void()>&& work, uint32_t delayMs) {
+        uint32_t index;
+        if (mFreeSlots.size()) {
+            index = mFreeSlots.back();
+            mFreeSlots.pop_back();
+        } else {
+            index = mSlots.size();
+            mSlots.emplace_back();
+        }
+
+        Slot& slot = mSlots[index];
+        slot.work = std::move(work);
+        slot.active = true;
+        mLive++;
+        arm(index, delayMs);
+
+        return (static_cast<Handle>(slot.generation) << 32) | (index + 1);
+    }
+
+    bool cancel(Handle handle) {
+        Slot* slot = find(handle);
+        if (!slot)
+            return false;
+
+        mStale++;
+        release(*slot, handle);
+        compact();
+        return true;
+    }
+
+    bool reschedule(Handle handle, uint32_t delayMs) {
+        Slot* slot = find(handle);
+        if (!slot)
+            return false;
+
+        mStale++;
+        arm(slotIndex(handle), delayMs);
+        compact();
+        return true;
+    }
+
+    bool isActive(Handle handle) const {
+        return const_cast<TimerQueue*>(this)->find(handle) != nullptr;
+    }
+
+    size_t size() const {
+        return mLive;
+    }
+
+    /* run all timers that have expired and return the time in ms until the next one, or -1
+     * if there is none. Timers that are scheduled while running expire in the next call at
+     * the earliest.
+     */
+    int runExpired() {
+        const auto now = Clock::now();
+
+        while (mHeap.size()) {
+            const Entry top = mHeap.front();
+            Slot& slot = mSlots[top.index];
+            if (!slot.active || (slot.seq != top.seq)) {
+                popHeap();
+                mStale--;
+                continue;
+            }
+
+            if (top.deadline > now) {
+                const auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(top.deadline - now + std::chrono::milliseconds(1) - Clock::duration(1));
+                return delay.count();
+            }
+
+            popHeap();
+            auto work = std::move(slot.work);
+            release(slot, (static_cast<Handle>(slot.generation) << 32) | (top.index + 1));
+            work();
+        }
+
+        return -1;
+    }
+
+private:
+    struct Slot {
+        std::function<void()> work;
+        Clock::time_point deadline;
+        uint64_t seq = 0;
+        uint32_t generation = 0;
+        bool active = false;
+    };
+
+    struct Entry {
+        Clock::time_point deadline;
+        uint64_t seq;
+        uint32_t index;
+    };
+
+    /* min-heap on the deadline, timers with the same deadline run in scheduling order */
+    static bool later(const Entry& e1, const Entry& e2) {
+        return (e1.deadline != e2.deadline) ? (e1.deadline > e2.deadline) : (e1.seq > e2.seq);
+    }
+
+    static uint32_t slotIndex(Handle handle) {
+        return static_cast<uint32_t>(handle & 0xffffffff) - 1;
+    }
+
+    Slot* find(Handle handle) {
+        const uint32_t index = slotIndex(handle);
+        if ((handle == INVALID_HANDLE) || (index >= mSlots.size()))
+            return nullptr;
+        Slot& slot = mSlots[index];
+        if (!slot.active || (slot.generation != static_cast<uint32_t>(handle >> 32)))
+            return nullptr;
+        return &slot;
+    }
+
+    void arm(uint32_t index, uint32_t delayMs) {
+        Slot& slot = mSlots[index];
+        slot.deadline = Clock::now() + std::chrono::milliseconds(delayMs);
+        slot.seq = ++mSeq;
+        mHeap.push_back({slot.deadline, slot.seq, index});
+        std::push_heap(mHeap.begin(), mHeap.end(), later);
+    }
+
+    void release(Slot& slot, Handle handle) {
+        std::function<void()>().swap(slot.work);
+        slot.active = false;
+        slot.generation++;
+        mLive--;
+        mFreeSlots.push_back(slotIndex(handle));
+    }
+
+    void popHeap() {
+        std::pop_heap(mHeap.begin(), mHeap.end(), later);
+        mHeap.pop_back();
+    }
+
+    /* drop stale entries once they make up more than half of the heap */
+    void compact() {
+        if ((mStale < MIN_STALE_FOR_COMPACTION) || (mStale < mHeap.size() / 2))
+            return;
+
+        mHeap.erase(std::remove_if(mHeap.begin(), mHeap.end(), [this] (const Entry& e) {
+            const Slot& slot = mSlots[e.index];
+            return !slot.active || (slot.seq != e.seq);
+        }), mHeap.end());
+        std::make_heap(mHeap.begin(), mHeap.end(), later);
+        mStale = 0;
+    }
+
+    std::vector<Slot> mSlots;
+    std::vector<uint32_t> mFreeSlots;
+    std::vector<Entry> mHeap;
+    uint64_t mSeq;
+    size_t mLive;
+    size_t mStale;
+};
+
+} // namespace tuya
@@ -0,0 +1,412 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#ifdef TUYACPP_USE_MBEDTLS
+    #include <mbedtls/aes.h>
+    #include <mbedtls/gcm.h>
+    #include <mbedtls/md.h>
+#else
+    #include <openssl/evp.h>
+#endif
+
+#include "../logging.hpp"
+
+namespace tuya {
+
+/* AES-128-ECB with PKCS#7 padding, plus the HMAC-SHA256 and AES-128-GCM of protocol 3.4
+ * and 3.5. The key schedules are computed once per key and reused for every message, so a
+ * Cipher should live as long as its key, e.g. one per connection; setKey() switches it to
+ * the session key of a connection. The HMAC and GCM contexts are only set up when they are
+ * used first. It is not thread-safe.
+ */
+class Cipher {
+public:
+    static const size_t KEY_SIZE = 16;
+    static const size_t BLOCK_SIZE = 16;
+    static const size_t HMAC_SIZE = 32;
+    static const size_t GCM_IV_SIZE = 12;
+    static const size_t GCM_TAG_SIZE = 16;
+
+    Cipher(const std::string& key) {
+#ifdef TUYACPP_USE_MBEDTLS
+        mbedtls_aes_init(&mEncCtx);
+        mbedtls_aes_init(&mDecCtx);
+        mbedtls_md_init(&mHmacCtx);
+        mbedtls_gcm_init(&mGcmCtx);
+#else
+        /* padding is done by us, so that the contexts keep no state between messages */
+        mEncCtx = EVP_CIPHER_CTX_new();
+        mDecCtx = EVP_CIPHER_CTX_new();
+        if (!mEncCtx || !mDecCtx ||
+            (EVP_EncryptInit_ex(mEncCtx, EVP_aes_128_ecb(), NULL, NULL, NULL) != 1) ||
+            (EVP_DecryptInit_ex(mDecCtx, EVP_aes_128_ecb(), NULL, NULL, NULL) != 1)) {
+            EVP_CIPHER_CTX_free(mEncCtx);
+            EVP_CIPHER_CTX_free(mDecCtx);
+            throw std::runtime_error("EVP_*Init_ex failed");
+        }
+        EVP_CIPHER_CTX_set_padding(mEncCtx, 0);
+        EVP_CIPHER_CTX_set_padding(mDecCtx, 0);
+#endif
+        if (setKey(key) < 0) {
+            release();
+            throw std::runtime_error("failed to set the key");
+        }
+    }
+
+    Cipher(const Cipher&) = delete;
+    Cipher& operator=(const Cipher&) = delete;
+
+    ~Cipher() {
+        release();
+    }
+
+    const std::string& key() const {
+        return mKey;
+    }
+
+    /* switch all contexts to another key, e.g. the session key of a connection */
+    int setKey(const std::string& key) {
+        /* keys that are too short (e.g. of devices that are not known yet) are zero-padded */
+        mKey = key;
+        memset(mRawKey, 0, KEY_SIZE);
+        memcpy(mRawKey, key.data(), std::min(key.length(), (size_t) KEY_SIZE));
+
+#ifdef TUYACPP_USE_MBEDTLS
+        if ((mbedtls_aes_setkey_enc(&mEncCtx, mRawKey, KEY_SIZE * 8) != 0) ||
+            (mbedtls_aes_setkey_dec(&mDecCtx, mRawKey, KEY_SIZE * 8) != 0)) {
+            TUYACPP_LOGE() << "mbedtls_aes_setkey failed" << std::endl;
+            return -EIO;
+        }
+        if ((mHmacReady && (mbedtls_md_hmac_starts(&mHmacCtx, mRawKey, KEY_SIZE) != 0)) ||
+            (mGcmReady && (mbedtls_gcm_setkey(&mGcmCtx, MBEDTLS_CIPHER_ID_AES, mRawKey, KEY_SIZE * 8) != 0))) {
+            TUYACPP_LOGE() << "failed to rekey the HMAC or GCM context" << std::endl;
+            mHmacReady = mGcmReady = false;
+            return -EIO;
+        }
+#else
+        if ((EVP_EncryptInit_ex(mEncCtx, NULL, NULL, mRawKey, NULL) != 1) ||
+            (EVP_DecryptInit_ex(mDecCtx, NULL, NULL, mRawKey, NULL) != 1)) {
+            TUYACPP_LOGE() << "EVP_*Init_ex failed" << std::endl;
+            return -EIO;
+        }
+        if (mHmacInner && (initHmacPads() < 0))
+            return -EIO;
+        if (mGcmEncCtx &&
+            ((EVP_EncryptInit_ex(mGcmEncCtx, NULL, NULL, mRawKey, NULL) != 1) ||
+             (EVP_DecryptInit_ex(mGcmDecCtx, NULL, NULL, mRawKey, NULL) != 1))) {
+            TUYACPP_LOGE() << "failed to rekey the GCM contexts" << std::endl;
+            return -EIO;
+        }
+#endif
+        return 0;
+    }
+
+    static size_t paddedLength(size_t len) {
+        return len + BLOCK_SIZE - len % BLOCK_SIZE;
+    }
+
+    /* pad and encrypt len bytes at plain and append the result to out */
+    int encrypt(const char* plain, size_t len, std::string& out) {
+        const size_t offset = out.length();
+        out.append(plain, len);
+        return encryptInPlace(out, offset);
+    }
+
+    /* pad and encrypt everything in buf from offset on, nothing is copied if buf has room for
+     * the padding (see paddedLength())
+     */
+    int encryptInPlace(std::string& buf, size_t offset) {
+        const size_t len = buf.length() - offset;
+        const char padNum = BLOCK_SIZE - len % BLOCK_SIZE;
+        buf.append(padNum, padNum);
+
+        int ret = crypt(true, &buf[offset], &buf[offset], buf.length() - offset);
+        if (ret < 0)
+            buf.resize(offset);
+        return ret;
+    }
+
+    /* decrypt and unpad len bytes at cipher and append the result to out */
+    int decrypt(const char* cipher, size_t len, std::string& out) {
+        if (!len || (len % BLOCK_SIZE)) {
+            TUYACPP_LOGE() << "decrypt() failed: invalid length " << len << std::endl;
+            return -EINVAL;
+        }
+
+        const size_t offset = out.length();
+        out.resize(offset + len);
+        int ret = crypt(false, cipher, &out[offset], len);
+        if (ret == 0) {
+            const unsigned char padNum = out.back();
+            bool valid = (padNum > 0) && (padNum <= BLOCK_SIZE);
+            for (size_t i = 1; valid && (i <= padNum); i++)
+                valid = ((unsigned char) out[out.length() - i] == padNum);
+            if (valid) {
+                out.resize(out.length() - padNum);
+            } else {
+                TUYACPP_LOGE() << "decrypt() failed: invalid padding" << std::endl;
+                ret = -EBADMSG;
+            }
+        }
+
+        if (ret < 0)
+            out.resize(offset);
+        return ret;
+    }
+
+    /* encrypt exactly one block, e.g. to derive a session key */
+    int encryptBlock(const unsigned char in[BLOCK_SIZE], unsigned char out[BLOCK_SIZE]) {
+        return crypt(true, (const char *) in, (char *) out, BLOCK_SIZE);
+    }
+
+    /* HMAC-SHA256 of len bytes at data with the current key */
+    int hmac(const char* data, size_t len, unsigned char mac[HMAC_SIZE]) {
+        if (initHmac() < 0)
+            return -EIO;
+
+#ifdef TUYACPP_USE_MBEDTLS
+        if ((mbedtls_md_hmac_reset(&mHmacCtx) != 0) ||
+            (mbedtls_md_hmac_update(&mHmacCtx, (const unsigned char *) data, len) != 0) ||
+            (mbedtls_md_hmac_finish(&mHmacCtx, mac) != 0)) {
+            TUYACPP_LOGE() << "mbedtls_md_hmac failed" << std::endl;
+            return -EIO;
+        }
+#else
+        /* the hashes of the padded key are computed once per key, each message only costs
+         * copying them and hashing the data and the inner digest
+         */
+        unsigned char inner[HMAC_SIZE];
+        if ((EVP_MD_CTX_copy_ex(mHmacCtx, mHmacInner) != 1) ||
+            (EVP_DigestUpdate(mHmacCtx, data, len) != 1) ||
+            (EVP_DigestFinal_ex(mHmacCtx, inner, NULL) != 1) ||
+            (EVP_MD_CTX_copy_ex(mHmacCtx, mHmacOuter) != 1) ||
+            (EVP_DigestUpdate(mHmacCtx, inner, HMAC_SIZE) != 1) ||
+            (EVP_DigestFinal_ex(mHmacCtx, mac, NULL) != 1)) {
+            TUYACPP_LOGE() << "HMAC-SHA256 failed" << std::endl;
+            return -EIO;
+        }
+#endif
+        return 0;
+    }
+
+    /* check the HMAC-SHA256 of len bytes at data against mac in constant time, without
+     * copying the data
+     */
+    bool verifyHmac(const char* data, size_t len, const char* mac) {
+        unsigned char expected[HMAC_SIZE];
+        if (hmac(data, len, expected) < 0)
+            return false;
+        unsigned char diff = 0;
+        for (size_t i = 0; i < HMAC_SIZE; i++)
+            diff |= expected[i] ^ (unsigned char) mac[i];
+        return diff == 0;
+    }
+
+    /* AES-128-GCM encryption of len bytes from in to out, which may be the same, and the tag
+     * over aad and the cipher text
+     */
+    int gcmEncrypt(const unsigned char iv[GCM_IV_SIZE], const char* aad, size_t aadLen,
+                   const char* in, char* out, size_t len, unsigned char tag[GCM_TAG_SIZE]) {
+        if (initGcm() < 0)
+            return -EIO;
+
+#ifdef TUYACPP_USE_MBEDTLS
+        if (mbedtls_gcm_crypt_and_tag(&mGcmCtx, MBEDTLS_GCM_ENCRYPT, len, iv, GCM_IV_SIZE,
+                                      (const unsigned char *) aad, aadLen, (const unsigned char *) in,
+                                      (unsigned char *) out, GCM_TAG_SIZE, tag) != 0) {
+            TUYACPP_LOGE() << "mbedtls_gcm_crypt_and_tag failed" << std::endl;
+            return -EIO;
+        }
+#else
+        int outLen = 0;
+        if ((EVP_EncryptInit_ex(mGcmEncCtx, NULL, NULL, NULL, iv) != 1) ||
+            (aadLen && (EVP_EncryptUpdate(mGcmEncCtx, NULL, &outLen, (const unsigned char *) aad, aadLen) != 1)) ||
+            (EVP_EncryptUpdate(mGcmEncCtx, (unsigned char *) out, &outLen, (const unsigned char *) in, len) != 1) ||
+            (EVP_EncryptFinal_ex(mGcmEncCtx, (unsigned char *) out + outLen, &outLen) != 1) ||
+            (EVP_CIPHER_CTX_ctrl(mGcmEncCtx, EVP_CTRL_GCM_GET_TAG, GCM_TAG_SIZE, tag) != 1)) {
+            TUYACPP_LOGE() << "AES-GCM encryption failed" << std::endl;
+            return -EIO;
+        }
+#endif
+        return 0;
+    }
+
+    /* AES-128-GCM decryption of len bytes from in to out, which may be the same; returns
+     * -EBADMSG if tag does not match aad and the cipher text
+     */
+    int gcmDecrypt(const unsigned char iv[GCM_IV_SIZE], const char* aad, size_t aadLen,
+                   const char* in, char* out, size_t len, const unsigned char tag[GCM_TAG_SIZE]) {
+        if (initGcm() < 0)
+            return -EIO;
+
+#ifdef TUYACPP_USE_MBEDTLS
+        int ret = mbedtls_gcm_auth_decrypt(&mGcmCtx, len, iv, GCM_IV_SIZE, (const unsigned char *) aad, aadLen,
+                                           tag, GCM_TAG_SIZE, (const unsigned char *) in, (unsigned char *) out);
+        if (ret == MBEDTLS_ERR_GCM_AUTH_FAILED)
+            return -EBADMSG;
+        if (ret != 0) {
+            TUYACPP_LOGE() << "mbedtls_gcm_auth_decrypt failed" << std::endl;
+            return -EIO;
+        }
+#else
+        int outLen = 0;
+        if ((EVP_DecryptInit_ex(mGcmDecCtx, NULL, NULL, NULL, iv) != 1) ||
+            (aadLen && (EVP_DecryptUpdate(mGcmDecCtx, NULL, &outLen, (const unsigned char *) aad, aadLen) != 1)) ||
+            (EVP_DecryptUpdate(mGcmDecCtx, (unsigned char *) out, &outLen, (const unsigned char *) in, len) != 1) ||
+            (EVP_CIPHER_CTX_ctrl(mGcmDecCtx, EVP_CTRL_GCM_SET_TAG, GCM_TAG_SIZE, const_cast<unsigned char *>(tag)) != 1)) {
+            TUYACPP_LOGE() << "AES-GCM decryption failed" << std::endl;
+            return -EIO;
+        }
+        if (EVP_DecryptFinal_ex(mGcmDecCtx, (unsigned char *) out + outLen, &outLen) != 1)
+            return -EBADMSG;
+#endif
+        return 0;
+    }
+
+private:
+    LOG_MEMBERS(CIPHER);
+
+    void release() {
+#ifdef TUYACPP_USE_MBEDTLS
+        mbedtls_aes_free(&mEncCtx);
+        mbedtls_aes_free(&mDecCtx);
+        mbedtls_md_free(&mHmacCtx);
+        mbedtls_gcm_free(&mGcmCtx);
+#else
+        EVP_CIPHER_CTX_free(mEncCtx);
+        EVP_CIPHER_CTX_free(mDecCtx);
+        EVP_CIPHER_CTX_free(mGcmEncCtx);
+        EVP_CIPHER_CTX_free(mGcmDecCtx);
+        EVP_MD_CTX_free(mHmacInner);
+        EVP_MD_CTX_free(mHmacOuter);
+        EVP_MD_CTX_free(mHmacCtx);
+#endif
+    }
+
+    int initHmac() {
+#ifdef TUYACPP_USE_MBEDTLS
+        if (mHmacReady)
+            return 0;
+        if ((mbedtls_md_setup(&mHmacCtx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1) != 0) ||
+            (mbedtls_md_hmac_starts(&mHmacCtx, mRawKey, KEY_SIZE) != 0)) {
+            TUYACPP_LOGE() << "mbedtls_md_setup failed" << std::endl;
+            return -EIO;
+        }
+        mHmacReady = true;
+        return 0;
+#else
+        if (mHmacInner)
+            return 0;
+        mHmacInner = EVP_MD_CTX_new();
+        mHmacOuter = EVP_MD_CTX_new();
+        mHmacCtx = EVP_MD_CTX_new();
+        if (!mHmacInner || !mHmacOuter || !mHmacCtx || (initHmacPads() < 0)) {
+            EVP_MD_CTX_free(mHmacInner);
+            EVP_MD_CTX_free(mHmacOuter);
+            EVP_MD_CTX_free(mHmacCtx);
+            mHmacInner = mHmacOuter = mHmacCtx = nullptr;
+            return -EIO;
+        }
+        return 0;
+#endif
+    }
+
+#ifndef TUYACPP_USE_MBEDTLS
+    /* hash the key xor ipad and opad (RFC 2104) into the inner and outer contexts */
+    int initHmacPads() {
+        const size_t SHA256_BLOCK_SIZE = 64;
+        unsigned char ipad[SHA256_BLOCK_SIZE], opad[SHA256_BLOCK_SIZE];
+        memset(ipad, 0x36, SHA256_BLOCK_SIZE);
+        memset(opad, 0x5c, SHA256_BLOCK_SIZE);
+        for (size_t i = 0; i < KEY_SIZE; i++) {
+            ipad[i] ^= mRawKey[i];
+            opad[i] ^= mRawKey[i];
+        }
+        if ((EVP_DigestInit_ex(mHmacInner, EVP_sha256(), NULL) != 1) ||
+            (EVP_DigestUpdate(mHmacInner, ipad, SHA256_BLOCK_SIZE) != 1) ||
+            (EVP_DigestInit_ex(mHmacOuter, EVP_sha256(), NULL) != 1) ||
+            (EVP_DigestUpdate(mHmacOuter, opad, SHA256_BLOCK_SIZE) != 1)) {
+            TUYACPP_LOGE() << "failed to hash the HMAC key" << std::endl;
+            return -EIO;
+        }
+        return 0;
+    }
+#endif
+
+    int initGcm() {
+#ifdef TUYACPP_USE_MBEDTLS
+        if (mGcmReady)
+            return 0;
+        if (mbedtls_gcm_setkey(&mGcmCtx, MBEDTLS_CIPHER_ID_AES, mRawKey, KEY_SIZE * 8) != 0) {
+            TUYACPP_LOGE() << "mbedtls_gcm_setkey failed" << std::endl;
+            return -EIO;
+        }
+        mGcmReady = true;
+        return 0;
+#else
+        if (mGcmEncCtx)
+            return 0;
+        mGcmEncCtx = EVP_CIPHER_CTX_new();
+        mGcmDecCtx = EVP_CIPHER_CTX_new();
+        if (!mGcmEncCtx || !mGcmDecCtx ||
+            (EVP_EncryptInit_ex(mGcmEncCtx, EVP_aes_128_gcm(), NULL, mRawKey, NULL) != 1) ||
+            (EVP_DecryptInit_ex(mGcmDecCtx, EVP_aes_128_gcm(), NULL, mRawKey, NULL) != 1)) {
+            TUYACPP_LOGE() << "failed to set up the GCM contexts" << std::endl;
+            EVP_CIPHER_CTX_free(mGcmEncCtx);
+            EVP_CIPHER_CTX_free(mGcmDecCtx);
+            mGcmEncCtx = mGcmDecCtx = nullptr;
+            return -EIO;
+        }
+        return 0;
+#endif
+    }
+
+    /* en- or decrypt len bytes, len must be a multiple of BLOCK_SIZE, in and out may be the same */
+    int crypt(bool enc, const char* in, char* out, size_t len) {
+#ifdef TUYACPP_USE_MBEDTLS
+        mbedtls_aes_context* ctx = enc ? &mEncCtx : &mDecCtx;
+        for (size_t i = 0; i < len; i += BLOCK_SIZE) {
+            if (mbedtls_aes_crypt_ecb(ctx, enc ? MBEDTLS_AES_ENCRYPT : MBEDTLS_AES_DECRYPT,
+                                      (const unsigned char *) in + i, (unsigned char *) out + i) != 0) {
+                TUYACPP_LOGE() << "mbedtls_aes_crypt_ecb failed" << std::endl;
+                return -EIO;
+            }
+        }
+#else
+        int outLen = 0;
+        int ret = enc ? EVP_EncryptUpdate(mEncCtx, (unsigned char *) out, &outLen, (const unsigned char *) in, len)
+                      : EVP_DecryptUpdate(mDecCtx, (unsigned char *) out, &outLen, (const unsigned char *) in, len);
+        if ((ret != 1) || ((size_t) outLen != len)) {
+            TUYACPP_LOGE() << (enc ? "EVP_EncryptUpdate" : "EVP_DecryptUpdate") << " failed" << std::endl;
+            return -EIO;
+        }
+#endif
+        return 0;
+    }
+
+    std::string mKey;
+    unsigned char mRawKey[KEY_SIZE];
+#ifdef TUYACPP_USE_MBEDTLS
+    mbedtls_aes_context mEncCtx;
+    mbedtls_aes_context mDecCtx;
+    mbedtls_md_context_t mHmacCtx;
+    mbedtls_gcm_context mGcmCtx;
+    bool mHmacReady = false;
+    bool mGcmReady = false;
+#else
+    EVP_CIPHER_CTX* mEncCtx;
+    EVP_CIPHER_CTX* mDecCtx;
+    EVP_CIPHER_CTX* mGcmEncCtx = nullptr;
+    EVP_CIPHER_CTX* mGcmDecCtx = nullptr;
+    EVP_MD_CTX* mHmacInner = nullptr;
+    EVP_MD_CTX* mHmacOuter = nullptr;
+    EVP_MD_CTX* mHmacCtx = nullptr;
+#endif
+};
+
+} // namespace tuya
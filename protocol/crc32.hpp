@@ -0,0 +1,240 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#ifndef TUYACPP_NO_HW_CRC32
+    #if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+        #define TUYACPP_CRC32_PCLMUL
+        #include <immintrin.h>
+    #elif defined(__aarch64__) && defined(__linux__) && defined(__GNUC__)
+        #define TUYACPP_CRC32_ARMV8
+        #include <arm_acle.h>
+        #include <sys/auxv.h>
+        #include <asm/hwcap.h>
+    #endif
+#endif
+
+namespace tuya {
+
+/* CRC-32 as used by zlib and Ethernet (reflected polynomial 0xedb88320), which is the
+ * checksum of 55AA frames. The implementation is picked once at runtime: folding with
+ * carry-less multiplication on x86 CPUs with PCLMULQDQ, the CRC32 instructions on ARMv8
+ * CPUs that have them, slicing-by-8 everywhere else and for the tails.
+ */
+class Crc32 {
+public:
+    /* continue the CRC crc (0 for the first piece) over len more bytes, so that frames can
+     * be checksummed piece by piece while they are assembled
+     */
+    static uint32_t update(uint32_t crc, const void* data, size_t len) {
+        return ~instance().mImpl(~crc, static_cast<const uint8_t*>(data), len);
+    }
+
+    static uint32_t calculate(const void* data, size_t len) {
+        return update(0, data, len);
+    }
+
+    /* name of the implementation in use */
+    static const char* implementation() {
+        return instance().mName;
+    }
+
+    /* the portable implementation, on the inverted CRC like the others */
+    static uint32_t slicingBy8(uint32_t crc, const uint8_t* p, size_t len) {
+        const auto& t = instance().mTable;
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+        while (len >= 8) {
+            uint32_t lo, hi;
+            memcpy(&lo, p, 4);
+            memcpy(&hi, p + 4, 4);
+            lo ^= crc;
+            crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+                  t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+            p += 8;
+            len -= 8;
+        }
+#endif
+        while (len--)
+            crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+        return crc;
+    }
+
+private:
+    typedef uint32_t (*Impl_t)(uint32_t crc, const uint8_t* p, size_t len);
+
+    static const uint32_t POLYNOMIAL = 0xedb88320;
+
+    Crc32() : mImpl(slicingBy8), mName("slicing-by-8") {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc >> 1) ^ ((crc & 1) ? POLYNOMIAL : 0);
+            mTable[0][i] = crc;
+        }
+        for (int k = 1; k < 8; k++) {
+            for (int i = 0; i < 256; i++)
+                mTable[k][i] = (mTable[k - 1][i] >> 8) ^ mTable[0][mTable[k - 1][i] & 0xff];
+        }
+
+#if defined(TUYACPP_CRC32_PCLMUL)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+            mImpl = pclmul;
+            mName = "pclmul";
+        }
+#elif defined(TUYACPP_CRC32_ARMV8)
+        if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+            mImpl = armv8;
+            mName = "armv8";
+        }
+#endif
+    }
+
+    static const Crc32& instance() {
+        static const Crc32 sInstance;
+        return sInstance;
+    }
+
+#if defined(TUYACPP_CRC32_PCLMUL)
+    /* Folds 64 bytes at a time into four 128 bit accumulators, then into one, and reduces
+     * that to 32 bits (Intel, "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+     * Instruction", with the constants of the bit-reflected domain).
+     */
+    __attribute__((target("pclmul,sse4.1")))
+    static uint32_t pclmul(uint32_t crc, const uint8_t* p, size_t len) {
+        if (len < 64)
+            return slicingBy8(crc, p, len);
+
+        alignas(16) static const uint64_t k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+        alignas(16) static const uint64_t k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+        alignas(16) static const uint64_t k5k0[] = { 0x0163cd6124, 0x0000000000 };
+        alignas(16) static const uint64_t poly[] = { 0x01db710641, 0x01f7011641 };
+
+        const size_t tail = len & 15;
+        len -= tail;
+
+        __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+        x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x00));
+        x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x10));
+        x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x20));
+        x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x30));
+        x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+        x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k1k2));
+        p += 64;
+        len -= 64;
+
+        while (len >= 64) {
+            x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+            x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+            x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+            x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+            x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+            x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+            x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+            x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+            y5 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x00));
+            y6 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x10));
+            y7 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x20));
+            y8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x30));
+
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+            x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+            x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+            x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+            p += 64;
+            len -= 64;
+        }
+
+        /* fold the four accumulators into one */
+        x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k3k4));
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+        while (len >= 16) {
+            x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+
+            x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+            x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+            p += 16;
+            len -= 16;
+        }
+
+        /* 128 to 64 bits */
+        x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+        x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+        x1 = _mm_srli_si128(x1, 8);
+        x1 = _mm_xor_si128(x1, x2);
+
+        x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(k5k0));
+
+        x2 = _mm_srli_si128(x1, 4);
+        x1 = _mm_and_si128(x1, x3);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+
+        /* Barrett reduction to 32 bits */
+        x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(poly));
+
+        x2 = _mm_and_si128(x1, x3);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+        x2 = _mm_and_si128(x2, x3);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+
+        crc = _mm_extract_epi32(x1, 1);
+        return slicingBy8(crc, p, tail);
+    }
+#endif
+
+#if defined(TUYACPP_CRC32_ARMV8)
+#ifdef __clang__
+    __attribute__((target("crc")))
+#else
+    __attribute__((target("+crc")))
+#endif
+    static uint32_t armv8(uint32_t crc, const uint8_t* p, size_t len) {
+        while (len >= 8) {
+            uint64_t v;
+            memcpy(&v, p, 8);
+            crc = __crc32d(crc, v);
+            p += 8;
+            len -= 8;
+        }
+        if (len >= 4) {
+            uint32_t v;
+            memcpy(&v, p, 4);
+            crc = __crc32w(crc, v);
+            p += 4;
+            len -= 4;
+        }
+        while (len--)
+            crc = __crc32b(crc, *p++);
+        return crc;
+    }
+#endif
+
+    uint32_t mTable[8][256];
+    Impl_t mImpl;
+    const char* mName;
+};
+
+} // namespace tuya
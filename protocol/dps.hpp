@@ -0,0 +1,258 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+using ordered_json = nlohmann::ordered_json;
+
+#include "dpsdecoder.hpp"
+
+namespace tuya {
+
+/* Datapoints of a device by their numeric id, in a flat array of 8 byte entries sorted by
+ * id. The work modes of lights are stored as ENUM, other strings as STRING and whatever else
+ * a device reports (floats, objects, integers beyond 32 bits) as its serialized json in RAW;
+ * the strings are kept out of line. Devices have a handful of datapoints, so updates and
+ * lookups do not allocate once all of them have been seen, except for long string values.
+ */
+class DpsStore {
+public:
+    enum Type : uint8_t {
+        NONE,
+        BOOL,
+        INT,
+        ENUM,
+        STRING,
+        RAW,
+    };
+
+    struct Entry {
+        uint16_t id;
+        Type type;
+        int32_t value;      // index into mStrings for STRING and RAW
+    };
+
+    size_t size() const {
+        return mEntries.size();
+    }
+
+    bool empty() const {
+        return mEntries.empty();
+    }
+
+    bool contains(uint16_t id) const {
+        return find(id) != nullptr;
+    }
+
+    /* the entry of datapoint id, nullptr if the device does not have it */
+    const Entry* find(uint16_t id) const {
+        auto it = lowerBound(id);
+        return ((it != mEntries.end()) && (it->id == id)) ? &*it : nullptr;
+    }
+
+    bool getBool(uint16_t id, bool fallback = false) const {
+        const Entry* entry = find(id);
+        return (entry && isNumber(*entry)) ? entry->value : fallback;
+    }
+
+    int32_t getInt(uint16_t id, int32_t fallback = 0) const {
+        const Entry* entry = find(id);
+        return (entry && isNumber(*entry)) ? entry->value : fallback;
+    }
+
+    /* the value of ENUM and STRING datapoints, the json text of RAW ones, "" otherwise */
+    const std::string& getString(uint16_t id) const {
+        const Entry* entry = find(id);
+        return entry ? str(*entry) : enumValues()[0];
+    }
+
+    void set(uint16_t id, const ordered_json& value) {
+        Entry& entry = at(id);
+
+        if (value.is_boolean()) {
+            setNumber(entry, BOOL, value.get<bool>());
+        } else if (value.is_number_integer() && fitsInt(value)) {
+            setNumber(entry, INT, value.get<int32_t>());
+        } else if (value.is_string()) {
+            const auto& str = value.get_ref<const std::string&>();
+            setString(entry, str.data(), str.length());
+        } else if (value.is_null()) {
+            setNumber(entry, NONE, 0);
+        } else {
+            const std::string json = value.dump();
+            setString(entry, RAW, json.data(), json.length());
+        }
+    }
+
+    /* the sink interface of DpsDecoder */
+    void setBool(uint16_t id, bool b) {
+        setNumber(at(id), BOOL, b);
+    }
+
+    void setInt(uint16_t id, int64_t i) {
+        if ((i >= INT32_MIN) && (i <= INT32_MAX)) {
+            setNumber(at(id), INT, (int32_t) i);
+        } else {
+            const std::string json = std::to_string(i);
+            setString(at(id), RAW, json.data(), json.length());
+        }
+    }
+
+    void setString(uint16_t id, const char* s, size_t len) {
+        setString(at(id), s, len);
+    }
+
+    /* merge the datapoints of a JSON payload without building a DOM, see DpsDecoder */
+    bool decode(const char* json, size_t len) {
+        return DpsDecoder<DpsStore>::decode(json, len, *this);
+    }
+
+    /* merge the "dps" object of a STATUS or DP_QUERY message, returns false if it is not an
+     * object; keys that are not numeric are ignored
+     */
+    bool update(const ordered_json& dps) {
+        if (!dps.is_object())
+            return false;
+        for (auto it = dps.begin(); it != dps.end(); ++it) {
+            uint16_t id;
+            if (parseDpsId(it.key(), id))
+                set(id, it.value());
+        }
+        return true;
+    }
+
+    /* replace all datapoints */
+    bool assign(const ordered_json& dps) {
+        if (!dps.is_object())
+            return false;
+        clear();
+        update(dps);
+        mEntries.shrink_to_fit();
+        return true;
+    }
+
+    void clear() {
+        mEntries.clear();
+        mStrings.clear();
+        mFreeStrings.clear();
+    }
+
+    ordered_json toJson() const {
+        ordered_json dps = ordered_json::object();
+        for (const auto& entry : mEntries)
+            dps[std::to_string(entry.id)] = toJson(entry);
+        return dps;
+    }
+
+    ordered_json toJson(const Entry& entry) const {
+        switch (entry.type) {
+        case BOOL:      return (bool) entry.value;
+        case INT:       return entry.value;
+        case ENUM:
+        case STRING:    return str(entry);
+        case RAW:       return ordered_json::parse(str(entry), nullptr, false);
+        default:        return nullptr;
+        }
+    }
+
+    std::vector<Entry>::const_iterator begin() const {
+        return mEntries.begin();
+    }
+
+    std::vector<Entry>::const_iterator end() const {
+        return mEntries.end();
+    }
+
+private:
+    /* the first one is returned for datapoints without string value */
+    static const std::vector<std::string>& enumValues() {
+        static const std::vector<std::string> values = { "", "white", "colour", "scene", "music" };
+        return values;
+    }
+
+    static bool isNumber(const Entry& entry) {
+        return (entry.type == BOOL) || (entry.type == INT);
+    }
+
+    static bool hasString(const Entry& entry) {
+        return (entry.type == STRING) || (entry.type == RAW);
+    }
+
+    static bool fitsInt(const ordered_json& value) {
+        if (value.is_number_unsigned())
+            return value.get<uint64_t>() <= INT32_MAX;
+        const int64_t i = value.get<int64_t>();
+        return (i >= INT32_MIN) && (i <= INT32_MAX);
+    }
+
+    const std::string& str(const Entry& entry) const {
+        switch (entry.type) {
+        case ENUM:      return enumValues()[entry.value];
+        case STRING:
+        case RAW:       return mStrings[entry.value];
+        default:        return enumValues()[0];
+        }
+    }
+
+    Entry& at(uint16_t id) {
+        auto it = lowerBound(id);
+        if ((it == mEntries.end()) || (it->id != id))
+            it = mEntries.insert(it, Entry{id, NONE, 0});
+        return *it;
+    }
+
+    void setString(Entry& entry, const char* s, size_t len) {
+        const auto& values = enumValues();
+        for (size_t i = 1; i < values.size(); i++) {
+            if ((values[i].length() == len) && !memcmp(values[i].data(), s, len)) {
+                setNumber(entry, ENUM, i);
+                return;
+            }
+        }
+        setString(entry, STRING, s, len);
+    }
+
+    /* a datapoint keeps its string as long as it has a string value, the strings of
+     * datapoints that change to another type are reused by the next one that needs one
+     */
+    void setString(Entry& entry, Type type, const char* s, size_t len) {
+        if (!hasString(entry)) {
+            if (mFreeStrings.empty()) {
+                entry.value = mStrings.size();
+                mStrings.emplace_back();
+            } else {
+                entry.value = mFreeStrings.back();
+                mFreeStrings.pop_back();
+            }
+        }
+        entry.type = type;
+        mStrings[entry.value].assign(s, len);
+    }
+
+    void setNumber(Entry& entry, Type type, int32_t value) {
+        if (hasString(entry))
+            mFreeStrings.push_back(entry.value);
+        entry.type = type;
+        entry.value = value;
+    }
+
+    std::vector<Entry>::const_iterator lowerBound(uint16_t id) const {
+        return std::lower_bound(mEntries.begin(), mEntries.end(), id,
+                                [] (const Entry& entry, uint16_t i) { return entry.id < i; });
+    }
+
+    std::vector<Entry>::iterator lowerBound(uint16_t id) {
+        return std::lower_bound(mEntries.begin(), mEntries.end(), id,
+                                [] (const Entry& entry, uint16_t i) { return entry.id < i; });
+    }
+
+    std::vector<Entry> mEntries;
+    std::vector<std::string> mStrings;
+    std::vector<int32_t> mFreeStrings;
+};
+
+} // namespace tuya
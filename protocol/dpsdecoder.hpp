@@ -0,0 +1,254 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace tuya {
+
+/* datapoint ids are the keys of "dps", numbers up to 65535 */
+inline bool parseDpsId(const char* key, size_t len, uint16_t& id) {
+    if (!len || (len > 5))
+        return false;
+    uint32_t value = 0;
+    for (size_t i = 0; i < len; i++) {
+        if ((key[i] < '0') || (key[i] > '9'))
+            return false;
+        value = value * 10 + (key[i] - '0');
+    }
+    if (value > UINT16_MAX)
+        return false;
+    id = (uint16_t) value;
+    return true;
+}
+
+inline bool parseDpsId(const std::string& key, uint16_t& id) {
+    return parseDpsId(key.data(), key.length(), id);
+}
+
+/* Streaming decoder for the datapoints of a payload such as
+ *
+ *   {"devId":"...","dps":{"20":true,"22":500},"t":1700000000}
+ *   {"protocol":4,"t":1700000000,"data":{"dps":{"20":true}}}
+ *
+ * It passes them to sink.setBool(id, bool), sink.setInt(id, int64_t) and
+ * sink.setString(id, const char*, size_t) while it scans the text, without building a DOM
+ * and without allocating. Everything else is skipped. Shapes it does not handle make it
+ * return false, the caller then falls back to the DOM:
+ * - datapoints with values other than booleans, integers and strings
+ * - strings with escape sequences
+ * - ids that are not numeric
+ * - invalid JSON
+ * Values that have been passed to the sink until then are passed again by the DOM.
+ */
+template <typename Sink>
+class DpsDecoder {
+public:
+    /* returns true if the payload had a "dps" object and all of it went to the sink */
+    static bool decode(const char* json, size_t len, Sink& sink) {
+        DpsDecoder decoder(json, len, sink);
+        decoder.skipWhitespace();
+        if (!decoder.consume('{') || !decoder.object(TOP, 1))
+            return false;
+        decoder.skipWhitespace();
+        return (decoder.mPos == decoder.mEnd) && decoder.mDecoded;
+    }
+
+private:
+    static const int MAX_DEPTH = 32;
+
+    enum Context {
+        TOP,
+        DATA,
+        DPS,
+        OTHER,
+    };
+
+    DpsDecoder(const char* json, size_t len, Sink& sink) : mPos(json), mEnd(json + len), mSink(sink), mDecoded(false) {}
+
+    void skipWhitespace() {
+        while ((mPos < mEnd) && ((*mPos == ' ') || (*mPos == '\t') || (*mPos == '\n') || (*mPos == '\r')))
+            mPos++;
+    }
+
+    bool consume(char c) {
+        skipWhitespace();
+        if ((mPos == mEnd) || (*mPos != c))
+            return false;
+        mPos++;
+        return true;
+    }
+
+    bool literal(const char* s, size_t len) {
+        if (((size_t) (mEnd - mPos) < len) || memcmp(mPos, s, len))
+            return false;
+        mPos += len;
+        return true;
+    }
+
+    /* the members of an object whose '{' has been consumed */
+    bool object(Context context, int depth) {
+        if (depth > MAX_DEPTH)
+            return false;
+        if (consume('}'))
+            return endObject(context);
+
+        do {
+            const char* key;
+            size_t keyLen;
+            skipWhitespace();
+            if (!string(key, keyLen) || !consume(':'))
+                return false;
+
+            bool ok;
+            if (context == DPS) {
+                uint16_t id;
+                ok = parseDpsId(key, keyLen, id) && dpsValue(id);
+            } else if (((context == TOP) || (context == DATA)) && isKey(key, keyLen, "dps")) {
+                ok = consume('{') && object(DPS, depth + 1);
+            } else if ((context == TOP) && isKey(key, keyLen, "data")) {
+                ok = consume('{') ? object(DATA, depth + 1) : value(depth + 1);
+            } else {
+                ok = value(depth + 1);
+            }
+            if (!ok)
+                return false;
+        } while (consume(','));
+
+        return consume('}') && endObject(context);
+    }
+
+    bool endObject(Context context) {
+        if (context == DPS)
+            mDecoded = true;
+        return true;
+    }
+
+    bool dpsValue(uint16_t id) {
+        skipWhitespace();
+        if (mPos == mEnd)
+            return false;
+
+        switch (*mPos) {
+        case 't':
+            if (!literal("true", 4))
+                return false;
+            mSink.setBool(id, true);
+            return true;
+        case 'f':
+            if (!literal("false", 5))
+                return false;
+            mSink.setBool(id, false);
+            return true;
+        case '"': {
+            const char* s;
+            size_t len;
+            if (!string(s, len))
+                return false;
+            mSink.setString(id, s, len);
+            return true;
+        }
+        default: {
+            int64_t i;
+            if (!integer(i))
+                return false;
+            mSink.setInt(id, i);
+            return true;
+        }
+        }
+    }
+
+    /* skip any value */
+    bool value(int depth) {
+        skipWhitespace();
+        if ((mPos == mEnd) || (depth > MAX_DEPTH))
+            return false;
+
+        const char* s;
+        size_t len;
+        switch (*mPos) {
+        case '{':
+            mPos++;
+            return object(OTHER, depth);
+        case '[':
+            mPos++;
+            if (consume(']'))
+                return true;
+            do {
+                if (!value(depth + 1))
+                    return false;
+            } while (consume(','));
+            return consume(']');
+        case '"':
+            return string(s, len);
+        case 't':
+            return literal("true", 4);
+        case 'f':
+            return literal("false", 5);
+        case 'n':
+            return literal("null", 4);
+        default:
+            return number();
+        }
+    }
+
+    /* a string without escape sequences, s points into the payload */
+    bool string(const char*& s, size_t& len) {
+        if ((mPos == mEnd) || (*mPos != '"'))
+            return false;
+        s = ++mPos;
+        while ((mPos < mEnd) && (*mPos != '"')) {
+            if ((*mPos == '\\') || ((unsigned char) *mPos < 0x20))
+                return false;
+            mPos++;
+        }
+        if (mPos == mEnd)
+            return false;
+        len = mPos++ - s;
+        return true;
+    }
+
+    /* an integer of up to 18 digits, which can't overflow */
+    bool integer(int64_t& i) {
+        const bool negative = (mPos < mEnd) && (*mPos == '-');
+        if (negative)
+            mPos++;
+
+        const char* start = mPos;
+        i = 0;
+        while ((mPos < mEnd) && (*mPos >= '0') && (*mPos <= '9') && (mPos - start < 18))
+            i = i * 10 + (*mPos++ - '0');
+
+        const size_t digits = mPos - start;
+        if (!digits || ((*start == '0') && (digits > 1)))
+            return false;
+        /* longer numbers, fractions and exponents are left to the DOM */
+        if ((mPos < mEnd) && (((*mPos >= '0') && (*mPos <= '9')) || (*mPos == '.') || (*mPos == 'e') || (*mPos == 'E')))
+            return false;
+        if (negative)
+            i = -i;
+        return true;
+    }
+
+    /* skip any number */
+    bool number() {
+        if ((mPos < mEnd) && (*mPos == '-'))
+            mPos++;
+        const char* start = mPos;
+        while ((mPos < mEnd) && (((*mPos >= '0') && (*mPos <= '9')) || (*mPos == '.') || (*mPos == 'e') ||
+                                 (*mPos == 'E') || (*mPos == '+') || (*mPos == '-')))
+            mPos++;
+        return (mPos > start) && (*start >= '0') && (*start <= '9');
+    }
+
+    static bool isKey(const char* key, size_t len, const char* name) {
+        return (strlen(name) == len) && !memcmp(key, name, len);
+    }
+
+    const char* mPos;
+    const char* const mEnd;
+    Sink& mSink;
+    bool mDecoded;
+};
+
+} // namespace tuya
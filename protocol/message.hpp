@@ -1,17 +1,15 @@
 #pragma once
 
 #include <iostream>
+#include <cstdlib>
+#include <map>
 #include <sstream>
 
-#ifdef TUYACPP_USE_MBEDTLS
-    #include <mbedtls/aes.h>
-#else
-    #include <openssl/evp.h>
-#endif
-
 #include <nlohmann/json.hpp>
 using ordered_json = nlohmann::ordered_json;
 
+#include "cipher.hpp"
+#include "dpsdecoder.hpp"
 #include "../logging.hpp"
 
 namespace tuya {
@@ -19,12 +17,50 @@ namespace tuya {
 class Message {
 public:
     enum Command {
-        CONTROL         = 0x07,
-        STATUS          = 0x08,
-        DP_QUERY        = 0x0a,
-        UDP_NEW         = 0x13,
+        SESS_KEY_NEG_START  = 0x03,
+        SESS_KEY_NEG_RESP   = 0x04,
+        SESS_KEY_NEG_FINISH = 0x05,
+        CONTROL             = 0x07,
+        STATUS              = 0x08,
+        HEART_BEAT          = 0x09,
+        DP_QUERY            = 0x0a,
+        CONTROL_NEW         = 0x0d,
+        DP_QUERY_NEW        = 0x10,
+        UDP_NEW             = 0x13,
+    };
+
+    /* protocol versions: 3.3 sends 55AA frames with a CRC, 3.4 55AA frames with an HMAC
+     * and 3.5 6699 frames with AES-GCM; both of the latter negotiate a session key first
+     */
+    enum Version {
+        V3_3 = 33,
+        V3_4 = 34,
+        V3_5 = 35,
     };
 
+    /* "3.4" or 3.4 as found in devices.json, 3.3 for anything else */
+    static Version parseVersion(const ordered_json& version) {
+        int v = 0;
+        if (version.is_string())
+            v = (int) (std::atof(version.get_ref<const std::string&>().c_str()) * 10 + 0.5);
+        else if (version.is_number())
+            v = (int) (version.get<double>() * 10 + 0.5);
+        return ((v == V3_4) || (v == V3_5)) ? (Version) v : V3_3;
+    }
+
+    static const char* versionString(Version version) {
+        switch (version) {
+        case V3_4:  return "3.4";
+        case V3_5:  return "3.5";
+        default:    return "3.3";
+        }
+    }
+
+    /* the payloads of the session key negotiation are binary and never parsed as JSON */
+    static bool isRawCommand(uint32_t cmd) {
+        return (cmd == SESS_KEY_NEG_START) || (cmd == SESS_KEY_NEG_RESP) || (cmd == SESS_KEY_NEG_FINISH);
+    }
+
     // md5(b"yGAdlopoPVldABfn").digest()
     static constexpr const char* DEFAULT_KEY = "l\x1e\xc8\xe2\xbb\x9b\xb5\x9a\xb5\x0b\r\xaf""d\x9b""A\n";
 
@@ -32,26 +68,82 @@ public:
     mPrefix(prefix),
     mSeqNo(seqNo),
     mCmd(cmd),
-    mData(data) {
+    mData(data),
+    mRaw(false),
+    mDecryptFailed(false) {
 
     }
 
     operator std::string() const {
         std::ostringstream ss;
         ss << std::hex << "Message { prefix: 0x" << mPrefix << ", seqno: 0x" << mSeqNo
-           << ", cmd: 0x" << mCmd << std::dec << ", data: " << mData << " }";
+           << ", cmd: 0x" << mCmd << std::dec << ", data: ";
+        if (mRaw)
+            ss << mPayload.length() << " bytes";
+        else
+            ss << data();
+        ss << " }";
         return ss.str();
     }
 
 
-    bool hasData() {
+    /* false if the payload of a received message could not be decrypted, this does not
+     * parse the payload, so that decodeDps() can still take the datapoints from it
+     */
+    bool hasData() const {
+        if (mDecryptFailed)
+            return false;
+        if (mPayload.length())
+            return true;
         return !(mData.is_array() && (mData.size() == 1) && mData.at(0).is_null());
     }
 
+    /* The payload of a received message is parsed when it is asked for the first time, so
+     * that handlers which only need the datapoints can take them from decodeDps() instead.
+     * The datapoints of lights also show up under aliases such as "is_on" and "brightness".
+     */
     const ordered_json& data() const {
+        /* only mutable members are modified, the cast is for the non-const TAG() of the logs */
+        if (mPayload.length() && !mRaw)
+            const_cast<Message*>(this)->parsePayload();
         return mData;
     }
 
+    /* "dps" of a payload, or of its "data" as sent by 3.4 and later devices */
+    static const ordered_json* findDps(const ordered_json& data) {
+        auto dps = data.find("dps");
+        if (dps != data.end())
+            return &*dps;
+        auto inner = data.find("data");
+        if ((inner == data.end()) || !inner->is_object())
+            return nullptr;
+        dps = inner->find("dps");
+        return (dps != inner->end()) ? &*dps : nullptr;
+    }
+
+    /* messages of the session key negotiation carry binary payloads instead of JSON */
+    bool isRaw() const {
+        return mRaw;
+    }
+
+    const std::string& rawPayload() const {
+        return mPayload;
+    }
+
+    void setRawPayload(const char* payload, size_t len) {
+        mPayload.assign(payload, len);
+        mRaw = true;
+    }
+
+    /* Pass the datapoints of a received message to sink, see DpsDecoder. Returns false if
+     * they have to be taken from data(), e.g. because it has been parsed already or because
+     * the payload has values that the decoder does not handle.
+     */
+    template <typename Sink>
+    bool decodeDps(Sink& sink) const {
+        return mPayload.length() && !mRaw && DpsDecoder<Sink>::decode(mPayload.data(), mPayload.length(), sink);
+    }
+
     uint32_t prefix() const {
         return mPrefix;
     }
@@ -66,8 +158,14 @@ public:
 
     const std::string& cmdString() const {
         static const std::map<Command, const std::string> cmdToString = {
+            { Command::SESS_KEY_NEG_START, "SESS_KEY_NEG_START" },
+            { Command::SESS_KEY_NEG_RESP, "SESS_KEY_NEG_RESP" },
+            { Command::SESS_KEY_NEG_FINISH, "SESS_KEY_NEG_FINISH" },
             { Command::CONTROL, "CONTROL" },
+            { Command::CONTROL_NEW, "CONTROL_NEW" },
             { Command::DP_QUERY, "DP_QUERY" },
+            { Command::DP_QUERY_NEW, "DP_QUERY_NEW" },
+            { Command::HEART_BEAT, "HEART_BEAT" },
             { Command::STATUS, "STATUS" },
             { Command::UDP_NEW, "UDP_NEW" },
         };
@@ -78,121 +176,144 @@ public:
         return unknownCommand;
     }
 
-    virtual std::string serialize(const std::string& key = DEFAULT_KEY, bool noRetCode = true) = 0;
+    /* cipher for DEFAULT_KEY, one per thread because cipher contexts are not thread-safe */
+    static Cipher& defaultCipher() {
+        static thread_local Cipher sCipher(DEFAULT_KEY);
+        return sCipher;
+    }
+
+    /* append the frame to out, e.g. a send buffer, and return its length (0 on errors) */
+    virtual size_t serializeTo(std::string& out, Cipher& cipher = defaultCipher(), bool noRetCode = true) = 0;
+
+    std::string serialize(Cipher& cipher = defaultCipher(), bool noRetCode = true) {
+        std::string result;
+        serializeTo(result, cipher, noRetCode);
+        return result;
+    }
 
 protected:
     LOG_MEMBERS(MESSAGE);
 
-    std::string encrypt(const std::string& plain, const std::string& key) {
-        std::string err;
-        const char padNum = 16 - plain.length() % 16;
-        std::string result = plain + std::string(padNum, padNum);
-
-#ifdef TUYACPP_USE_MBEDTLS
-        size_t p_len = result.length();
-        int f_len = 0;
-        mbedtls_aes_context aes_ctx;
-        mbedtls_aes_init(&aes_ctx);
-        if (mbedtls_aes_setkey_enc(&aes_ctx, (const unsigned char *) key.data(), 128) != 0) {
-            err = "mbedtls_aes_setkey_enc failed";
-        }
-        if (!err.length()) {
-            for (size_t i = 0; i < result.length(); i += 16) {
-                if (mbedtls_aes_crypt_ecb(&aes_ctx, MBEDTLS_AES_ENCRYPT, (const unsigned char *) result.data() + i, (unsigned char *) result.data() + i) != 0) {
-                    err = "mbedtls_aes_crypt_ecb failed";
-                    break;
-                }
-            }
-        }
-        mbedtls_aes_free(&aes_ctx);
-#else
-        int p_len = result.length();
-
-        EVP_CIPHER_CTX* en = EVP_CIPHER_CTX_new();
-        EVP_CIPHER_CTX_init(en);
-        if(EVP_EncryptInit_ex(en, EVP_aes_128_ecb(), NULL, (const unsigned char *) key.data(), NULL) != 1) {
-            err = "EVP_EncryptInit_ex failed";
-        }
-        if(!err.length() && EVP_EncryptUpdate(en, (unsigned char *) result.data(), &p_len, (const unsigned char *) result.data(), result.length()) != 1) {
-            err = "EVP_EncryptUpdate failed";
-        }
-        // TODO: EVP_DecryptFinal_ex ?
-        // if(EVP_DecryptFinal_ex(de, mPayload.get() + p_len, &f_len) != 1) {
-        //     err = "EVP_DecryptFinal_ex failed" << std::endl;
-        // }
-        result.resize(p_len);
-        EVP_CIPHER_CTX_free(en);
-#endif
-
-        if(err.length()) {
-            result.clear();
-            LOGE() << "encrypt() failed: " << err << std::endl;
-        }
+    /* per-thread buffer for serialized payloads, it only allocates until it has grown to the
+     * largest payload seen
+     */
+    static std::string& scratchBuffer() {
+        static thread_local std::string sScratch;
+        return sScratch;
+    }
 
-        return result;
+    /* mData as compact JSON in the scratch buffer, like mData.dump() but without allocating
+     * a new string each time
+     */
+    const std::string& dumpData() const {
+        static thread_local nlohmann::detail::serializer<ordered_json> sSerializer(
+            nlohmann::detail::output_adapter<char, std::string>(scratchBuffer()), ' ');
+        auto& scratch = scratchBuffer();
+        scratch.clear();
+        sSerializer.dump(mData, false, false, 0);
+        return scratch;
     }
 
-    std::string decrypt(const std::string& cipher, const std::string& key) {
-        // TODO: padding operation should be symmetric with encrypt
-        std::string err;
-        std::string result = cipher;
+    /* the plain text of an outgoing message: its raw payload or mData as JSON */
+    const std::string& plainPayload() const {
+        return mRaw ? mPayload : dumpData();
+    }
 
-#ifdef TUYACPP_USE_MBEDTLS
-        size_t p_len = result.length();
-        int f_len = 0;
-        mbedtls_aes_context aes_ctx;
-        mbedtls_aes_init(&aes_ctx);
-        if (mbedtls_aes_setkey_dec(&aes_ctx, (const unsigned char *) key.data(), 128) != 0) {
-            err = "mbedtls_aes_setkey_enc failed";
-        }
-        if (!err.length()) {
-            for (size_t i = 0; i < result.length(); i += 16) {
-                if (mbedtls_aes_crypt_ecb(&aes_ctx, MBEDTLS_AES_DECRYPT, (const unsigned char *) result.data() + i, (unsigned char *) result.data() + i) != 0) {
-                    err = "mbedtls_aes_crypt_ecb failed";
-                    break;
-                }
-            }
-        }
-        mbedtls_aes_free(&aes_ctx);
-#else
-        int p_len = cipher.length();
-        int f_len = 0;
-
-        EVP_CIPHER_CTX* de = EVP_CIPHER_CTX_new();
-        EVP_CIPHER_CTX_init(de);
-        if(EVP_DecryptInit_ex(de, EVP_aes_128_ecb(), NULL, (const unsigned char *) key.data(), NULL) != 1) {
-            err = "EVP_DecryptInit_ex failed";
-        }
-        if(!err.length() && EVP_DecryptUpdate(de, (unsigned char *) result.data(), &p_len, (const unsigned char *) cipher.data(), cipher.length()) != 1) {
-            err = "EVP_DecryptUpdate failed";
-        }
-        if(EVP_DecryptFinal_ex(de, (unsigned char *) result.data() + p_len, &f_len) != 1) {
-            err = "EVP_DecryptFinal_ex failed";
-        }
-        EVP_CIPHER_CTX_free(de);
-#endif
-
-        p_len += f_len;
-        if (!err.length()) {
-#ifdef TUYACPP_USE_MBEDTLS
-            // TODO: for some reason, even when using the mbedtls_cipher API, we cannot get the correct length, so we have to rely on the JSON format
-            result.resize(result.find_last_of('}') + 1);
-#else
-            result.resize(p_len);
-#endif
-        } else {
-            result.clear();
-            LOGE() << "decrypt() failed: " << err << std::endl;
+    /* the queries, heartbeats and the negotiation go without the version header that is in
+     * front of the payload of other commands
+     */
+    static bool hasVersionHeader(uint32_t cmd) {
+        switch (cmd) {
+        case DP_QUERY:
+        case DP_QUERY_NEW:
+        case HEART_BEAT:
+        case UDP_NEW:
+        case SESS_KEY_NEG_START:
+        case SESS_KEY_NEG_RESP:
+        case SESS_KEY_NEG_FINISH:
+            return false;
+        default:
+            return true;
         }
+    }
 
-        return result;
+    /* "3.x" and 12 zero bytes, returns the number of bytes appended to out */
+    static size_t appendVersionHeader(std::string& out, Version version, uint32_t cmd) {
+        if (!hasVersionHeader(cmd))
+            return 0;
+        out.append(versionString(version), 3);
+        out.append(VERSION_HEADER_SIZE - 3, '\0');
+        return VERSION_HEADER_SIZE;
+    }
+
+    static const size_t VERSION_HEADER_SIZE = 15;
+
+    /* take the decrypted plain text of a received message: strip the version header if it
+     * has one and keep the rest as raw payload or JSON text for data() and decodeDps()
+     */
+    void setPlainPayload() {
+        mRaw = isRawCommand(mCmd);
+        if (!mRaw && (mPayload.length() >= VERSION_HEADER_SIZE) && (mPayload[0] == '3') && (mPayload[1] == '.'))
+            mPayload.erase(0, VERSION_HEADER_SIZE);
+        if (mPayload.empty() && !mRaw)
+            mData = ordered_json::object();
     }
 
     uint32_t mPrefix;
     uint32_t mSeqNo;
     uint32_t mCmd;
     uint32_t mRetCode;
-    ordered_json mData;
+    mutable ordered_json mData;
+    /* JSON text of a received message that has not been parsed into mData yet, or the
+     * binary payload of a raw one
+     */
+    mutable std::string mPayload;
+    bool mRaw;
+    bool mDecryptFailed;
+
+private:
+    void parsePayload() {
+        static const std::map<int, const std::string> dpsToString = {
+            {1, "is_on"},
+            {2, "brightness"}, // {2, "mode"},
+            {3, "colourtemp"}, // {3, "brightness"},
+            // {4, "colourtemp"},
+            // {5, "colour"},
+            {20, "is_on"},
+            {21, "mode"},
+            {22, "brightness"},
+            {23, "colourtemp"},
+            {24, "colour"},
+        };
+
+        std::string payload;
+        payload.swap(mPayload);
+        try {
+            mData = ordered_json::parse(payload);
+        } catch (const ordered_json::parse_error& e) {
+            TUYACPP_LOGE() << "Failed to parse " << (const std::string&) *this << " payload: " << payload << std::endl;
+            mData = ordered_json();
+            return;
+        }
+
+        /* adding the aliases must not reallocate mData, which would copy the "dps" value we
+         * are iterating over, so it is looked up once mData has room for them
+         */
+        const ordered_json* dpsObj = findDps(mData);
+        if (!dpsObj || !dpsObj->is_object())
+            return;
+        auto data = mData.get_ptr<ordered_json::object_t*>();
+        data->reserve(data->size() + dpsObj->size());
+        const auto& dps = *findDps(mData)->get_ptr<const ordered_json::object_t*>();
+        for (const auto& dp : dps) {
+            uint16_t id;
+            if (!parseDpsId(dp.first, id))
+                continue;
+            auto dpsString = dpsToString.find(id);
+            if (dpsString != dpsToString.end())
+                mData[dpsString->second] = dp.second;
+        }
+    }
 };
 
 } // namespace tuya
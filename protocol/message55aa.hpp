@@ -1,23 +1,34 @@
 #pragma once
 
+#include <cstddef>
+#include <cstring>
 #include <iostream>
 #include <memory>
 
 #include <netinet/in.h>
 
-#include <CRC.h>
 #include <nlohmann/json.hpp>
 using ordered_json = nlohmann::ordered_json;
 
+#include "crc32.hpp"
 #include "message.hpp"
 #include "../logging.hpp"
 
 namespace tuya {
 
+/* Frames of protocol 3.3 and 3.4:
+ *
+ *   prefix seqNo cmd len [retCode] payload crc|hmac suffix
+ *
+ * 3.3 payloads are encrypted with the local key and checksummed with a CRC, their version
+ * header is in front of the encrypted payload. 3.4 payloads are encrypted with the session
+ * key, version header included, and authenticated by an HMAC-SHA256 over everything in front
+ * of it. Both are checked straight in the receive buffer.
+ */
 class Message55AA : public Message {
 public:
     static const uint32_t PREFIX = 0x55aa;
-    static const uint32_t SUFFIX = 0xaa55;   
+    static const uint32_t SUFFIX = 0xaa55;
 
     struct Header {
         uint32_t prefix;
@@ -34,114 +45,155 @@ public:
         uint32_t suffix;
     };
 
-    Message55AA(uint32_t seqNo, uint32_t cmd, const ordered_json& data) :
-        Message(PREFIX, seqNo, cmd, data) {
+    Message55AA(uint32_t seqNo, uint32_t cmd, const ordered_json& data, Version version = V3_3) :
+        Message(PREFIX, seqNo, cmd, data),
+        mVersion(version) {
     }
 
-    Message55AA(const std::string& raw, uint32_t& parsedSize, const std::string& key = DEFAULT_KEY, bool noRetCode = false) :
-        Message(0, 0, 0, ordered_json{{}}) {
-        static const std::map<int, const std::string> dpsToString = {
-            {1, "is_on"},
-            {2, "brightness"}, // {2, "mode"},
-            {3, "colourtemp"}, // {3, "brightness"},
-            // {4, "colourtemp"},
-            // {5, "colour"},
-            {20, "is_on"},
-            {21, "mode"},
-            {22, "brightness"},
-            {23, "colourtemp"},
-            {24, "colour"},
-        };
+    /* total length of the frame that starts at raw, or 0 if the header is not complete yet */
+    static size_t frameLength(const char* raw, size_t rawLen) {
+        const size_t lenEnd = offsetof(Header, payloadLen) + sizeof(uint32_t);
+        if (rawLen < lenEnd)
+            return 0;
+
+        uint32_t payloadLen;
+        memcpy(&payloadLen, raw + offsetof(Header, payloadLen), sizeof(payloadLen));
+        return lenEnd + ntohl(payloadLen);
+    }
+
+    Message55AA(const std::string& raw, uint32_t& parsedSize, Cipher& cipher = defaultCipher(), bool noRetCode = false,
+                Version version = V3_3) :
+        Message55AA(raw.data(), raw.length(), parsedSize, cipher, noRetCode, version) {
+    }
+
+    Message55AA(const char* raw, size_t rawLen, uint32_t& parsedSize, Cipher& cipher = defaultCipher(), bool noRetCode = false,
+                Version version = V3_3) :
+        Message(0, 0, 0, ordered_json()),
+        mVersion(version) {
         const size_t headerLen = noRetCode ? (sizeof(Header) - sizeof(uint32_t)) : sizeof(Header);
-        if (raw.length() < headerLen + sizeof(Footer))
+        const size_t footerLen = footerLength();
+        if (rawLen < headerLen + footerLen)
             throw std::runtime_error("message too short");
 
-        const Header *header = reinterpret_cast<const Header *>(raw.data());
-        mPrefix = ntohl(header->prefix);
-        mSeqNo = ntohl(header->seqNo);
-        mCmd = ntohl(header->cmd);
+        /* the frame may start anywhere in the receive buffer, so it is copied */
+        Header header;
+        memcpy(&header, raw, headerLen);
+        mPrefix = ntohl(header.prefix);
+        mSeqNo = ntohl(header.seqNo);
+        mCmd = ntohl(header.cmd);
         if (!noRetCode)
-            mRetCode = ntohl(header->retCode);
-        uint32_t payloadLen = ntohl(header->payloadLen);
-        uint32_t dataLen = sizeof(Header) + payloadLen - sizeof(uint32_t);
+            mRetCode = ntohl(header.retCode);
+        const size_t dataLen = offsetof(Header, retCode) + ntohl(header.payloadLen);
+
+        if (dataLen < headerLen + footerLen)
+            throw std::runtime_error("invalid payload length");
 
-        if (raw.length() < dataLen)
+        if (rawLen < dataLen)
             throw std::runtime_error("not enough data");
 
-        const Footer *footer = reinterpret_cast<const Footer *>(raw.data() + dataLen - sizeof(Footer));
-        if (ntohl(footer->suffix) != SUFFIX)
+        uint32_t suffix;
+        memcpy(&suffix, raw + dataLen - sizeof(uint32_t), sizeof(suffix));
+        if (ntohl(suffix) != SUFFIX)
             throw std::runtime_error("invalid suffix");
 
-        uint32_t crc = CRC::Calculate(raw.data(), dataLen - sizeof(Footer), CRC::CRC_32());
-        if (ntohl(footer->crc) != crc)
-            throw std::runtime_error("invalid CRC");
+        const char* check = raw + dataLen - footerLen;
+        if (mVersion >= V3_4) {
+            if (!cipher.verifyHmac(raw, dataLen - footerLen, check))
+                throw std::runtime_error("invalid HMAC");
+        } else {
+            uint32_t crc;
+            memcpy(&crc, check, sizeof(crc));
+            if (ntohl(crc) != Crc32::calculate(raw, dataLen - footerLen))
+                throw std::runtime_error("invalid CRC");
+        }
 
         parsedSize = dataLen;
-        const auto& payload = std::string(raw.data() + headerLen, payloadLen - sizeof(uint32_t) - sizeof(Footer));
-        if (payload.length()) {
-            auto result = decrypt(payload.substr(payloadPrefix().length()), key);
-            if (result.length()) {
-                try {
-                    mData = ordered_json::parse(result);
-                    if (mData.contains("dps")) {
-                        auto dps = mData["dps"];
-                        for (auto it = dps.begin(); it != dps.end(); ++it) {
-                            auto dpsString = dpsToString.find(std::stoi(it.key()));
-                            if (dpsString != dpsToString.end())
-                                mData[dpsString->second] = it.value();
-                        }
-                    }
-                } catch (const ordered_json::parse_error& e) {
-                    LOGE() << "Failed to parse " << (const std::string&) *this << " payload: " << result << std::endl;
-                    mData = ordered_json();
-                }
-            } else {
-                LOGE() << "Failed to decrypt " << (const std::string&) *this << " payload: " << payload << std::endl;
+
+        /* the payload is decrypted straight from the receive buffer, it is only parsed into
+         * a DOM when someone asks for data()
+         */
+        const char* payload = raw + headerLen;
+        const size_t payloadLen = dataLen - headerLen - footerLen;
+        const size_t prefixLen = ((mVersion < V3_4) && hasVersionHeader(mCmd)) ? VERSION_HEADER_SIZE : 0;
+        if (payloadLen) {
+            if (payloadLen > prefixLen)
+                cipher.decrypt(payload + prefixLen, payloadLen - prefixLen, mPayload);
+            if (!mPayload.length()) {
+                mData = ordered_json{{}};
+                mDecryptFailed = true;
+                TUYACPP_LOGE() << "Failed to decrypt " << (const std::string&) *this << " payload of " << payloadLen << " bytes" << std::endl;
+                return;
             }
+            setPlainPayload();
         } else {
             mData = ordered_json::object();
         }
     }
 
-   virtual std::string serialize(const std::string& key = DEFAULT_KEY, bool noRetCode = true) override {
-        // TODO: demystify the three different payloadLen...
-
-        std::string result;
-
-        std::string payload = payloadPrefix() + encrypt(mData.dump(), key);
-        const uint32_t payloadLen = payload.length() + (noRetCode ? 0 : 4);
-
-        auto header = std::make_unique<Header>();
-        header->prefix = htonl(PREFIX);
-        header->seqNo = htonl(mSeqNo);
-        header->cmd = htonl(mCmd);
-        header->payloadLen = htonl(payloadLen + sizeof(Footer));
-        header->retCode = 0;
-        result += std::string((char *) header.get(), sizeof(Header) - (noRetCode ? 4 : 0));
+    Version version() const {
+        return mVersion;
+    }
 
-        result += payload;
+    /* The size of the frame is known once the payload has been dumped, so out grows at most
+     * once. Header, version header, plain text and footer are written straight into out and
+     * the plain text is padded and encrypted in place. The 3.3 CRC is continued over each
+     * piece as it is final, the 3.4 HMAC is computed over out.
+     */
+    virtual size_t serializeTo(std::string& out, Cipher& cipher = defaultCipher(), bool noRetCode = true) override {
+        const size_t start = out.length();
+        const size_t headerLen = sizeof(Header) - (noRetCode ? sizeof(uint32_t) : 0);
+        const size_t versionLen = hasVersionHeader(mCmd) ? VERSION_HEADER_SIZE : 0;
+        const std::string& plain = plainPayload();
+        /* 3.3 leaves the version header unencrypted, 3.4 encrypts it with the rest */
+        const size_t payloadLen = (mVersion >= V3_4) ? Cipher::paddedLength(versionLen + plain.length())
+                                                     : versionLen + Cipher::paddedLength(plain.length());
+        const size_t frameLen = headerLen + payloadLen + footerLength();
+        out.reserve(start + frameLen);
+
+        Header header;
+        header.prefix = htonl(PREFIX);
+        header.seqNo = htonl(mSeqNo);
+        header.cmd = htonl(mCmd);
+        /* the length counts everything after it: return code, payload and footer */
+        header.payloadLen = htonl(frameLen - offsetof(Header, retCode));
+        header.retCode = 0;
+        out.append(reinterpret_cast<const char*>(&header), headerLen);
+
+        appendVersionHeader(out, mVersion, mCmd);
+        const size_t encryptedStart = start + headerLen + ((mVersion >= V3_4) ? 0 : versionLen);
+        uint32_t crc = 0;
+        if (mVersion < V3_4)
+            crc = Crc32::update(0, out.data() + start, encryptedStart - start);
+
+        out += plain;
+        if (cipher.encryptInPlace(out, encryptedStart) < 0) {
+            out.resize(start);
+            return 0;
+        }
 
-        uint32_t crc = CRC::Calculate(result.data(), sizeof(Header) - sizeof(uint32_t) + payloadLen, CRC::CRC_32());
-        auto footer = std::make_unique<Footer>();
-        footer->crc = htonl(crc);
-        footer->suffix = htonl(SUFFIX);
-        result += std::string((char *) footer.get(), sizeof(Footer));
+        if (mVersion >= V3_4) {
+            unsigned char mac[Cipher::HMAC_SIZE];
+            if (cipher.hmac(out.data() + start, headerLen + payloadLen, mac) < 0) {
+                out.resize(start);
+                return 0;
+            }
+            out.append(reinterpret_cast<const char*>(mac), sizeof(mac));
+        } else {
+            crc = htonl(Crc32::update(crc, out.data() + encryptedStart, out.length() - encryptedStart));
+            out.append(reinterpret_cast<const char*>(&crc), sizeof(crc));
+        }
+        const uint32_t suffix = htonl(SUFFIX);
+        out.append(reinterpret_cast<const char*>(&suffix), sizeof(suffix));
 
-        return result;
+        return frameLen;
     }
 
 private:
-    std::string payloadPrefix() {
-        static const char PREFIX_VER_3_3[] = "3.3\0\0\0\0\0\0\0\0\0\0\0\0";
-
-        switch(mCmd) {
-        case DP_QUERY:
-        case UDP_NEW:
-            return "";
-        default:
-            return std::string(PREFIX_VER_3_3, sizeof(PREFIX_VER_3_3) - 1);
-        }
+    size_t footerLength() const {
+        return ((mVersion >= V3_4) ? Cipher::HMAC_SIZE : sizeof(uint32_t)) + sizeof(uint32_t);
     }
+
+    Version mVersion;
 };
 
 } // namespace tuya
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <random>
+
+#include <netinet/in.h>
+
+#include <nlohmann/json.hpp>
+using ordered_json = nlohmann::ordered_json;
+
+#include "message.hpp"
+#include "../logging.hpp"
+
+namespace tuya {
+
+/* Frames of protocol 3.5:
+ *
+ *   prefix unknown(2) seqNo cmd len | iv(12) ciphertext tag(16) | suffix
+ *
+ * The payload is encrypted with AES-128-GCM and the session key, the 14 header bytes after
+ * the prefix are authenticated with it. Frames of devices start the plain text with their
+ * return code, all of them with the version header of the command (see hasVersionHeader()).
+ * The payload is decrypted straight from the receive buffer and encrypted in place.
+ */
+class Message6699 : public Message {
+public:
+    static const uint32_t PREFIX = 0x6699;
+    static const uint32_t SUFFIX = 0x9966;
+    static const size_t HEADER_SIZE = 18;
+    static const size_t AAD_OFFSET = 4;
+
+    Message6699(uint32_t seqNo, uint32_t cmd, const ordered_json& data) :
+        Message(PREFIX, seqNo, cmd, data) {
+    }
+
+    /* total length of the frame that starts at raw, or 0 if the header is not complete yet */
+    static size_t frameLength(const char* raw, size_t rawLen) {
+        if (rawLen < HEADER_SIZE)
+            return 0;
+        return HEADER_SIZE + get32(raw + 14) + sizeof(uint32_t);
+    }
+
+    Message6699(const std::string& raw, uint32_t& parsedSize, Cipher& cipher = defaultCipher(), bool noRetCode = false) :
+        Message6699(raw.data(), raw.length(), parsedSize, cipher, noRetCode) {
+    }
+
+    Message6699(const char* raw, size_t rawLen, uint32_t& parsedSize, Cipher& cipher = defaultCipher(), bool noRetCode = false) :
+        Message(0, 0, 0, ordered_json()) {
+        const size_t minLen = HEADER_SIZE + Cipher::GCM_IV_SIZE + Cipher::GCM_TAG_SIZE + sizeof(uint32_t);
+        if (rawLen < minLen)
+            throw std::runtime_error("message too short");
+
+        mPrefix = get32(raw);
+        mSeqNo = get32(raw + 6);
+        mCmd = get32(raw + 10);
+        const size_t dataLen = frameLength(raw, rawLen);
+
+        if (dataLen < minLen)
+            throw std::runtime_error("invalid payload length");
+
+        if (rawLen < dataLen)
+            throw std::runtime_error("not enough data");
+
+        if (get32(raw + dataLen - sizeof(uint32_t)) != SUFFIX)
+            throw std::runtime_error("invalid suffix");
+
+        const unsigned char* iv = reinterpret_cast<const unsigned char*>(raw + HEADER_SIZE);
+        const char* cipherText = raw + HEADER_SIZE + Cipher::GCM_IV_SIZE;
+        const size_t cipherLen = dataLen - minLen;
+        const unsigned char* tag = reinterpret_cast<const unsigned char*>(cipherText + cipherLen);
+
+        mPayload.resize(cipherLen);
+        int ret = cipher.gcmDecrypt(iv, raw + AAD_OFFSET, HEADER_SIZE - AAD_OFFSET, cipherText, &mPayload[0], cipherLen, tag);
+        if (ret < 0) {
+            mPayload.clear();
+            throw std::runtime_error((ret == -EBADMSG) ? "invalid tag" : "failed to decrypt");
+        }
+
+        parsedSize = dataLen;
+
+        if (!noRetCode) {
+            if (mPayload.length() < sizeof(uint32_t))
+                throw std::runtime_error("missing return code");
+            mRetCode = get32(mPayload.data());
+            mPayload.erase(0, sizeof(uint32_t));
+        }
+        setPlainPayload();
+    }
+
+    /* The frame is assembled in out, which grows at most once: header, IV, return code,
+     * version header and plain text, which is then encrypted in place, and the tag.
+     */
+    virtual size_t serializeTo(std::string& out, Cipher& cipher = defaultCipher(), bool noRetCode = true) override {
+        const size_t start = out.length();
+        const std::string& plain = plainPayload();
+        const size_t plainLen = (noRetCode ? 0 : sizeof(uint32_t)) + (hasVersionHeader(mCmd) ? VERSION_HEADER_SIZE : 0) +
+                                plain.length();
+        const size_t payloadLen = Cipher::GCM_IV_SIZE + plainLen + Cipher::GCM_TAG_SIZE;
+        const size_t frameLen = HEADER_SIZE + payloadLen + sizeof(uint32_t);
+        out.reserve(start + frameLen);
+
+        put32(out, PREFIX);
+        out.append(2, '\0');
+        put32(out, mSeqNo);
+        put32(out, mCmd);
+        put32(out, payloadLen);
+
+        unsigned char iv[Cipher::GCM_IV_SIZE];
+        nextIv(iv);
+        out.append(reinterpret_cast<const char*>(iv), sizeof(iv));
+
+        const size_t plainStart = out.length();
+        if (!noRetCode)
+            put32(out, 0);
+        appendVersionHeader(out, V3_5, mCmd);
+        out += plain;
+
+        unsigned char tag[Cipher::GCM_TAG_SIZE];
+        char* text = &out[plainStart];
+        if (cipher.gcmEncrypt(iv, out.data() + start + AAD_OFFSET, HEADER_SIZE - AAD_OFFSET, text, text, plainLen, tag) < 0) {
+            out.resize(start);
+            return 0;
+        }
+        out.append(reinterpret_cast<const char*>(tag), sizeof(tag));
+        put32(out, SUFFIX);
+
+        return frameLen;
+    }
+
+private:
+    static uint32_t get32(const char* p) {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return ntohl(value);
+    }
+
+    static void put32(std::string& out, uint32_t value) {
+        value = htonl(value);
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    /* GCM must never see an IV twice with the same key: a random value per process and a
+     * counter
+     */
+    static void nextIv(unsigned char iv[Cipher::GCM_IV_SIZE]) {
+        static std::atomic<uint64_t> sCounter(0);
+        static const uint32_t sRandom = std::random_device()();
+        const uint64_t counter = sCounter++;
+        memcpy(iv, &sRandom, sizeof(sRandom));
+        memcpy(iv + sizeof(sRandom), &counter, sizeof(counter));
+    }
+};
+
+} // namespace tuya
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+
+#include <nlohmann/json.hpp>
+using ordered_json = nlohmann::ordered_json;
+
+#include "message55aa.hpp"
+#include "message6699.hpp"
+
+namespace tuya {
+
+/* Messages of a protocol version and the session key negotiation of 3.4 and 3.5:
+ *
+ *   client -> device  SESS_KEY_NEG_START   clientNonce
+ *   device -> client  SESS_KEY_NEG_RESP    deviceNonce, hmac(clientNonce)
+ *   client -> device  SESS_KEY_NEG_FINISH  hmac(deviceNonce)
+ *
+ * all of them encrypted and authenticated with the local key. Both sides then derive the
+ * session key from the nonces and use it for everything else on the connection.
+ */
+class Session {
+public:
+    static const size_t NONCE_SIZE = 16;
+
+    /* an outgoing message in the frame format of version */
+    static std::unique_ptr<Message> message(Message::Version version, uint32_t seqNo, uint32_t cmd, const ordered_json& data) {
+        if (version >= Message::V3_5)
+            return std::unique_ptr<Message>(new Message6699(seqNo, cmd, data));
+        return std::unique_ptr<Message>(new Message55AA(seqNo, cmd, data, version));
+    }
+
+    static std::unique_ptr<Message> rawMessage(Message::Version version, uint32_t seqNo, uint32_t cmd,
+                                               const char* payload, size_t len) {
+        auto msg = message(version, seqNo, cmd, ordered_json());
+        msg->setRawPayload(payload, len);
+        return msg;
+    }
+
+    static std::string nonce() {
+        static thread_local std::random_device sRandom;
+        std::string nonce(NONCE_SIZE, '\0');
+        for (size_t i = 0; i < NONCE_SIZE; i += sizeof(uint32_t)) {
+            const uint32_t r = sRandom();
+            memcpy(&nonce[i], &r, sizeof(r));
+        }
+        return nonce;
+    }
+
+    /* the session key: the nonces xored and encrypted with the local key, with AES-ECB for
+     * 3.4 and AES-GCM with the first 12 bytes of the client nonce as IV for 3.5; cipher has
+     * to be set to the local key. Returns an empty string on errors.
+     */
+    static std::string deriveKey(Cipher& cipher, Message::Version version, const std::string& clientNonce,
+                                 const std::string& deviceNonce) {
+        if ((clientNonce.length() != NONCE_SIZE) || (deviceNonce.length() != NONCE_SIZE))
+            return std::string();
+
+        unsigned char mixed[NONCE_SIZE];
+        for (size_t i = 0; i < NONCE_SIZE; i++)
+            mixed[i] = clientNonce[i] ^ deviceNonce[i];
+
+        unsigned char key[Cipher::KEY_SIZE];
+        int ret;
+        if (version >= Message::V3_5) {
+            unsigned char tag[Cipher::GCM_TAG_SIZE];
+            ret = cipher.gcmEncrypt(reinterpret_cast<const unsigned char*>(clientNonce.data()), nullptr, 0,
+                                    reinterpret_cast<const char*>(mixed), reinterpret_cast<char*>(key), NONCE_SIZE, tag);
+        } else {
+            ret = cipher.encryptBlock(mixed, key);
+        }
+        if (ret < 0)
+            return std::string();
+        return std::string(reinterpret_cast<const char*>(key), Cipher::KEY_SIZE);
+    }
+
+    static std::string hmac(Cipher& cipher, const std::string& data) {
+        unsigned char mac[Cipher::HMAC_SIZE];
+        if (cipher.hmac(data.data(), data.length(), mac) < 0)
+            return std::string();
+        return std::string(reinterpret_cast<const char*>(mac), Cipher::HMAC_SIZE);
+    }
+};
+
+} // namespace tuya
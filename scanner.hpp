@@ -1,9 +1,13 @@
 #pragma once
 
 #include <fstream>
+#include <mutex>
+#include <set>
 #include <arpa/inet.h>
 
 #include "device.hpp"
+#include "deviceregistry.hpp"
+#include "loop/looppool.hpp"
 #include "loop/udpserverhandler.hpp"
 #include "protocol/message.hpp"
 
@@ -11,81 +15,192 @@ namespace tuya {
 
 class Scanner : public UDPServerHandler {
 public:
-    Scanner(Loop& loop, const ordered_json& devicesData) : UDPServerHandler(loop, 6667, false), mKnownDevices(devicesData) {
+    Scanner(Loop& loop, const ordered_json& devicesData) : UDPServerHandler(loop, 6667, false), mPool(nullptr), mKnownDevices(devicesData) {
         init();
     }
 
-    Scanner(Loop& loop, const std::string& devicesFile = "tinytuya/devices.json") : UDPServerHandler(loop, 6667, false) {
-        std::ifstream ifs(devicesFile);
-        if (ifs.is_open()) {
-            mKnownDevices = ordered_json::parse(ifs);
-        } else {
-            LOGE() << "Failed to open file: " << devicesFile << std::endl;
-            mKnownDevices = ordered_json::array();
-        }
+    Scanner(Loop& loop, const std::string& devicesFile = "tinytuya/devices.json") : UDPServerHandler(loop, 6667, false), mPool(nullptr) {
+        mKnownDevices = loadDevices(devicesFile);
+        init();
+    }
+
+    /* the scanner runs on the first loop of the pool, devices are distributed over all loops */
+    Scanner(LoopPool& pool, const ordered_json& devicesData) : UDPServerHandler(pool.loop(0), 6667, false), mPool(&pool), mKnownDevices(devicesData) {
+        init();
+    }
 
+    Scanner(LoopPool& pool, const std::string& devicesFile = "tinytuya/devices.json") : UDPServerHandler(pool.loop(0), 6667, false), mPool(&pool) {
+        mKnownDevices = loadDevices(devicesFile);
         init();
     }
 
     ~Scanner() {
-        mLoop.detach(this);
+        if (mPool)
+            mPool->detach(this);
+        else
+            mLoop.detach(this);
     }
 
+    /* the IP addresses of all devices, prefer forEachDevice() which does not copy them */
     std::set<std::string> getDevices() {
+        std::lock_guard<std::mutex> lock(mDevicesMutex);
         std::set<std::string> devices;
-        for (const auto& it : mDevices)
-            devices.insert(it.first);
+        mDevices.forEach([&devices] (DeviceRegistry::Handle, const DeviceRegistry::Entry& entry) { devices.insert(entry.ip); });
         return devices;
     }
 
+    /* Call fn(const std::shared_ptr<Device>&) for all devices that have been created. The
+     * scanner is locked meanwhile, so fn must not call back into it.
+     */
+    template <typename F>
+    void forEachDevice(F&& fn) {
+        std::lock_guard<std::mutex> lock(mDevicesMutex);
+        mDevices.forEach([&fn] (DeviceRegistry::Handle, const DeviceRegistry::Entry& entry) {
+            if (entry.device)
+                fn(entry.device);
+        });
+    }
+
+    size_t deviceCount() {
+        std::lock_guard<std::mutex> lock(mDevicesMutex);
+        return mDevices.size();
+    }
+
     const ordered_json& knownDevices() {
         return mKnownDevices;
     }
 
+    /* handles stay valid until the device is removed, unlike fds they are never reused */
+    DeviceRegistry::Handle findDevice(const std::string& ip) {
+        std::lock_guard<std::mutex> lock(mDevicesMutex);
+        return mDevices.findByIp(ip);
+    }
+
+    std::shared_ptr<Device> getDevice(DeviceRegistry::Handle handle) {
+        std::lock_guard<std::mutex> lock(mDevicesMutex);
+        return deviceOf(handle);
+    }
+
     std::shared_ptr<Device> getDevice(const std::string& ip) {
-        if (mDevices.count(ip))
-            return mDevices.at(ip);
-        return std::shared_ptr<Device>();
+        std::lock_guard<std::mutex> lock(mDevicesMutex);
+        return deviceOf(mDevices.findByIp(ip));
+    }
+
+    std::shared_ptr<Device> getDeviceById(const std::string& devId) {
+        std::lock_guard<std::mutex> lock(mDevicesMutex);
+        return deviceOf(mDevices.findByDevId(devId));
+    }
+
+    /* the device that is connected with fd */
+    std::shared_ptr<Device> getDeviceByFd(int fd) {
+        std::lock_guard<std::mutex> lock(mDevicesMutex);
+        return deviceOf(mDevices.findByFd(fd));
     }
 
     virtual void handleMessage(MessageEvent& e) override {
         if (e.fd != mSocketFd)
             return;
 
-        /* ignore devices that are already registered */
-        if (mDevices.count(e.addr)) {
-            EV_LOGD(e) << "ignoring known device " << e.addr << std::endl;
+        uint32_t addr;
+        if (!DeviceRegistry::parseIp(e.addr, addr))
             return;
+
+        /* ignore devices that are already registered */
+        {
+            std::lock_guard<std::mutex> lock(mDevicesMutex);
+            if (mDevices.findByIp(addr).isValid()) {
+                TUYACPP_EV_LOGD(e) << "ignoring known device " << e.addr << std::endl;
+                return;
+            }
         }
 
         /* register new device */
-        auto dev = std::make_shared<Device>(mLoop, e.addr, "unknown", "unknown", "unknown", "unknown");
-        EV_LOGI(e) << "new device discovered: " << static_cast<std::string>(*dev) << std::endl;
-        mDevices[e.addr] = std::move(dev);
+        TUYACPP_EV_LOGI(e) << "new device discovered: " << e.addr << std::endl;
+        registerDevice(e.addr, "unknown", "unknown", "unknown", "unknown",
+                       Message::parseVersion(e.msg.data().value("version", ordered_json())));
+    }
+
+    virtual void handleConnected(ConnectedEvent& e) override {
+        std::lock_guard<std::mutex> lock(mDevicesMutex);
+        mDevices.setFd(mDevices.findByIp(e.addr), e.fd);
     }
 
     virtual void handleClose(CloseEvent& e) override {
-        EV_LOGI(e) << static_cast<std::string>(*mDevices[e.addr])
-            << " disconnected" << std::endl;
+        std::lock_guard<std::mutex> lock(mDevicesMutex);
+        const auto handle = mDevices.findByFd(e.fd);
+        const auto* entry = mDevices.get(handle);
+        if (!entry)
+            return;
+        if (entry->device)
+            TUYACPP_EV_LOGI(e) << static_cast<std::string>(*entry->device) << " disconnected" << std::endl;
+        mDevices.setFd(handle, -1);
     }
 
 private:
     void init() {
-        /* attach to loop as promiscuous handler */
-        mLoop.attach(this);
+        /* subscribe to the messages and the connection state of all fds */
+        const uint8_t events = Event::mask(Event::CONNECTED) | Event::mask(Event::MESSAGE) | Event::mask(Event::CLOSING);
+        if (mPool)
+            mPool->attach(this, events);
+        else
+            mLoop.attach(this, events);
 
         /* register all known devices */
-        for (const auto& devDesc : mKnownDevices) {
-            const auto& addr = devDesc["ip"];
-            mDevices[addr] = std::make_shared<Device>(mLoop, addr, devDesc["name"], devDesc["uuid"], devDesc["id"], devDesc["key"]);
+        for (const auto& devDesc : mKnownDevices)
+            registerDevice(devDesc["ip"], devDesc["name"], devDesc["uuid"], devDesc["id"], devDesc["key"],
+                           Message::parseVersion(devDesc.value("version", ordered_json())));
+    }
+
+    ordered_json loadDevices(const std::string& devicesFile) {
+        std::ifstream ifs(devicesFile);
+        if (ifs.is_open())
+            return ordered_json::parse(ifs);
+
+        TUYACPP_LOGE() << "Failed to open file: " << devicesFile << std::endl;
+        return ordered_json::array();
+    }
+
+    /* Devices are created in the thread of the loop they are placed on. Until then, the
+     * address is registered without a device.
+     */
+    void registerDevice(const std::string& ip, const std::string& name, const std::string& gwId, const std::string& devId, const std::string& key,
+                        Message::Version version) {
+        Loop& loop = mPool ? mPool->loopFor(ip) : mLoop;
+
+        std::lock_guard<std::mutex> lock(mDevicesMutex);
+        auto handle = mDevices.findByIp(ip);
+        if (!handle.isValid())
+            handle = mDevices.add(ip, devId);
+        if (!handle.isValid()) {
+            TUYACPP_LOGE() << "invalid device address " << ip << std::endl;
+            return;
         }
+
+        if (loop.isLoopThread()) {
+            mDevices.setDevice(handle, std::make_shared<Device>(loop, ip, name, gwId, devId, key, version));
+            return;
+        }
+
+        /* the handle is stale if the device has been removed meanwhile */
+        loop.post([this, &loop, handle, ip, name, gwId, devId, key, version] () {
+            auto dev = std::make_shared<Device>(loop, ip, name, gwId, devId, key, version);
+            std::lock_guard<std::mutex> lock(mDevicesMutex);
+            mDevices.setDevice(handle, std::move(dev));
+        });
+    }
+
+    std::shared_ptr<Device> deviceOf(DeviceRegistry::Handle handle) const {
+        const auto* entry = mDevices.get(handle);
+        return entry ? entry->device : std::shared_ptr<Device>();
     }
 
     virtual const std::string& TAG() override { static const std::string tag = "SCANNER"; return tag; };
 
+    LoopPool* mPool;
     ordered_json mKnownDevices;
 
-    std::map<std::string, std::shared_ptr<Device>> mDevices;
+    std::mutex mDevicesMutex;
+    DeviceRegistry mDevices;
 };
 
 } // namespace tuya
@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "scanner.hpp"
+
+using namespace tuya;
+
+/* Connects a Scanner to all devices of a devices.json (e.g. the one written by the
+ * simulator), then reports the memory used per connection and the latency of commands.
+ */
+
+typedef std::chrono::steady_clock Clock;
+
+/* devices can be controlled once they have answered the DP_QUERY sent on connect */
+class ConnectionCounter : public Handler {
+public:
+    virtual void handleConnected(ConnectedEvent&) override {
+        mConnected++;
+    }
+
+    virtual void handleMessage(MessageEvent& e) override {
+        if ((e.msg.cmd() == Message::DP_QUERY) || (e.msg.cmd() == Message::DP_QUERY_NEW))
+            mReady++;
+    }
+
+    virtual void handleClose(CloseEvent&) override {
+        mConnected--;
+    }
+
+    long connected() const {
+        return mConnected;
+    }
+
+    long ready() const {
+        return mReady;
+    }
+
+private:
+    std::atomic_long mConnected{0};
+    std::atomic_long mReady{0};
+};
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-t threads] [-r rounds] [-w timeout s] [-c connects] [devices.json]\n", name);
+}
+
+static size_t residentBytes() {
+    size_t pages = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%*u %zu", &pages) != 1)
+            pages = 0;
+        fclose(f);
+    }
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+static double percentile(const std::vector<uint64_t>& sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    return sorted[std::min(sorted.size() - 1, (size_t) (p * sorted.size()))] / 1000.0;
+}
+
+int main(int argc, char* argv[]) {
+    size_t threads = std::thread::hardware_concurrency();
+    size_t rounds = 10;
+    unsigned timeoutS = 60;
+    long maxConnects = -1;
+    std::string devicesFile = "devices.json";
+
+    for (int i = 1; i < argc; i++) {
+        const bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "-t") && hasValue) {
+            threads = strtoul(argv[++i], nullptr, 0);
+        } else if (!strcmp(argv[i], "-r") && hasValue) {
+            rounds = strtoul(argv[++i], nullptr, 0);
+        } else if (!strcmp(argv[i], "-w") && hasValue) {
+            timeoutS = strtoul(argv[++i], nullptr, 0);
+        } else if (!strcmp(argv[i], "-c") && hasValue) {
+            maxConnects = strtol(argv[++i], nullptr, 0);
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            devicesFile = argv[i];
+        }
+    }
+
+    LogStream::setLevel(LogStream::WARNING);
+
+    struct rlimit limit;
+    if (!getrlimit(RLIMIT_NOFILE, &limit)) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    LoopPool pool(threads);
+    if (maxConnects >= 0)
+        pool.setMaxConnectsInProgress(maxConnects);
+    ConnectionCounter counter;
+    pool.attach(&counter, Event::mask(Event::CONNECTED) | Event::mask(Event::MESSAGE) | Event::mask(Event::CLOSING));
+
+    const size_t rssBefore = residentBytes();
+    Scanner scanner(pool, devicesFile);
+    const long count = scanner.knownDevices().size();
+
+    const auto connectStart = Clock::now();
+    pool.start();
+    while ((counter.ready() < count) && (Clock::now() - connectStart < std::chrono::seconds(timeoutS)))
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    const double connectS = std::chrono::duration<double>(Clock::now() - connectStart).count();
+    const size_t rssAfter = residentBytes();
+
+    printf("connected:    %ld of %ld devices in %.2f s on %zu loops\n", counter.connected(), count, connectS, pool.size());
+    printf("memory:       %.1f MB, %.0f bytes per device\n", (rssAfter - rssBefore) / 1e6,
+           count ? (double) (rssAfter - rssBefore) / count : 0.0);
+    const auto connects = pool.connectStats();
+    printf("connects:     %lu attempts, %lu failed (%lu timed out), latency (us) avg %.0f  max %lu\n",
+           (unsigned long) connects.attempts, (unsigned long) connects.failed, (unsigned long) connects.timedOut,
+           connects.connected ? (double) connects.latencyTotalUs / connects.connected : 0.0,
+           (unsigned long) connects.latencyMaxUs);
+
+    std::vector<std::shared_ptr<Device>> devices;
+    devices.reserve(count);
+    scanner.forEachDevice([&devices] (const std::shared_ptr<Device>& device) { devices.push_back(device); });
+
+    /* every round sends one command to every device and waits for all responses */
+    std::mutex mutex;
+    std::vector<uint64_t> latencies;
+    std::atomic<size_t> pending(0);
+    std::atomic<size_t> failed(0);
+    const auto start = Clock::now();
+    for (size_t round = 0; round < rounds; round++) {
+        pending = devices.size();
+        for (auto& device : devices) {
+            const auto sent = Clock::now();
+            device->setBrightness(10 + (round * 97) % 990, [&, sent] (Device::CommandStatus status, const ordered_json&) {
+                const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - sent).count();
+                if (status == Device::CMD_OK) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    latencies.push_back(ns);
+                } else {
+                    failed++;
+                }
+                pending--;
+            });
+        }
+        while (pending)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::sort(latencies.begin(), latencies.end());
+    printf("commands:     %zu ok, %zu failed, %.0f commands/s\n", latencies.size(), failed.load(),
+           seconds > 0 ? latencies.size() / seconds : 0);
+    printf("latency (us): p50 %.0f  p90 %.0f  p99 %.0f  max %.0f\n", percentile(latencies, 0.5),
+           percentile(latencies, 0.9), percentile(latencies, 0.99), percentile(latencies, 1));
+
+    pool.stop();
+    pool.detach(&counter);
+    return 0;
+}
@@ -0,0 +1,159 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "device.hpp"
+#include "loop/capture.hpp"
+
+using namespace tuya;
+
+/* Feeds the stream records of a capture through the receive path of devices (frame parsing,
+ * decryption, Device::handleMessage) as fast as possible. The loop is never run, so no
+ * timers expire and nothing is read from the network. Each device adopts one end of a
+ * socketpair(), so that the commands it sends on connect go nowhere.
+ */
+
+class MessageCounter : public Handler {
+public:
+    virtual void handleMessage(MessageEvent&) override {
+        mMessages++;
+    }
+
+    size_t messages() const {
+        return mMessages;
+    }
+
+private:
+    size_t mMessages = 0;
+};
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-n repeats] <capture> [devices.json]\n", name);
+}
+
+static double percentile(const std::vector<uint64_t>& sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    return sorted[std::min(sorted.size() - 1, (size_t) (p * sorted.size()))];
+}
+
+int main(int argc, char* argv[]) {
+    size_t repeats = 1;
+    const char* capturePath = nullptr;
+    const char* devicesPath = "tinytuya/devices.json";
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && (i + 1 < argc)) {
+            repeats = strtoul(argv[++i], nullptr, 0);
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else if (!capturePath) {
+            capturePath = argv[i];
+        } else {
+            devicesPath = argv[i];
+        }
+    }
+    if (!capturePath) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    LogStream::setLevel(LogStream::WARNING);
+
+    /* load everything up front, so that only the parsing is measured */
+    CaptureReader reader(capturePath);
+    if (!reader.isOpen())
+        return 1;
+    std::vector<Capture::Record> records;
+    Capture::Record record;
+    while (reader.next(record))
+        records.push_back(record);
+
+    std::ifstream ifs(devicesPath);
+    if (!ifs.is_open()) {
+        fprintf(stderr, "failed to open %s\n", devicesPath);
+        return 1;
+    }
+    const ordered_json devicesData = ordered_json::parse(ifs);
+
+    Loop loop;
+    MessageCounter counter;
+    loop.attach(&counter, Event::mask(Event::MESSAGE));
+
+    std::map<std::string, std::unique_ptr<Device>> devices;
+    std::vector<int> peers;
+    for (const auto& devDesc : devicesData) {
+        const std::string ip = devDesc["ip"];
+        if (devices.count(ip))
+            continue;
+
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+            perror("socketpair");
+            return 1;
+        }
+        auto device = std::make_unique<Device>(loop, ip, devDesc["name"], devDesc["uuid"], devDesc["id"], devDesc["key"]);
+        if (device->adopt(fds[0]) < 0)
+            return 1;
+        devices[ip] = std::move(device);
+        peers.push_back(fds[1]);
+    }
+
+    size_t replayed = 0;
+    size_t skipped = 0;
+    size_t bytes = 0;
+    std::vector<uint64_t> latencies;
+    latencies.reserve(records.size() * repeats);
+
+    const size_t messagesBefore = counter.messages();
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repeats; i++) {
+        for (const auto& r : records) {
+            auto it = devices.find(r.addr);
+            if ((r.flags & Capture::DATAGRAM) || (it == devices.end())) {
+                skipped++;
+                continue;
+            }
+
+            const auto t0 = std::chrono::steady_clock::now();
+            it->second->receive(r.data.data(), r.data.size(), r.addr, LogStream::WARNING);
+            const auto t1 = std::chrono::steady_clock::now();
+
+            latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+            bytes += r.data.size();
+            replayed++;
+        }
+    }
+    const auto end = std::chrono::steady_clock::now();
+    const size_t frames = counter.messages() - messagesBefore;
+
+    const double seconds = std::chrono::duration<double>(end - start).count();
+    std::sort(latencies.begin(), latencies.end());
+
+    printf("records:      %zu replayed, %zu skipped (datagrams or unknown devices)\n", replayed, skipped / repeats);
+    printf("frames:       %zu\n", frames);
+    printf("bytes:        %zu\n", bytes);
+    printf("time:         %.3f s\n", seconds);
+    printf("records/s:    %.0f\n", seconds > 0 ? replayed / seconds : 0);
+    printf("frames/s:     %.0f\n", seconds > 0 ? frames / seconds : 0);
+    printf("MB/s:         %.1f\n", seconds > 0 ? bytes / seconds / 1e6 : 0);
+    printf("latency (ns): p50 %.0f  p90 %.0f  p99 %.0f  max %.0f\n", percentile(latencies, 0.5),
+           percentile(latencies, 0.9), percentile(latencies, 0.99), latencies.empty() ? 0.0 : (double) latencies.back());
+
+    loop.detach(&counter);
+    devices.clear();
+    for (int fd : peers)
+        close(fd);
+
+    return 0;
+}
@@ -0,0 +1,8 @@
+TEMPLATE = app
+CONFIG += console c++14
+CONFIG -= app_bundle qt
+
+include(../../tuyacpp.pri)
+
+SOURCES += \
+    main.cpp
@@ -0,0 +1,152 @@
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "loop/looppool.hpp"
+#include "simulator.hpp"
+
+using namespace tuya;
+
+/* Emulates N protocol 3.3, 3.4 or 3.5 bulbs on local addresses, see usage(). The
+ * devices.json that is written on startup can be passed to Scanner to connect to all of them.
+ */
+
+static std::atomic_bool sRunning(true);
+
+static void usage(const char* name) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -n count      number of devices (1)\n"
+            "  -a address    address of the first device, the following ones get consecutive addresses (127.0.1.1)\n"
+            "  -p port       port of the first device (6668)\n"
+            "  -P            give the devices consecutive ports on the same address instead\n"
+            "  -s ms         interval of the STATUS updates pushed by each device, 0 disables them (10000)\n"
+            "  -d ms         interval of the UDP_NEW discovery broadcasts, 0 disables them (5000)\n"
+            "  -b address    where to send the discovery broadcasts to (127.0.0.1)\n"
+            "  -v version    protocol version of the devices: 3.3, 3.4 or 3.5 (3.3)\n"
+            "  -t threads    number of loops (1)\n"
+            "  -o file       devices.json to write (devices.json)\n",
+            name);
+}
+
+/* each simulated device and each client connection need a file descriptor */
+static void raiseFdLimit(size_t needed) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) || (limit.rlim_cur >= needed))
+        return;
+    limit.rlim_cur = std::min<rlim_t>(needed, limit.rlim_max);
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur < needed)
+        fprintf(stderr, "warning: only %lu file descriptors available\n", (unsigned long) limit.rlim_cur);
+}
+
+int main(int argc, char* argv[]) {
+    size_t count = 1;
+    std::string firstAddress = "127.0.1.1";
+    int firstPort = 6668;
+    bool consecutivePorts = false;
+    uint32_t statusIntervalMs = 10000;
+    uint32_t discoveryIntervalMs = 5000;
+    std::string discoveryTarget = "127.0.0.1";
+    Message::Version version = Message::V3_3;
+    size_t threads = 1;
+    std::string devicesFile = "devices.json";
+
+    for (int i = 1; i < argc; i++) {
+        const bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "-n") && hasValue) {
+            count = strtoul(argv[++i], nullptr, 0);
+        } else if (!strcmp(argv[i], "-a") && hasValue) {
+            firstAddress = argv[++i];
+        } else if (!strcmp(argv[i], "-p") && hasValue) {
+            firstPort = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-P")) {
+            consecutivePorts = true;
+        } else if (!strcmp(argv[i], "-s") && hasValue) {
+            statusIntervalMs = strtoul(argv[++i], nullptr, 0);
+        } else if (!strcmp(argv[i], "-d") && hasValue) {
+            discoveryIntervalMs = strtoul(argv[++i], nullptr, 0);
+        } else if (!strcmp(argv[i], "-b") && hasValue) {
+            discoveryTarget = argv[++i];
+        } else if (!strcmp(argv[i], "-v") && hasValue) {
+            version = Message::parseVersion(argv[++i]);
+        } else if (!strcmp(argv[i], "-t") && hasValue) {
+            threads = strtoul(argv[++i], nullptr, 0);
+        } else if (!strcmp(argv[i], "-o") && hasValue) {
+            devicesFile = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    struct in_addr addr;
+    if (inet_pton(AF_INET, firstAddress.c_str(), &addr) != 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* clients closing their connections are not worth a warning here */
+    LogStream::setLevel(LogStream::ERROR);
+    raiseFdLimit(3 * count + 64);
+    signal(SIGINT, [] (int) { sRunning = false; });
+    signal(SIGTERM, [] (int) { sRunning = false; });
+    signal(SIGPIPE, SIG_IGN);
+
+    sim::Stats stats;
+    LoopPool pool(threads);
+    std::vector<std::unique_ptr<sim::Device>> devices;
+    ordered_json devicesData = ordered_json::array();
+
+    const uint32_t first = ntohl(addr.s_addr);
+    for (size_t i = 0; i < count; i++) {
+        struct in_addr deviceAddr;
+        deviceAddr.s_addr = htonl(consecutivePorts ? first : first + i);
+        char ip[INET_ADDRSTRLEN] = { 0 };
+        inet_ntop(AF_INET, &deviceAddr, ip, sizeof(ip));
+        const int port = consecutivePorts ? firstPort + i : firstPort;
+
+        char id[32];
+        char key[17];
+        snprintf(id, sizeof(id), "bfsimulator%09zu", i);
+        snprintf(key, sizeof(key), "%016zx", 0x5117000000000000 + i);
+
+        auto device = std::make_unique<sim::Device>(pool.loop(i % pool.size()), stats, ip, port, id, key, version, statusIntervalMs);
+        int ret = device->listen();
+        if (ret < 0) {
+            fprintf(stderr, "failed to listen on %s:%d: %s\n", ip, port, strerror(-ret));
+            return 1;
+        }
+        devices.push_back(std::move(device));
+        devicesData.push_back({{"name", std::string("sim ") + std::to_string(i)}, {"id", id}, {"uuid", id}, {"key", key}, {"ip", ip}, {"port", port},
+                               {"version", Message::versionString(version)}});
+    }
+
+    std::ofstream(devicesFile) << devicesData.dump(4) << std::endl;
+
+    sim::Discovery discovery(pool.loop(0), stats, devices, discoveryTarget, discoveryIntervalMs);
+
+    pool.start();
+    printf("simulating %zu protocol %s devices on %zu loops, devices written to %s\n", count, Message::versionString(version),
+           pool.size(), devicesFile.c_str());
+
+    while (sRunning) {
+        for (int i = 0; i < 50 && sRunning; i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        printf("connections %zu (accepted %zu), commands %zu, heartbeats %zu, status frames %zu, discovery frames %zu, "
+               "send errors %zu\n", stats.connections.load(), stats.accepted.load(), stats.commands.load(),
+               stats.heartbeats.load(), stats.statusFrames.load(), stats.discoveryFrames.load(), stats.sendErrors.load());
+        fflush(stdout);
+    }
+
+    pool.stop();
+    return 0;
+}
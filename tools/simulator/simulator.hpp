@@ -0,0 +1,406 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "loop/loop.hpp"
+#include "loop/udpserverhandler.hpp"
+#include "protocol/session.hpp"
+
+namespace tuya {
+namespace sim {
+
+/* counters of all simulated devices, updated from all loop threads */
+struct Stats {
+    std::atomic<size_t> connections{0};
+    std::atomic<size_t> accepted{0};
+    std::atomic<size_t> commands{0};
+    std::atomic<size_t> heartbeats{0};
+    std::atomic<size_t> statusFrames{0};
+    std::atomic<size_t> discoveryFrames{0};
+    std::atomic<size_t> sendErrors{0};
+};
+
+/* One client connection of a simulated device, frames are parsed by SocketHandler. The
+ * connections of 3.4 and 3.5 devices answer the session key negotiation themselves and
+ * only pass the other commands on.
+ */
+class Connection : public SocketHandler {
+public:
+    typedef std::function<void(Connection&, const Message&)> MessageCallback_t;
+    typedef std::function<void(Connection&)> CloseCallback_t;
+
+    Connection(Loop& loop, int fd, const std::string& peer, const std::string& key, Message::Version version,
+               MessageCallback_t onMessage, CloseCallback_t onClose)
+        : SocketHandler(loop, key, 0), mPeer(peer), mLocalKey(key), mOnMessage(std::move(onMessage)), mOnClose(std::move(onClose)) {
+        mSocketFd = fd;
+        setVersion(version);
+    }
+
+    virtual int read(char* buf, size_t len, std::string& addr) override {
+        addr.assign(mPeer);
+        return recv(mSocketFd, buf, len, 0);
+    }
+
+    virtual bool hasRetCode() const override {
+        return false;
+    }
+
+    virtual void handleMessage(MessageEvent& e) override {
+        if (e.fd != mSocketFd)
+            return;
+
+        if ((version() >= Message::V3_4) && (e.msg.cmd() == Message::SESS_KEY_NEG_START))
+            startNegotiation(e.msg);
+        else if ((version() >= Message::V3_4) && (e.msg.cmd() == Message::SESS_KEY_NEG_FINISH))
+            finishNegotiation(e.msg);
+        else
+            mOnMessage(*this, e.msg);
+    }
+
+    /* stop reading right away, the socket is closed when the connection is destroyed */
+    virtual void handleClose(CloseEvent& e) override {
+        if (e.fd != mSocketFd)
+            return;
+        mLoop.detach(mSocketFd);
+        mOnClose(*this);
+    }
+
+    /* 3.4 and 3.5 clients can only be sent to once they have a session key */
+    bool hasSession() const {
+        return (version() < Message::V3_4) || mHasSession;
+    }
+
+    /* frames that do not fit into the socket buffer are dropped, like a device would */
+    int send(Message& msg) {
+        const std::string frame = msg.serialize(mCipher, false);
+        int ret = ::send(mSocketFd, frame.data(), frame.length(), MSG_NOSIGNAL);
+        if ((ret < 0) || ((size_t) ret != frame.length())) {
+            TUYACPP_LOGD() << "failed to send to " << mPeer << std::endl;
+            return -EIO;
+        }
+        return 0;
+    }
+
+private:
+    LOG_MEMBERS(SIM CONNECTION);
+
+    /* a client may renegotiate at any time, which starts over with the local key */
+    void startNegotiation(const Message& msg) {
+        if (!msg.isRaw() || (msg.rawPayload().length() != Session::NONCE_SIZE) || (mCipher.setKey(mLocalKey) < 0)) {
+            TUYACPP_LOGW() << "invalid " << msg.cmdString() << " from " << mPeer << std::endl;
+            return;
+        }
+
+        mHasSession = false;
+        mClientNonce = msg.rawPayload();
+        mDeviceNonce = Session::nonce();
+        const std::string payload = mDeviceNonce + Session::hmac(mCipher, mClientNonce);
+        auto reply = Session::rawMessage(version(), msg.seqNo(), Message::SESS_KEY_NEG_RESP, payload.data(), payload.length());
+        send(*reply);
+    }
+
+    void finishNegotiation(const Message& msg) {
+        if (!msg.isRaw() || (msg.rawPayload().length() != Cipher::HMAC_SIZE) || mDeviceNonce.empty() ||
+            !mCipher.verifyHmac(mDeviceNonce.data(), mDeviceNonce.length(), msg.rawPayload().data())) {
+            TUYACPP_LOGW() << "invalid " << msg.cmdString() << " from " << mPeer << std::endl;
+            return;
+        }
+
+        const std::string key = Session::deriveKey(mCipher, version(), mClientNonce, mDeviceNonce);
+        if (key.empty() || (mCipher.setKey(key) < 0))
+            TUYACPP_LOGE() << "failed to derive the session key for " << mPeer << std::endl;
+        else
+            mHasSession = true;
+        mDeviceNonce.clear();
+    }
+
+    const std::string mPeer;
+    const std::string mLocalKey;
+    std::string mClientNonce;
+    std::string mDeviceNonce;
+    bool mHasSession = false;
+    MessageCallback_t mOnMessage;
+    CloseCallback_t mOnClose;
+};
+
+/* A protocol 3.3, 3.4 or 3.5 bulb that listens on ip:port. It answers HEART_BEAT, DP_QUERY
+ * and CONTROL, or DP_QUERY_NEW and CONTROL_NEW, and pushes a STATUS update to all of its clients every
+ * statusIntervalMs if that is not 0.
+ */
+class Device : public Handler {
+public:
+    Device(Loop& loop, Stats& stats, const std::string& ip, int port, const std::string& id, const std::string& key,
+           Message::Version version, uint32_t statusIntervalMs)
+        : mLoop(loop), mStats(stats), mIp(ip), mPort(port), mId(id), mKey(key), mVersion(version),
+          mStatusIntervalMs(statusIntervalMs), mListenFd(-1),
+          mDps{{"20", false}, {"21", "white"}, {"22", 500}, {"23", 500}} {
+    }
+
+    ~Device() {
+        mLoop.cancel(mStatusTimer);
+        if (mListenFd >= 0) {
+            mLoop.detach(mListenFd);
+            close(mListenFd);
+        }
+        mStats.connections -= mConnections.size();
+    }
+
+    const std::string& ip() const {
+        return mIp;
+    }
+
+    int port() const {
+        return mPort;
+    }
+
+    const std::string& id() const {
+        return mId;
+    }
+
+    const std::string& key() const {
+        return mKey;
+    }
+
+    Message::Version version() const {
+        return mVersion;
+    }
+
+    int listen() {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(mPort);
+        if (inet_pton(AF_INET, mIp.c_str(), &addr.sin_addr) != 1)
+            return -EINVAL;
+
+        int one = 1;
+        mListenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+        if ((mListenFd < 0)
+            || (setsockopt(mListenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0)
+            || (bind(mListenFd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+            || (::listen(mListenFd, SOMAXCONN) < 0)) {
+            int ret = -errno;
+            TUYACPP_LOGE() << "failed to listen on " << mIp << ":" << mPort << std::endl;
+            if (mListenFd >= 0)
+                close(mListenFd);
+            mListenFd = -1;
+            return ret;
+        }
+
+        int ret = mLoop.attach(mListenFd, this);
+        if (ret < 0)
+            return ret;
+
+        /* spread the status updates of all devices over the interval */
+        if (mStatusIntervalMs)
+            mStatusTimer = mLoop.pushWork([this] () { pushStatus(); }, random(mStatusIntervalMs));
+        return 0;
+    }
+
+    virtual void handleReadable(ReadableEvent& e) override {
+        if (e.fd != mListenFd)
+            return;
+
+        while (true) {
+            struct sockaddr_in addr;
+            socklen_t len = sizeof(addr);
+            int fd = accept4(mListenFd, (struct sockaddr *) &addr, &len, SOCK_NONBLOCK);
+            if (fd < 0) {
+                if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+                    TUYACPP_EV_LOGE(e) << "accept failed: " << strerror(errno) << std::endl;
+                return;
+            }
+
+            char peer[INET_ADDRSTRLEN] = { 0 };
+            inet_ntop(AF_INET, &addr.sin_addr, peer, sizeof(peer));
+            auto conn = std::make_unique<Connection>(mLoop, fd, peer, mKey, mVersion,
+                [this] (Connection& c, const Message& msg) { handleCommand(c, msg); },
+                [this] (Connection& c) { removeConnection(c); });
+            if (mLoop.attach(fd, conn.get()) < 0)
+                continue;
+
+            mConnections[fd] = std::move(conn);
+            mStats.connections++;
+            mStats.accepted++;
+        }
+    }
+
+private:
+    LOG_MEMBERS(SIM DEVICE);
+
+    uint32_t random(uint32_t max) {
+        static thread_local std::minstd_rand sRandom(std::random_device{}());
+        return max ? sRandom() % max : 0;
+    }
+
+    void handleCommand(Connection& conn, const Message& msg) {
+        if (msg.cmd() == Message::HEART_BEAT) {
+            mStats.heartbeats++;
+            auto reply = Session::message(mVersion, msg.seqNo(), msg.cmd(), ordered_json::object());
+            if (conn.send(*reply) < 0)
+                mStats.sendErrors++;
+            return;
+        }
+
+        mStats.commands++;
+        switch (msg.cmd()) {
+        case Message::DP_QUERY:
+        case Message::DP_QUERY_NEW: {
+            auto reply = Session::message(mVersion, msg.seqNo(), msg.cmd(), ordered_json{{"devId", mId}, {"dps", mDps}});
+            if (conn.send(*reply) < 0)
+                mStats.sendErrors++;
+            break;
+        }
+        case Message::CONTROL:
+        case Message::CONTROL_NEW: {
+            auto reply = Session::message(mVersion, msg.seqNo(), msg.cmd(), ordered_json::object());
+            if (conn.send(*reply) < 0)
+                mStats.sendErrors++;
+
+            /* CONTROL_NEW has the datapoints under "data" */
+            const auto& data = (msg.cmd() == Message::CONTROL_NEW) ? msg.data().value("data", ordered_json()) : msg.data();
+            auto dps = data.find("dps");
+            if ((dps == data.end()) || !dps->is_object())
+                break;
+            for (const auto& dp : dps->items())
+                mDps[dp.key()] = dp.value();
+            broadcastStatus(*dps);
+            break;
+        }
+        default:
+            TUYACPP_LOGW() << "unsupported command " << msg.cmdString() << std::endl;
+            break;
+        }
+    }
+
+    /* the connection is removed after the close event has been dispatched */
+    void removeConnection(Connection& conn) {
+        const int fd = conn.fd();
+        mLoop.pushWork([this, fd] () {
+            if (mConnections.erase(fd))
+                mStats.connections--;
+        });
+    }
+
+    void broadcastStatus(const ordered_json& dps) {
+        const uint32_t t = time(NULL);
+        auto status = Session::message(mVersion, 0, Message::STATUS, (mVersion >= Message::V3_4)
+            ? ordered_json{{"protocol", 4}, {"t", t}, {"data", {{"dps", dps}}}}
+            : ordered_json{{"devId", mId}, {"dps", dps}, {"t", t}});
+        for (auto& it : mConnections) {
+            if (!it.second->hasSession())
+                continue;
+            if (it.second->send(*status) < 0)
+                mStats.sendErrors++;
+            else
+                mStats.statusFrames++;
+        }
+    }
+
+    /* pretend that someone turned the dimmer */
+    void pushStatus() {
+        mDps["22"] = 10 + random(991);
+        broadcastStatus(ordered_json{{"22", mDps["22"]}});
+        mStatusTimer = mLoop.pushWork([this] () { pushStatus(); }, mStatusIntervalMs);
+    }
+
+    Loop& mLoop;
+    Stats& mStats;
+    const std::string mIp;
+    const int mPort;
+    const std::string mId;
+    const std::string mKey;
+    const Message::Version mVersion;
+    const uint32_t mStatusIntervalMs;
+    int mListenFd;
+    ordered_json mDps;
+    std::map<int, std::unique_ptr<Connection>> mConnections;
+    TimerQueue::Handle mStatusTimer = TimerQueue::INVALID_HANDLE;
+};
+
+/* Sends the UDP_NEW frames of all devices to target:6667 every intervalMs, also for 3.5
+ * devices, which would announce themselves with 6699 frames on port 7000. Each frame has
+ * the address of its device as source address (IP_PKTINFO), which only works for local
+ * addresses such as 127.0.0.0/8.
+ */
+class Discovery : public UDPServerHandler {
+public:
+    static const int PORT = 6667;
+
+    Discovery(Loop& loop, Stats& stats, const std::vector<std::unique_ptr<Device>>& devices, const std::string& target, uint32_t intervalMs)
+        : UDPServerHandler(loop, 0, false), mStats(stats), mDevices(devices), mIntervalMs(intervalMs) {
+        memset(&mTarget, 0, sizeof(mTarget));
+        mTarget.sin_family = AF_INET;
+        mTarget.sin_port = htons(PORT);
+        if (inet_pton(AF_INET, target.c_str(), &mTarget.sin_addr) != 1)
+            throw std::runtime_error("Invalid address");
+
+        if (mIntervalMs)
+            mTimer = mLoop.pushWork([this] () { announce(); }, 0);
+    }
+
+    ~Discovery() {
+        mLoop.cancel(mTimer);
+    }
+
+private:
+    LOG_MEMBERS(SIM DISCOVERY);
+
+    void announce() {
+        mTimer = mLoop.pushWork([this] () { announce(); }, mIntervalMs);
+        if (mSocketFd < 0)
+            return;
+
+        for (const auto& device : mDevices) {
+            Message55AA msg(0, Message::UDP_NEW, ordered_json{
+                {"ip", device->ip()}, {"gwId", device->id()}, {"active", 2}, {"ability", 0}, {"mode", 0},
+                {"encrypt", true}, {"productKey", "simulator"}, {"version", Message::versionString(device->version())}
+            });
+            if (sendFrom(device->ip(), msg.serialize(mCipher, false)) < 0)
+                mStats.sendErrors++;
+            else
+                mStats.discoveryFrames++;
+        }
+    }
+
+    int sendFrom(const std::string& ip, const std::string& frame) {
+        char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+        memset(control, 0, sizeof(control));
+
+        struct iovec iov = { const_cast<char*>(frame.data()), frame.length() };
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = &mTarget;
+        hdr.msg_namelen = sizeof(mTarget);
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = IPPROTO_IP;
+        cmsg->cmsg_type = IP_PKTINFO;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+        struct in_pktinfo* info = reinterpret_cast<struct in_pktinfo*>(CMSG_DATA(cmsg));
+        inet_pton(AF_INET, ip.c_str(), &info->ipi_spec_dst);
+
+        return (sendmsg(mSocketFd, &hdr, MSG_DONTWAIT) < 0) ? -errno : 0;
+    }
+
+    Stats& mStats;
+    const std::vector<std::unique_ptr<Device>>& mDevices;
+    const uint32_t mIntervalMs;
+    struct sockaddr_in mTarget;
+    TimerQueue::Handle mTimer = TimerQueue::INVALID_HANDLE;
+};
+
+} // namespace sim
+} // namespace tuya
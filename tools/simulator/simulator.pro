@@ -0,0 +1,11 @@
+TEMPLATE = app
+CONFIG += console c++14
+CONFIG -= app_bundle qt
+
+include(../../tuyacpp.pri)
+
+HEADERS += \
+    simulator.hpp
+
+SOURCES += \
+    main.cpp
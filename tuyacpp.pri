@@ -1,19 +1,33 @@
-include(crc.pri)
 include(json.pri)
 
 INCLUDEPATH += $$PWD
 
 HEADERS += \
+    $$PWD/loop/capture.hpp \
+    $$PWD/loop/connectmanager.hpp \
     $$PWD/loop/event.hpp \
     $$PWD/loop/handler.hpp \
     $$PWD/loop/sockethandler.hpp \
     $$PWD/loop/loop.hpp \
+    $$PWD/loop/looppool.hpp \
+    $$PWD/loop/mpscqueue.hpp \
+    $$PWD/loop/poller.hpp \
+    $$PWD/loop/receivebuffer.hpp \
+    $$PWD/loop/sendbuffer.hpp \
     $$PWD/loop/tcpclienthandler.hpp \
+    $$PWD/loop/timerqueue.hpp \
     $$PWD/loop/udpserverhandler.hpp \
+    $$PWD/protocol/cipher.hpp \
+    $$PWD/protocol/crc32.hpp \
+    $$PWD/protocol/dps.hpp \
+    $$PWD/protocol/dpsdecoder.hpp \
     $$PWD/protocol/message.hpp \
     $$PWD/protocol/message55aa.hpp \
+    $$PWD/protocol/message6699.hpp \
+    $$PWD/protocol/session.hpp \
     $$PWD/logging.hpp \
     $$PWD/device.hpp \
+    $$PWD/deviceregistry.hpp \
     $$PWD/scanner.hpp \
     $$PWD/bindings/qt.hpp
 